@@ -0,0 +1,607 @@
+// Runs standard workloads against idx_seq_file, one tab separated line per
+// workload and configuration. Lists separated by commas run every combination.
+// usage: idx_seq_bench [-n records,...] [-o ops] [-a alpha,...] [-b beta,...]
+//                      [-p records_per_page,...] [-m] [-f] [-l] [-g group_commit] [-r policy]
+//                      [-t threads] [-w workload,...] [-d directory]
+// The gets of get_hit and get_miss are split between -t threads.
+#include <idx_seq_file.h>
+#include <stats.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_RECORDS 20000
+#define DEFAULT_OPS 20000
+#define MAX_VALUES 16
+#define SCAN_LENGTH 100 // records returned by a scan
+#define REORGANIZE_RUNS 5
+#define HOT_PERCENT 90 // of the skewed inserts, they go to the first tenth of the keys
+
+struct bench_config {
+    size_t records;
+    size_t ops;
+    struct idx_seq_file_options options;
+    size_t threads; // running the gets, the file is opened thread_safe if more than one
+    const char *policy; // reorganize policy, see reorganize_policy()
+    char index_path[4096];
+    char data_path[4096];
+    char wal_path[4096 + sizeof(".wal")]; // the data path with .wal appended
+};
+
+// Timed operations of a workload, setup between the phases isn't counted
+struct bench_run {
+    uint64_t *latencies;
+    size_t ops;
+    uint64_t ns;
+    uint64_t disk_ops;
+    uint64_t phase_start;
+    uint64_t phase_disk_ops;
+};
+
+typedef int (*workload_fn)(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run);
+
+// Records get even keys, the odd ones are never there
+static int32_t key_of(size_t i)
+{
+    return 2 * (int32_t)i + 2;
+}
+
+static void fill_record(struct record *r, int32_t key)
+{
+    memset(r, 0x0, RECORD_SIZE);
+    r->key = key;
+    for (size_t i = 0; i < RECORD_LEN; i++) {
+        r->numbers[i] = key + i;
+    }
+}
+
+static size_t random_index(size_t n)
+{
+    return (((size_t)rand() << 31) ^ rand()) % n;
+}
+
+static void shuffle(int32_t *keys, size_t n)
+{
+    for (size_t i = n; i > 1; i--) {
+        size_t j = random_index(i);
+        int32_t tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static int32_t *shuffled_keys(size_t n)
+{
+    int32_t *keys = malloc(n * sizeof(int32_t));
+    if (keys == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = key_of(i);
+    }
+    shuffle(keys, n);
+
+    return keys;
+}
+
+static uint64_t disk_operations(struct idx_seq_file *file)
+{
+    struct stats stats;
+    idx_seq_file_stats(file, &stats);
+    return stats.page_reads + stats.page_writes + stats.index_reads + stats.index_writes + stats.log_syncs;
+}
+
+static void phase_begin(struct bench_run *run, struct idx_seq_file *file)
+{
+    run->phase_disk_ops = disk_operations(file);
+    run->phase_start = stats_now();
+}
+
+static void phase_end(struct bench_run *run, struct idx_seq_file *file)
+{
+    run->ns += stats_now() - run->phase_start;
+    run->disk_ops += disk_operations(file) - run->phase_disk_ops;
+}
+
+static void op_end(struct bench_run *run, uint64_t start)
+{
+    run->latencies[run->ops++] = stats_now() - start;
+}
+
+// Inserts all records in random order, the way most files come to be
+static int populate(struct idx_seq_file *file, const struct bench_config *config)
+{
+    int32_t *keys = shuffled_keys(config->records);
+    if (keys == NULL) {
+        return -1;
+    }
+
+    int rc = 0;
+    struct record r;
+    for (size_t i = 0; i < config->records && rc == 0; i++) {
+        fill_record(&r, keys[i]);
+        rc = add_record(file, &r);
+    }
+
+    free(keys);
+    return rc;
+}
+
+static int insert_keys(struct idx_seq_file *file, struct bench_run *run, const int32_t *keys, size_t n)
+{
+    struct record r;
+    phase_begin(run, file);
+    for (size_t i = 0; i < n; i++) {
+        fill_record(&r, keys[i]);
+        uint64_t start = stats_now();
+        if (add_record(file, &r) != 0) {
+            return -1;
+        }
+        op_end(run, start);
+    }
+    phase_end(run, file);
+
+    return 0;
+}
+
+static int seq_insert(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    int32_t *keys = malloc(config->records * sizeof(int32_t));
+    if (keys == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < config->records; i++) {
+        keys[i] = key_of(i);
+    }
+
+    int rc = insert_keys(file, run, keys, config->records);
+    free(keys);
+    return rc;
+}
+
+static int rand_insert(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    int32_t *keys = shuffled_keys(config->records);
+    if (keys == NULL) {
+        return -1;
+    }
+
+    int rc = insert_keys(file, run, keys, config->records);
+    free(keys);
+    return rc;
+}
+
+// One of the threads of get_keys(), timing its gets into its own slice of the latencies
+struct get_thread {
+    struct idx_seq_file *file;
+    const struct bench_config *config;
+    uint64_t *latencies;
+    size_t ops;
+    unsigned int seed;
+    int expected;
+    int32_t offset;
+    int rc;
+};
+
+static void *get_thread_run(void *arg)
+{
+    struct get_thread *t = arg;
+    struct record r;
+    for (size_t i = 0; i < t->ops; i++) {
+        size_t index = (((size_t)rand_r(&t->seed) << 31) ^ rand_r(&t->seed)) % t->config->records;
+        int32_t key = key_of(index) + t->offset;
+        uint64_t start = stats_now();
+        if (get_record(t->file, key, &r) != t->expected) {
+            t->rc = -1;
+            break;
+        }
+        t->latencies[i] = stats_now() - start;
+    }
+
+    return NULL;
+}
+
+static int get_keys(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run, int expected,
+                    int32_t offset)
+{
+    if (populate(file, config) != 0) {
+        return -1;
+    }
+
+    if (config->threads > 1) {
+        struct get_thread threads[config->threads];
+        pthread_t ids[config->threads];
+        size_t started = 0;
+        int rc = 0;
+        phase_begin(run, file);
+        for (size_t i = 0; i < config->threads; i++) {
+            size_t first = config->ops * i / config->threads;
+            threads[i] = (struct get_thread){ .file = file, .config = config, .latencies = run->latencies + first,
+                                              .ops = config->ops * (i + 1) / config->threads - first,
+                                              .seed = i + 1, .expected = expected, .offset = offset };
+            if (pthread_create(&ids[i], NULL, get_thread_run, &threads[i]) != 0) {
+                rc = -1;
+                break;
+            }
+            started++;
+        }
+        for (size_t i = 0; i < started; i++) {
+            pthread_join(ids[i], NULL);
+            rc |= threads[i].rc;
+        }
+        phase_end(run, file);
+        run->ops = config->ops;
+
+        return rc;
+    }
+
+    struct record r;
+    phase_begin(run, file);
+    for (size_t i = 0; i < config->ops; i++) {
+        int32_t key = key_of(random_index(config->records)) + offset;
+        uint64_t start = stats_now();
+        if (get_record(file, key, &r) != expected) {
+            return -1;
+        }
+        op_end(run, start);
+    }
+    phase_end(run, file);
+
+    return 0;
+}
+
+static int get_hit(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    return get_keys(file, config, run, 0, 0);
+}
+
+static int get_miss(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    return get_keys(file, config, run, -1, 1);
+}
+
+static int delete(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    int32_t *keys = shuffled_keys(config->records);
+    if (keys == NULL || populate(file, config) != 0) {
+        free(keys);
+        return -1;
+    }
+
+    int rc = 0;
+    phase_begin(run, file);
+    for (size_t i = 0; i < config->records && rc == 0; i++) {
+        uint64_t start = stats_now();
+        rc = delete_record(file, keys[i]);
+        op_end(run, start);
+    }
+    phase_end(run, file);
+
+    free(keys);
+    return rc;
+}
+
+// Gets with probability read_percent, otherwise a record is added or removed
+static int mixed(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run,
+                 int read_percent)
+{
+    bool *present = malloc(config->records * sizeof(bool));
+    if (present == NULL || populate(file, config) != 0) {
+        free(present);
+        return -1;
+    }
+    for (size_t i = 0; i < config->records; i++) {
+        present[i] = true;
+    }
+
+    int rc = 0;
+    struct record r;
+    phase_begin(run, file);
+    for (size_t i = 0; i < config->ops && rc == 0; i++) {
+        size_t k = random_index(config->records);
+        bool read = (rand() % 100 < read_percent);
+        uint64_t start = stats_now();
+        if (read) {
+            rc = (get_record(file, key_of(k), &r) == 0) == present[k] ? 0 : -1;
+        } else if (present[k]) {
+            rc = delete_record(file, key_of(k));
+        } else {
+            fill_record(&r, key_of(k));
+            rc = add_record(file, &r);
+        }
+        op_end(run, start);
+        if (!read) {
+            present[k] = !present[k];
+        }
+    }
+    phase_end(run, file);
+
+    free(present);
+    return rc;
+}
+
+static int mixed_90(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    return mixed(file, config, run, 90);
+}
+
+static int mixed_50(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    return mixed(file, config, run, 50);
+}
+
+// A scan returns SCAN_LENGTH records starting at a random one
+static int scan(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    if (populate(file, config) != 0) {
+        return -1;
+    }
+
+    size_t scans = config->ops / SCAN_LENGTH ? config->ops / SCAN_LENGTH : 1;
+    struct record r;
+    phase_begin(run, file);
+    for (size_t i = 0; i < scans; i++) {
+        int32_t lower = key_of(random_index(config->records));
+        uint64_t start = stats_now();
+
+        struct idx_seq_cursor cursor;
+        if (idx_seq_cursor_open(file, &cursor, lower, lower + 2 * SCAN_LENGTH - 1) != 0) {
+            return -1;
+        }
+        while (idx_seq_cursor_next(&cursor, &r) == 0) {
+        }
+        idx_seq_cursor_close(&cursor);
+
+        op_end(run, start);
+    }
+    phase_end(run, file);
+
+    return 0;
+}
+
+// Adds ops records with odd keys, most of them to the first tenth of the file
+static int skew_insert(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    size_t hot = config->records / 10 ? config->records / 10 : 1;
+    bool *present = calloc(config->records, sizeof(bool));
+    if (present == NULL || populate(file, config) != 0) {
+        free(present);
+        return -1;
+    }
+
+    int rc = 0;
+    struct record r;
+    phase_begin(run, file);
+    for (size_t i = 0; i < config->ops && rc == 0; i++) {
+        size_t k = (rand() % 100 < HOT_PERCENT) ? random_index(hot) : random_index(config->records);
+        if (present[k]) {
+            continue;
+        }
+        present[k] = true;
+
+        fill_record(&r, key_of(k) + 1);
+        uint64_t start = stats_now();
+        rc = add_record(file, &r);
+        op_end(run, start);
+    }
+    phase_end(run, file);
+
+    free(present);
+    return rc;
+}
+
+// Each run adds a tenth of the records with odd keys and then reorganizes
+static int reorganize_file(struct idx_seq_file *file, const struct bench_config *config, struct bench_run *run)
+{
+    if (populate(file, config) != 0) {
+        return -1;
+    }
+
+    struct record r;
+    for (size_t n = 0; n < REORGANIZE_RUNS; n++) {
+        for (size_t i = n; i < config->records; i += 10 * REORGANIZE_RUNS) {
+            fill_record(&r, key_of(i) + 1);
+            if (add_record(file, &r) != 0) {
+                return -1;
+            }
+        }
+
+        phase_begin(run, file);
+        uint64_t start = stats_now();
+        if (reorganize(file) != 0) {
+            return -1;
+        }
+        op_end(run, start);
+        phase_end(run, file);
+    }
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    workload_fn fn;
+} workloads[] = {
+    { "seq_insert", seq_insert },
+    { "rand_insert", rand_insert },
+    { "get_hit", get_hit },
+    { "get_miss", get_miss },
+    { "delete", delete },
+    { "mixed_90", mixed_90 },
+    { "mixed_50", mixed_50 },
+    { "scan", scan },
+    { "skew_insert", skew_insert },
+    { "reorganize", reorganize_file },
+};
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a;
+    uint64_t lb = *(const uint64_t *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    return n ? sorted[(size_t)(p * (n - 1))] : 0;
+}
+
+static int run_workload(size_t w, const struct bench_config *config)
+{
+    size_t capacity = config->records > config->ops ? config->records : config->ops;
+    struct bench_run run = {};
+    run.latencies = malloc(capacity * sizeof(uint64_t));
+    if (run.latencies == NULL) {
+        return -1;
+    }
+
+    unlink(config->index_path);
+    unlink(config->data_path);
+    unlink(config->wal_path);
+
+    struct idx_seq_file file;
+    int rc = idx_seq_file_init_with_options(&file, config->index_path, config->data_path, &config->options);
+    if (rc == 0) {
+        srand(1);
+        rc = workloads[w].fn(&file, config, &run);
+        idx_seq_file_close(&file);
+    }
+    unlink(config->index_path);
+    unlink(config->data_path);
+    unlink(config->wal_path);
+
+    if (rc != 0) {
+        fprintf(stderr, "%s failed\n", workloads[w].name);
+        free(run.latencies);
+        return -1;
+    }
+
+    qsort(run.latencies, run.ops, sizeof(uint64_t), compare_latencies);
+    printf("%s\t%zu\t%.2f\t%.2f\t%s\t%d\t%d\t%zu\t%d\t%zu\t%zu\t%zu\t%.0f\t%llu\t%llu\t%llu\t%llu\t%.3f\n", workloads[w].name,
+           config->records, config->options.alpha, config->options.beta, config->policy, config->options.adaptive_fill,
+           config->options.local_overflow, config->options.records_per_page, config->options.use_mmap,
+           config->options.use_wal ? config->options.wal_group_commit : 0, config->threads, run.ops,
+           run.ops / (run.ns / 1e9),
+           (unsigned long long)percentile(run.latencies, run.ops, 0.5),
+           (unsigned long long)percentile(run.latencies, run.ops, 0.9),
+           (unsigned long long)percentile(run.latencies, run.ops, 0.99),
+           (unsigned long long)percentile(run.latencies, run.ops, 1.0), (double)run.disk_ops / run.ops);
+    fflush(stdout);
+
+    free(run.latencies);
+    return 0;
+}
+
+// Parses a comma separated list of numbers, returns how many there were
+static size_t parse_list(const char *arg, double *values)
+{
+    size_t n = 0;
+    char *end;
+    while (n < MAX_VALUES) {
+        values[n++] = strtod(arg, &end);
+        if (*end != ',') {
+            break;
+        }
+        arg = end + 1;
+    }
+
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    double records[MAX_VALUES] = { DEFAULT_RECORDS };
+    double alphas[MAX_VALUES] = { ALPHA };
+    double betas[MAX_VALUES] = { BETA };
+    double pages[MAX_VALUES] = { RECORDS_PER_PAGE };
+    size_t n_records = 1, n_alphas = 1, n_betas = 1, n_pages = 1;
+    const char *selected = NULL;
+    const char *dir = ".";
+
+    struct bench_config config = {};
+    config.ops = DEFAULT_OPS;
+    config.threads = 1;
+    config.options.buffer_pool_pages = BUFFER_POOL_PAGES;
+    config.options.readahead_pages = READAHEAD_PAGES;
+    config.policy = "cost";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:a:b:p:mflg:r:t:w:d:")) != -1) {
+        switch (opt) {
+        case 'n': n_records = parse_list(optarg, records); break;
+        case 'o': config.ops = strtoul(optarg, NULL, 10); break;
+        case 'a': n_alphas = parse_list(optarg, alphas); break;
+        case 'b': n_betas = parse_list(optarg, betas); break;
+        case 'p': n_pages = parse_list(optarg, pages); break;
+        case 'm': config.options.use_mmap = true; break;
+        case 'f': config.options.adaptive_fill = true; break;
+        case 'l': config.options.local_overflow = true; break;
+        case 'g':
+            config.options.use_wal = true;
+            config.options.wal_group_commit = strtoul(optarg, NULL, 10);
+            break;
+        case 'r': config.policy = optarg; break;
+        case 't': config.threads = strtoul(optarg, NULL, 10); break;
+        case 'w': selected = optarg; break;
+        case 'd': dir = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n records,...] [-o ops] [-a alpha,...] [-b beta,...] "
+                    "[-p records_per_page,...] [-m] [-f] [-l] [-g group_commit] [-r policy] [-t threads] "
+                    "[-w workload,...] [-d directory]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.threads == 0) {
+        config.threads = 1;
+    }
+    config.options.thread_safe = config.threads > 1;
+
+    config.options.reorganize_policy = reorganize_policy(config.policy);
+    if (config.options.reorganize_policy == NULL) {
+        fprintf(stderr, "Unknown reorganize policy: %s\n", config.policy);
+        return 1;
+    }
+
+    snprintf(config.index_path, sizeof(config.index_path), "%s/bench_index.bin", dir);
+    snprintf(config.data_path, sizeof(config.data_path), "%s/bench_data.bin", dir);
+    snprintf(config.wal_path, sizeof(config.wal_path), "%s.wal", config.data_path);
+
+    printf("workload\trecords\talpha\tbeta\tpolicy\tadaptive_fill\tlocal_overflow\trecords_per_page\tmmap\twal\tthreads"
+           "\tops\tops_per_sec\tp50_ns\tp90_ns\tp99_ns\tmax_ns\tdisk_ops_per_op\n");
+
+    int failed = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        // match whole names in the list
+        if (selected != NULL) {
+            size_t len = strlen(workloads[w].name);
+            const char *p = strstr(selected, workloads[w].name);
+            while (p != NULL && !((p == selected || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))) {
+                p = strstr(p + 1, workloads[w].name);
+            }
+            if (p == NULL) {
+                continue;
+            }
+        }
+
+        for (size_t r = 0; r < n_records; r++) {
+            for (size_t a = 0; a < n_alphas; a++) {
+                for (size_t b = 0; b < n_betas; b++) {
+                    for (size_t p = 0; p < n_pages; p++) {
+                        config.records = records[r];
+                        config.options.alpha = alphas[a];
+                        config.options.beta = betas[b];
+                        config.options.records_per_page = pages[p];
+                        failed |= run_workload(w, &config) != 0;
+                    }
+                }
+            }
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,96 @@
+// Compares the key search kernels against the plain loop they replace.
+// usage: search_bench [searches]
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_SEARCHES 2000000
+
+// The loop pages were searched with before the kernels
+static size_t loop_lower_bound(const int32_t *keys, size_t n, int32_t key)
+{
+    size_t idx = 0;
+    while (idx < n && keys[idx] < key) {
+        idx++;
+    }
+
+    return idx;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t searches = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_SEARCHES;
+    const size_t sizes[] = { 4, 10, 16, 32, 64, 128, 256, 1024, 4096, 65536 };
+    const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+    int32_t *queries = malloc(searches * sizeof(int32_t));
+    if (queries == NULL) {
+        return 1;
+    }
+
+    printf("keys\tkernel\tns_per_search\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        int32_t *keys = malloc(n * sizeof(int32_t));
+        if (keys == NULL) {
+            return 1;
+        }
+
+        // even keys, queries hit and miss them equally often
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = 2 * (int32_t)i + 2;
+        }
+        srand(n);
+        for (size_t i = 0; i < searches; i++) {
+            queries[i] = rand() % (2 * n + 2) + 1;
+        }
+
+        volatile size_t sink = 0;
+
+        // linear scans of the biggest array take too long
+        if (n <= 4096) {
+            double start = now();
+            for (size_t i = 0; i < searches; i++) {
+                sink += loop_lower_bound(keys, n, queries[i]);
+            }
+            printf("%zu\tloop\t%.2f\n", n, (now() - start) * 1e9 / searches);
+        }
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            search_kernel_fn kernel = search_kernel(kernels[k]);
+            if (kernel == NULL) {
+                printf("%zu\t%s\tunsupported\n", n, kernels[k]);
+                continue;
+            }
+
+            if (n <= 4096) {
+                double start = now();
+                for (size_t i = 0; i < searches; i++) {
+                    sink += kernel(keys, n, queries[i]);
+                }
+                printf("%zu\t%s\t%.2f\n", n, kernels[k], (now() - start) * 1e9 / searches);
+            }
+        }
+
+        // what pages and the index actually use: binary search narrowing plus the best kernel
+        double start = now();
+        for (size_t i = 0; i < searches; i++) {
+            sink += search_lower_bound(keys, n, queries[i]);
+        }
+        printf("%zu\tlower_bound\t%.2f\n", n, (now() - start) * 1e9 / searches);
+
+        (void)sink;
+        free(keys);
+    }
+
+    free(queries);
+    return 0;
+}
@@ -0,0 +1,574 @@
+#include <buffer_pool.h>
+#include <io.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_NULL (-1)
+
+static size_t bucket_of(struct buffer_pool *pool, uint64_t page_number)
+{
+    return (page_number * 2654435761u) & (pool->number_of_buckets - 1);
+}
+
+static struct bufpool_lock *lock_of(struct buffer_pool *pool, uint64_t page_number)
+{
+    return &pool->locks[bucket_of(pool, page_number) % BUFPOOL_LOCKS];
+}
+
+// The functions down to write_back() are called with the lock of the page held
+
+static struct buffer_frame *lookup(struct buffer_pool *pool, uint64_t page_number)
+{
+    int32_t i = pool->buckets[bucket_of(pool, page_number)];
+    while (i != HASH_NULL) {
+        if (pool->frames[i].page_number == page_number) {
+            return &pool->frames[i];
+        }
+        i = pool->frames[i].hash_next;
+    }
+
+    return NULL;
+}
+
+static void hash_insert(struct buffer_pool *pool, struct buffer_frame *frame)
+{
+    size_t b = bucket_of(pool, frame->page_number);
+    frame->hash_next = pool->buckets[b];
+    pool->buckets[b] = frame - pool->frames;
+}
+
+static void hash_remove(struct buffer_pool *pool, struct buffer_frame *frame)
+{
+    int32_t *link = &pool->buckets[bucket_of(pool, frame->page_number)];
+    int32_t target = frame - pool->frames;
+    while (*link != target) {
+        assert(*link != HASH_NULL);
+        link = &pool->frames[*link].hash_next;
+    }
+    *link = frame->hash_next;
+    frame->hash_next = HASH_NULL;
+}
+
+// Gives the frame a page, others find it from now on
+static void assign(struct buffer_pool *pool, struct buffer_frame *frame, uint64_t page_number, bool loading)
+{
+    __atomic_store_n(&frame->page_number, page_number, __ATOMIC_RELEASE);
+    frame->loading = loading;
+    frame->dirty = false;
+    frame->referenced = true;
+    hash_insert(pool, frame);
+}
+
+// Makes the frame free again, after its page was written back or couldn't be read
+static void unassign(struct buffer_pool *pool, struct buffer_frame *frame)
+{
+    hash_remove(pool, frame);
+    frame->referenced = false;
+    __atomic_store_n(&frame->page_number, 0, __ATOMIC_RELEASE);
+}
+
+static int write_back(struct buffer_pool *pool, struct buffer_frame *frame)
+{
+    assert(frame->page_number > 0);
+
+    off_t offset = pool->offset + (off_t)(frame->page_number - 1) * pool->page_size;
+    ssize_t written = io_write_at(pool->fd, frame->data, pool->page_size, offset);
+    if (written != (ssize_t)pool->page_size) {
+        fprintf(stderr, "Couldn't write back page %" PRIu64 "\n", frame->page_number);
+        return written < 0 ? written : -EIO;
+    }
+    stats_add(&pool->stats->page_writes, 1);
+    stats_add(&pool->stats->bytes_written, written);
+
+    frame->dirty = false;
+    __atomic_sub_fetch(&pool->dirty_frames, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void pin_frame(struct buffer_pool *pool, struct buffer_frame *frame)
+{
+    if (__atomic_fetch_add(&frame->pin_count, 1, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_add_fetch(&pool->pinned_frames, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Returns whether that was the last pin, wake_waiters() has to follow then
+static bool drop_pin(struct buffer_pool *pool, struct buffer_frame *frame)
+{
+    uint32_t pins = __atomic_sub_fetch(&frame->pin_count, 1, __ATOMIC_SEQ_CST);
+    assert(pins != UINT32_MAX);
+    if (pins > 0) {
+        return false;
+    }
+
+    __atomic_sub_fetch(&pool->pinned_frames, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->unpins, 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+// Called without a bucket lock, they come after the pool lock
+static void wake_waiters(struct buffer_pool *pool)
+{
+    // the pool lock is only taken when somebody found every frame pinned
+    if (__atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->unpinned);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+int bufpool_init(struct buffer_pool *pool, int fd, size_t offset, size_t page_size, size_t capacity, struct stats *stats)
+{
+    assert(pool != NULL);
+    assert(page_size > 0);
+    assert(stats != NULL);
+
+    // a primary page and an overflow page are pinned at the same time
+    if (capacity < 2) {
+        fprintf(stderr, "Buffer pool needs at least 2 pages\n");
+        return -EINVAL;
+    }
+
+    memset(pool, 0x0, sizeof(struct buffer_pool));
+    pool->fd = fd;
+    pool->offset = offset;
+    pool->page_size = page_size;
+    pool->capacity = capacity;
+    pool->stats = stats;
+
+    pool->number_of_buckets = 1;
+    while (pool->number_of_buckets < capacity) {
+        pool->number_of_buckets *= 2;
+    }
+
+    pool->frames = calloc(capacity, sizeof(struct buffer_frame));
+    pool->buckets = malloc(pool->number_of_buckets * sizeof(int32_t));
+    // aligned, so frames can be used with O_DIRECT
+    uint8_t *data = io_alloc_aligned(capacity * page_size);
+    if (pool->frames == NULL || pool->buckets == NULL || data == NULL) {
+        free(pool->frames);
+        free(pool->buckets);
+        free(data);
+        memset(pool, 0x0, sizeof(struct buffer_pool));
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < pool->number_of_buckets; i++) {
+        pool->buckets[i] = HASH_NULL;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        pool->frames[i].hash_next = HASH_NULL;
+        pool->frames[i].data = data + i * page_size;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->unpinned, NULL);
+    for (size_t i = 0; i < BUFPOOL_LOCKS; i++) {
+        pthread_mutex_init(&pool->locks[i].lock, NULL);
+        pthread_cond_init(&pool->locks[i].loaded, NULL);
+    }
+    return 0;
+}
+
+void bufpool_free(struct buffer_pool *pool)
+{
+    assert(pool != NULL);
+
+    if (pool->frames == NULL) {
+        return;
+    }
+
+    bufpool_flush(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->unpinned);
+    for (size_t i = 0; i < BUFPOOL_LOCKS; i++) {
+        pthread_mutex_destroy(&pool->locks[i].lock);
+        pthread_cond_destroy(&pool->locks[i].loaded);
+    }
+    free(pool->frames[0].data);
+    free(pool->frames);
+    free(pool->buckets);
+    memset(pool, 0x0, sizeof(struct buffer_pool));
+}
+
+/**
+ * Takes an unpinned frame for another page, writing its page back if
+ * needed. Returns it pinned and free or NULL if all frames are pinned or
+ * kept dirty or the write back failed. Called with the pool lock held.
+ */
+static struct buffer_frame *take_victim(struct buffer_pool *pool)
+{
+    // two full sweeps clear every reference bit, so if nothing was found
+    // by then all frames are pinned or kept dirty
+    for (size_t n = 0; n < 2 * pool->capacity; n++) {
+        struct buffer_frame *frame = &pool->frames[pool->clock_hand];
+        pool->clock_hand = (pool->clock_hand + 1) % pool->capacity;
+
+        // free frames are only taken with the pool lock held, the others with the lock of their page
+        uint64_t page_number = __atomic_load_n(&frame->page_number, __ATOMIC_ACQUIRE);
+        if (page_number == 0) {
+            if (__atomic_load_n(&frame->pin_count, __ATOMIC_SEQ_CST) > 0) {
+                continue;
+            }
+            pin_frame(pool, frame);
+            return frame;
+        }
+
+        // a frame being loaded is pinned by its loader
+        struct bufpool_lock *lock = lock_of(pool, page_number);
+        pthread_mutex_lock(&lock->lock);
+        if (__atomic_load_n(&frame->page_number, __ATOMIC_ACQUIRE) != page_number
+            || __atomic_load_n(&frame->pin_count, __ATOMIC_SEQ_CST) > 0 || (pool->keep_dirty && frame->dirty)) {
+            pthread_mutex_unlock(&lock->lock);
+            continue;
+        }
+
+        if (frame->referenced) {
+            frame->referenced = false;
+            pthread_mutex_unlock(&lock->lock);
+            continue;
+        }
+
+        if (frame->dirty && write_back(pool, frame) != 0) {
+            pthread_mutex_unlock(&lock->lock);
+            return NULL;
+        }
+        unassign(pool, frame);
+        pin_frame(pool, frame);
+        pthread_mutex_unlock(&lock->lock);
+        return frame;
+    }
+
+    return NULL;
+}
+
+// Takes a free frame, waiting while other threads have every frame pinned
+static struct buffer_frame *get_victim(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    // counted before looking, an unpin after the look sees it
+    __atomic_add_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+    struct buffer_frame *frame;
+    while (true) {
+        uint64_t unpins = __atomic_load_n(&pool->unpins, __ATOMIC_SEQ_CST);
+        frame = take_victim(pool);
+        if (frame != NULL) {
+            break;
+        }
+
+        if (__atomic_load_n(&pool->pinned_frames, __ATOMIC_SEQ_CST) == pool->capacity) {
+            pthread_cond_wait(&pool->unpinned, &pool->lock);
+        } else if (__atomic_load_n(&pool->unpins, __ATOMIC_SEQ_CST) == unpins) {
+            break; // the unpinned frames are kept dirty or couldn't be written back
+        }
+    }
+    __atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (frame == NULL) {
+        fprintf(stderr, "Couldn't find a free buffer pool frame\n");
+    }
+    return frame;
+}
+
+struct buffer_frame *bufpool_pin(struct buffer_pool *pool, uint64_t page_number, bool load)
+{
+    assert(pool != NULL);
+    assert(page_number > 0);
+
+    struct bufpool_lock *lock = lock_of(pool, page_number);
+    struct buffer_frame *victim = NULL;
+    while (true) {
+        pthread_mutex_lock(&lock->lock);
+        struct buffer_frame *frame = lookup(pool, page_number);
+        if (frame != NULL) {
+            pin_frame(pool, frame);
+            frame->referenced = true;
+            while (frame->loading) {
+                pthread_cond_wait(&lock->loaded, &lock->lock);
+            }
+
+            // a frame whose read failed was given up, the next round reads the page again
+            if (frame->page_number != page_number) {
+                bool last = drop_pin(pool, frame);
+                pthread_mutex_unlock(&lock->lock);
+                if (last) {
+                    wake_waiters(pool);
+                }
+                continue;
+            }
+            pthread_mutex_unlock(&lock->lock);
+
+            // another thread cached the page while the victim was taken
+            if (victim != NULL && drop_pin(pool, victim)) {
+                wake_waiters(pool);
+            }
+            __atomic_add_fetch(&pool->hits, 1, __ATOMIC_RELAXED);
+            return frame;
+        }
+
+        if (victim != NULL) {
+            assign(pool, victim, page_number, load);
+            pthread_mutex_unlock(&lock->lock);
+            break;
+        }
+        pthread_mutex_unlock(&lock->lock);
+
+        // the page may be cached by another thread meanwhile, it is looked up again
+        victim = get_victim(pool);
+        if (victim == NULL) {
+            return NULL;
+        }
+    }
+
+    __atomic_add_fetch(&pool->misses, 1, __ATOMIC_RELAXED);
+    if (!load) {
+        return victim;
+    }
+
+    // nobody reads the frame before it is loaded, the lock isn't needed for the read
+    off_t offset = pool->offset + (off_t)(page_number - 1) * pool->page_size;
+    ssize_t read = io_read_at(pool->fd, victim->data, pool->page_size, offset);
+    if (read >= 0) {
+        stats_add(&pool->stats->page_reads, 1);
+        stats_add(&pool->stats->bytes_read, read);
+        // pages past the end of the file read as zeroes
+        memset(victim->data + read, 0x0, pool->page_size - read);
+    }
+
+    pthread_mutex_lock(&lock->lock);
+    victim->loading = false;
+    if (read < 0) {
+        unassign(pool, victim);
+    }
+    pthread_cond_broadcast(&lock->loaded);
+    bool last = read < 0 && drop_pin(pool, victim);
+    pthread_mutex_unlock(&lock->lock);
+
+    if (read < 0) {
+        if (last) {
+            wake_waiters(pool);
+        }
+        fprintf(stderr, "Couldn't read page %" PRIu64 "\n", page_number);
+        return NULL;
+    }
+
+    return victim;
+}
+
+int bufpool_prefetch(struct buffer_pool *pool, uint64_t first_page, size_t count)
+{
+    assert(pool != NULL);
+    assert(first_page > 0);
+
+    size_t max_run = pool->capacity / 2;
+    if (count > max_run) {
+        count = max_run;
+    }
+
+    struct buffer_frame *frames[count ? count : 1];
+    struct iovec iov[count ? count : 1];
+
+    uint64_t page_number = first_page;
+    uint64_t end = first_page + count;
+
+    while (page_number < end) {
+        // the frames of a run are loading until the read is done, pins of their pages wait for it
+        uint64_t run_start = page_number;
+        size_t n = 0;
+        bool cached = false;
+        struct buffer_frame *spare = NULL; // taken before the page was found cached
+        pthread_mutex_lock(&pool->lock);
+        while (page_number < end) {
+            struct bufpool_lock *lock = lock_of(pool, page_number);
+            pthread_mutex_lock(&lock->lock);
+            cached = lookup(pool, page_number) != NULL;
+            pthread_mutex_unlock(&lock->lock);
+            if (cached) {
+                break;
+            }
+
+            // taking a victim locks buckets, a pin may cache the page meanwhile
+            struct buffer_frame *frame = take_victim(pool);
+            if (frame == NULL) {
+                break;
+            }
+
+            pthread_mutex_lock(&lock->lock);
+            cached = lookup(pool, page_number) != NULL;
+            if (!cached) {
+                assign(pool, frame, page_number, true);
+            }
+            pthread_mutex_unlock(&lock->lock);
+            if (cached) {
+                spare = frame;
+                break;
+            }
+
+            frames[n] = frame;
+            iov[n].iov_base = frame->data;
+            iov[n].iov_len = pool->page_size;
+            n++;
+            page_number++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (spare != NULL && drop_pin(pool, spare)) {
+            wake_waiters(pool);
+        }
+
+        if (n == 0 && cached) {
+            page_number++;
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        ssize_t read = io_readv_at(pool->fd, iov, n, pool->offset + (off_t)(run_start - 1) * pool->page_size);
+        if (read > 0) {
+            stats_add(&pool->stats->page_reads, read / pool->page_size);
+            stats_add(&pool->stats->bytes_read, read);
+        }
+
+        bool wake = false;
+        for (size_t i = 0; i < n; i++) {
+            struct bufpool_lock *lock = lock_of(pool, run_start + i);
+            pthread_mutex_lock(&lock->lock);
+            frames[i]->loading = false;
+            if (read < (ssize_t)((i + 1) * pool->page_size)) {
+                // past the end of the file or failed, leave the frame free
+                unassign(pool, frames[i]);
+            }
+            pthread_cond_broadcast(&lock->loaded);
+            wake |= drop_pin(pool, frames[i]);
+            pthread_mutex_unlock(&lock->lock);
+        }
+        if (wake) {
+            wake_waiters(pool);
+        }
+
+        if (read < (ssize_t)(n * pool->page_size)) {
+            return read < 0 ? read : 0;
+        }
+    }
+
+    return 0;
+}
+
+void bufpool_unpin(struct buffer_pool *pool, struct buffer_frame *frame, bool dirty)
+{
+    assert(pool != NULL);
+    assert(frame != NULL);
+
+    // a pinned frame keeps its page
+    struct bufpool_lock *lock = lock_of(pool, __atomic_load_n(&frame->page_number, __ATOMIC_ACQUIRE));
+    pthread_mutex_lock(&lock->lock);
+    if (dirty && !frame->dirty) {
+        frame->dirty = true;
+        __atomic_add_fetch(&pool->dirty_frames, 1, __ATOMIC_RELAXED);
+    }
+    bool last = drop_pin(pool, frame);
+    pthread_mutex_unlock(&lock->lock);
+
+    if (last) {
+        wake_waiters(pool);
+    }
+}
+
+/**
+ * Locks the frame at i if it holds a dirty page and returns that lock,
+ * NULL otherwise. The page can't be evicted or replaced until the lock is
+ * released.
+ */
+static struct bufpool_lock *lock_dirty(struct buffer_pool *pool, size_t i)
+{
+    struct buffer_frame *frame = &pool->frames[i];
+    uint64_t page_number = __atomic_load_n(&frame->page_number, __ATOMIC_ACQUIRE);
+    if (page_number == 0) {
+        return NULL;
+    }
+
+    struct bufpool_lock *lock = lock_of(pool, page_number);
+    pthread_mutex_lock(&lock->lock);
+    if (__atomic_load_n(&frame->page_number, __ATOMIC_ACQUIRE) != page_number || !frame->dirty) {
+        pthread_mutex_unlock(&lock->lock);
+        return NULL;
+    }
+
+    return lock;
+}
+
+int bufpool_flush(struct buffer_pool *pool)
+{
+    assert(pool != NULL);
+
+    int rc = 0;
+    for (size_t i = 0; i < pool->capacity; i++) {
+        struct bufpool_lock *lock = lock_dirty(pool, i);
+        if (lock != NULL) {
+            int ret = write_back(pool, &pool->frames[i]);
+            if (ret != 0) {
+                rc = ret;
+            }
+            pthread_mutex_unlock(&lock->lock);
+        }
+    }
+
+    return rc;
+}
+
+int bufpool_visit_dirty(struct buffer_pool *pool, bufpool_visit_fn fn, void *arg)
+{
+    assert(pool != NULL);
+    assert(fn != NULL);
+
+    int rc = 0;
+    for (size_t i = 0; i < pool->capacity && rc == 0; i++) {
+        struct bufpool_lock *lock = lock_dirty(pool, i);
+        if (lock != NULL) {
+            rc = fn(arg, pool->frames[i].page_number, pool->frames[i].data);
+            pthread_mutex_unlock(&lock->lock);
+        }
+    }
+
+    return rc;
+}
+
+size_t bufpool_dirty_pages(struct buffer_pool *pool)
+{
+    assert(pool != NULL);
+
+    return __atomic_load_n(&pool->dirty_frames, __ATOMIC_RELAXED);
+}
+
+void bufpool_reset(struct buffer_pool *pool, int fd)
+{
+    assert(pool != NULL);
+
+    // nothing is pinned, so nobody else uses the pool
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->capacity; i++) {
+        struct buffer_frame *frame = &pool->frames[i];
+        assert(frame->pin_count == 0);
+        frame->page_number = 0;
+        frame->dirty = false;
+        frame->referenced = false;
+        frame->hash_next = HASH_NULL;
+    }
+
+    for (size_t i = 0; i < pool->number_of_buckets; i++) {
+        pool->buckets[i] = HASH_NULL;
+    }
+
+    pool->clock_hand = 0;
+    pool->pinned_frames = 0;
+    pool->dirty_frames = 0;
+    pool->fd = fd;
+    pthread_mutex_unlock(&pool->lock);
+}
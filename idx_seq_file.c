@@ -1,895 +1,4345 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <idx_seq_file.h>
 #include <index.h>
+#include <io.h>
+#include <legacy_format.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
-static int number_of_disk_operations = 0;
-
 //#define LOG_ENTRY(msg) (printf("%s:%d\t%s\n", __FILE__, __LINE__, msg));
 #define LOG_ENTRY(msg)
 
-static size_t get_file_size(const char *filename)
+static int start_background_reorganize(struct idx_seq_file *file);
+static void finish_background_reorganize(struct idx_seq_file *file, bool wait);
+static int recover(struct idx_seq_file *file);
+
+// The latches do nothing unless the handle is thread safe
+static void index_latch(struct idx_seq_file *file, bool exclusive)
 {
-    LOG_ENTRY("get_file_size");
-    
-    assert(filename != NULL);
+    assert(file != NULL);
 
-    FILE *fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Couldn't open the file: %s\n", filename);
-        return 0;
+    if (!file->thread_safe) {
+        return;
+    }
+
+    if (exclusive) {
+        pthread_rwlock_wrlock(&file->index_latch);
+    } else {
+        pthread_rwlock_rdlock(&file->index_latch);
     }
+}
 
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    fclose(fp);
+static void index_unlatch(struct idx_seq_file *file)
+{
+    assert(file != NULL);
 
-    return size;
+    if (file->thread_safe) {
+        pthread_rwlock_unlock(&file->index_latch);
+    }
 }
 
-static bool is_file_empty(const char *filename)
+// A thread holds at most one page latch, two pages may share a latch
+static void page_latch(struct idx_seq_file *file, uint64_t page_number, bool exclusive)
 {
-    assert(filename != NULL);
+    assert(file != NULL);
 
-    size_t size = get_file_size(filename);
-    return (size == 0);
+    if (!file->thread_safe) {
+        return;
+    }
+
+    pthread_rwlock_t *latch = &file->page_latches[page_number % PAGE_LATCHES];
+    if (exclusive) {
+        pthread_rwlock_wrlock(latch);
+    } else {
+        pthread_rwlock_rdlock(latch);
+    }
 }
 
-static uint16_t get_page_number_from_index_file(struct idx_seq_file *file, int32_t key)
+static void page_unlatch(struct idx_seq_file *file, uint64_t page_number)
 {
-    LOG_ENTRY("get_page_number_from_index_file");
     assert(file != NULL);
-    assert(key >= 1);
 
-    size_t index_file_size = get_file_size(file->index_file_path);
-    assert(index_file_size % sizeof(struct index_entry) == 0);
+    if (file->thread_safe) {
+        pthread_rwlock_unlock(&file->page_latches[page_number % PAGE_LATCHES]);
+    }
+}
 
-    size_t number_of_entries = index_file_size / sizeof(struct index_entry);
+static void alloc_lock(struct idx_seq_file *file)
+{
+    if (file->thread_safe) {
+        pthread_mutex_lock(&file->alloc_lock);
+    }
+}
 
-    struct index_entry *buffer = calloc(number_of_entries, sizeof(struct index_entry));
-    if (buffer == NULL) {
-        return 0;
+static void alloc_unlock(struct idx_seq_file *file)
+{
+    if (file->thread_safe) {
+        pthread_mutex_unlock(&file->alloc_lock);
     }
+}
+
+static size_t get_file_size(int fd)
+{
+    LOG_ENTRY("get_file_size");
+    assert(fd >= 0);
 
-    FILE *fp = fopen(file->index_file_path, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Couldn't open file: %s\n", file->index_file_path);
-        free(buffer);
+    off_t size = io_file_size(fd);
+    if (size < 0) {
+        fprintf(stderr, "Couldn't stat the file: %s\n", strerror(-size));
         return 0;
     }
 
-    // set position at 0
-    fseek(fp, 0, SEEK_SET);
-    fread(buffer, sizeof(struct index_entry), number_of_entries, fp);
-    number_of_disk_operations++;
+    return size;
+}
 
-    fclose(fp);
+// Reorganizations swap the files, other threads may be running one
+static bool is_open(struct idx_seq_file *file)
+{
+    assert(file != NULL);
 
-    uint16_t page_no = 0;
+    return __atomic_load_n(&file->index_fd, __ATOMIC_RELAXED) >= 0 && __atomic_load_n(&file->data_fd, __ATOMIC_RELAXED) >= 0;
+}
 
-    // find first key greater than ours and return previous page number
-    for (size_t i = 0; i < number_of_entries; i++) {
-        if (buffer[i].key > key) {
-            page_no = buffer[i-1].page_number;
-            break;
-        }
-    }
+static bool is_file_empty(int fd)
+{
+    assert(fd >= 0);
+
+    size_t size = get_file_size(fd);
+    return (size == 0);
+}
+
+// Returns the page key belongs to, 0 if the index is empty or couldn't be read
+static uint64_t get_page_number_from_index(struct idx_seq_file *file, int32_t key)
+{
+    LOG_ENTRY("get_page_number_from_index");
+    assert(file != NULL);
+    assert(key >= 1);
 
-    // if page number still hasn't been find return page number of the last entry
-    if (page_no == 0) {
-        page_no = buffer[number_of_entries-1].page_number;
+    size_t pos;
+    if (file->index.size == 0 || index_lookup(&file->index, key, &pos) != 0) {
+        return 0;
     }
 
-    free(buffer);
-    return page_no;
+    return index_page_number(&file->index, pos);
 }
 
-static void read_page_from_data_file(struct idx_seq_file *file, struct record *page, uint16_t page_number)
+// Offset of page_number in the data file, pages follow the superblock
+static off_t page_offset(size_t page_size, uint64_t page_number)
 {
-    LOG_ENTRY("read_page_from_data_file");
-    assert(file != NULL);
-    assert(page != NULL);
     assert(page_number > 0);
 
-    FILE *fp = fopen(file->data_file_path, "rb");
+    return SUPERBLOCK_SIZE + (off_t)(page_number - 1) * page_size;
+}
 
-    size_t offset = (page_number - 1) * PAGESIZE;
-    fseek(fp, offset, SEEK_SET);
-    size_t read = fread(page, RECORD_SIZE, RECORDS_PER_PAGE, fp);
-    assert(read == RECORDS_PER_PAGE);
+// Overflow pointers are slots, overflow pages hold records_per_page of them
+static uint64_t slot_page(size_t records_per_page, uint64_t slot)
+{
+    assert(slot != OVERFLOW_PTR_NULL);
 
-    number_of_disk_operations++;
+    return slot / records_per_page + 1;
+}
 
-    fflush(fp);
-    fclose(fp);
+// Offset of slot on its overflow page
+static size_t slot_offset(size_t records_per_page, uint64_t slot)
+{
+    return slot % records_per_page * RECORD_SIZE;
 }
 
-static void save_page_to_data_file(struct idx_seq_file *file, struct record *page, uint16_t page_number)
+/**
+ * Returns a pointer to page_number of the data file, either in a pinned
+ * buffer pool frame or in the mapping. Has to be released with page_unpin().
+ * NULL if the page couldn't be read or every frame of the pool is pinned.
+ */
+static void *page_pin(struct idx_seq_file *file, uint64_t page_number, struct buffer_frame **frame)
 {
-    LOG_ENTRY("save_page_to_data_file");
     assert(file != NULL);
-    assert(page != NULL);
+    assert(frame != NULL);
     assert(page_number > 0);
 
-    FILE *fp = fopen(file->data_file_path, "r+b");
-    size_t offset = (page_number - 1) * PAGESIZE;
-    fseek(fp, offset, SEEK_SET);
-    assert(ftell(fp) < file->primary_area_size);
-    size_t written = fwrite(page, RECORD_SIZE, RECORDS_PER_PAGE, fp);
-    assert(written == RECORDS_PER_PAGE);
+    // the mapping grows with allocate_page()
+    if (file->use_mmap) {
+        *frame = NULL;
+        return file->map.base + page_offset(file->page_size, page_number);
+    }
+
+    *frame = bufpool_pin(&file->pool, page_number, true);
+    return *frame != NULL ? (*frame)->data : NULL;
+}
+
+static void page_unpin(struct idx_seq_file *file, struct buffer_frame *frame, bool dirty)
+{
+    assert(file != NULL);
+
+    // writes to the mapping reach the file without any help
+    if (frame != NULL) {
+        bufpool_unpin(&file->pool, frame, dirty);
+    }
+}
+
+// Returns rc. A write failing with it may have been left half done, so every later call fails.
+static int fail_write(struct idx_seq_file *file, int rc)
+{
+    assert(file != NULL);
+
+    int none = 0;
+    if (rc < 0) {
+        __atomic_compare_exchange_n(&file->error, &none, rc, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    return rc;
+}
 
-    number_of_disk_operations += 1;
+// The error of the write that failed half way, 0 if none did
+static int write_error(struct idx_seq_file *file)
+{
+    assert(file != NULL);
 
-    fflush(fp);
-    fclose(fp);
+    return __atomic_load_n(&file->error, __ATOMIC_RELAXED);
 }
 
-static bool is_page_free(struct record *page)
+static int read_page_from_data_file(struct idx_seq_file *file, void *page, uint64_t page_number)
 {
+    LOG_ENTRY("read_page_from_data_file");
+    assert(file != NULL);
     assert(page != NULL);
 
-    for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
-        if (page[i].key == 0) {
-            return true;
-        }
+    struct buffer_frame *frame;
+    void *data = page_pin(file, page_number, &frame);
+    if (data == NULL) {
+        return -EIO;
     }
+    memcpy(page, data, file->page_size);
+    page_unpin(file, frame, false);
 
-    return false;
+    return 0;
 }
 
-static void read_record_overflow_area(struct idx_seq_file *file, uint32_t ovf_ptr, struct record *buff)
+static int read_record_overflow_area(struct idx_seq_file *file, uint64_t ovf_ptr, struct record *buff)
 {
     LOG_ENTRY("read_record_overflow_area");
     assert(file != NULL);
     assert(buff != NULL);
     assert(ovf_ptr != OVERFLOW_PTR_NULL);
 
-    FILE *fp = fopen(file->data_file_path, "rb");
-    fseek(fp, ovf_ptr, SEEK_SET);
-
-    size_t read = fread(buff, RECORD_SIZE, 1, fp);
-    assert(read == 1);
-    number_of_disk_operations++;
+    struct buffer_frame *frame;
+    uint8_t *page = page_pin(file, slot_page(file->records_per_page, ovf_ptr), &frame);
+    if (page == NULL) {
+        return -EIO;
+    }
+    memcpy(buff, page + slot_offset(file->records_per_page, ovf_ptr), RECORD_SIZE);
+    page_unpin(file, frame, false);
+    stats_add(&file->stats.overflow_reads, 1);
+    stats_add(&file->activity.overflow_reads, 1);
 
-    fflush(fp);
-    fclose(fp);
+    return 0;
 }
 
-static void save_record_overflow_area(struct idx_seq_file *file, uint32_t ovf_ptr, struct record *r)
+static int save_record_overflow_area(struct idx_seq_file *file, uint64_t ovf_ptr, struct record *r)
 {
     LOG_ENTRY("save_record_overflow_area");
     assert(file != NULL);
     assert(r != NULL);
     assert(ovf_ptr != OVERFLOW_PTR_NULL);
-    assert(file->data_file_path != NULL);
 
-    FILE *fp = fopen(file->data_file_path, "r+b");
-    assert(fp != NULL);
-    fseek(fp, ovf_ptr, SEEK_SET);
+    struct buffer_frame *frame;
+    uint8_t *page = page_pin(file, slot_page(file->records_per_page, ovf_ptr), &frame);
+    if (page == NULL) {
+        return -EIO;
+    }
+    memcpy(page + slot_offset(file->records_per_page, ovf_ptr), r, RECORD_SIZE);
+    page_unpin(file, frame, true);
+    stats_add(&file->stats.overflow_writes, 1);
+
+    return 0;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const struct record *ra = a;
+    const struct record *rb = b;
+
+    return (ra->key > rb->key) - (ra->key < rb->key);
+}
+
+// Returns the position of the first delta entry with a key >= key
+static size_t delta_lower_bound(const struct idx_seq_delta *delta, int32_t key)
+{
+    assert(delta != NULL);
+
+    size_t lo = 0;
+    size_t hi = delta->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (delta->entries[mid].record.key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static struct idx_seq_delta_entry *delta_find(struct idx_seq_delta *delta, int32_t key)
+{
+    assert(delta != NULL);
+
+    size_t pos = delta_lower_bound(delta, key);
+    if (pos < delta->size && delta->entries[pos].record.key == key) {
+        return &delta->entries[pos];
+    }
+
+    return NULL;
+}
+
+// Records r, or the deletion of its key, replacing an entry with the same key
+static int delta_put(struct idx_seq_delta *delta, const struct record *r, bool deleted)
+{
+    assert(delta != NULL);
+    assert(r != NULL);
+
+    size_t pos = delta_lower_bound(delta, r->key);
+    if (pos == delta->size || delta->entries[pos].record.key != r->key) {
+        if (delta->size == delta->capacity) {
+            size_t capacity = delta->capacity ? delta->capacity * 2 : 64;
+            struct idx_seq_delta_entry *entries = realloc(delta->entries, capacity * sizeof(struct idx_seq_delta_entry));
+            if (entries == NULL) {
+                return -ENOMEM;
+            }
+            delta->entries = entries;
+            delta->capacity = capacity;
+        }
+
+        memmove(&delta->entries[pos+1], &delta->entries[pos], (delta->size - pos) * sizeof(struct idx_seq_delta_entry));
+        delta->size++;
+    }
+
+    memcpy(&delta->entries[pos].record, r, RECORD_SIZE);
+    delta->entries[pos].record.overflow_pointer = OVERFLOW_PTR_NULL;
+    delta->entries[pos].deleted = deleted;
+    return 0;
+}
 
-    size_t written = fwrite(r, RECORD_SIZE, 1, fp);
-    assert(written == 1);
-    number_of_disk_operations++;
+static void delta_clear(struct idx_seq_delta *delta)
+{
+    assert(delta != NULL);
 
-    fflush(fp);
-    fclose(fp);
+    free(delta->entries);
+    memset(delta, 0x0, sizeof(struct idx_seq_delta));
 }
 
 /**
- * Returns true if overflow pointer from data file has to be updated
-*/
-static bool add_record_overflow_area(struct idx_seq_file *file, struct record *r, uint32_t ovf_ptr)
+ * Takes a page off the free list or appends one to the data file, its
+ * number goes to *page_number. Returns 0 or a negative errno. Callers of
+ * this and free_page() hold alloc_lock or the index latch exclusively.
+ */
+static int allocate_page(struct idx_seq_file *file, uint64_t *page_number)
 {
-    LOG_ENTRY("add_record_overflow_area");
     assert(file != NULL);
-    assert(r != NULL);
+    assert(page_number != NULL);
+
+    if (file->free_page_head == 0) {
+        if (file->use_mmap) {
+            // the mapping can't move, past its reserved address space the file can't grow
+            int rc = mapped_file_ensure(&file->map, page_offset(file->page_size, file->number_of_pages + 2));
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        *page_number = ++file->number_of_pages;
+        return 0;
+    }
 
-    uint32_t ptr = file->primary_area_size + file->overflow_area_size;
+    struct buffer_frame *frame;
+    struct page_header *header = page_pin(file, file->free_page_head, &frame);
+    if (header == NULL) {
+        return -EIO;
+    }
+    assert(header->flags & PAGE_FREE);
+    *page_number = file->free_page_head;
+    file->free_page_head = header->overflow_head;
+    page_unpin(file, frame, false);
 
-    if (ovf_ptr == OVERFLOW_PTR_NULL) {
-        r->overflow_pointer = OVERFLOW_PTR_NULL;
-        save_record_overflow_area(file, ptr, r);
-        file->overflow_area_size += RECORD_SIZE;
-        
-        return true;
+    return 0;
+}
+
+/**
+ * Refuses adding records a mapped file may not have room for before
+ * anything is written. Every record may take an overflow page and a
+ * bucket. Returns 0 or -EFBIG.
+ */
+static int reserve_mapped_pages(struct idx_seq_file *file, size_t records)
+{
+    assert(file != NULL);
+
+    if (!file->use_mmap) {
+        return 0;
     }
 
-    uint32_t prev_ptr = OVERFLOW_PTR_NULL;
-    uint32_t curr_ptr = ovf_ptr;
-    struct record curr = {};
-    read_record_overflow_area(file, ovf_ptr, &curr);
+    alloc_lock(file);
+    uint64_t pages = file->number_of_pages + 2 * (uint64_t)records + 2;
+    alloc_unlock(file);
 
-    if (curr.key == r->key) {
-        fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
-        return false;
+    // the mapping grows in steps of MAPPED_FILE_GROWTH
+    if ((uint64_t)page_offset(file->page_size, pages) + MAPPED_FILE_GROWTH > file->map.reserved) {
+        fprintf(stderr, "The mapped file can't grow past %zu bytes\n", file->map.reserved);
+        return -EFBIG;
     }
 
-    bool ret;
+    return 0;
+}
 
-    if (curr.key < r->key) {
-        while (curr.overflow_pointer != OVERFLOW_PTR_NULL) {
-            prev_ptr = curr_ptr;
-            curr_ptr = curr.overflow_pointer;
-            read_record_overflow_area(file, curr_ptr, &curr);
+// Allocates a page for overflow records, a page from the free list still has a header
+static int allocate_cleared_page(struct idx_seq_file *file, uint64_t *page_number)
+{
+    assert(file != NULL);
+    assert(page_number != NULL);
 
-            if (curr.key == r->key) {
-                fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
-                return false;
-            }
+    int rc = allocate_page(file, page_number);
+    if (rc != 0) {
+        return rc;
+    }
 
-            if (curr.key > r->key) {
-                break;
-            }
+    struct buffer_frame *frame;
+    void *page = page_pin(file, *page_number, &frame);
+    if (page == NULL) {
+        return -EIO;
+    }
+    memset(page, 0x0, file->page_size);
+    page_unpin(file, frame, true);
+
+    return 0;
+}
+
+static int free_page(struct idx_seq_file *file, uint64_t page_number)
+{
+    assert(file != NULL);
+
+    struct buffer_frame *frame;
+    void *page = page_pin(file, page_number, &frame);
+    if (page == NULL) {
+        return -EIO;
+    }
+    page_format(&file->layout, page);
+    page_header(page)->flags = PAGE_FREE;
+    page_header(page)->overflow_head = file->free_page_head;
+    page_unpin(file, frame, true);
+
+    file->free_page_head = page_number;
+    return 0;
+}
+
+// Overflow records are packed records_per_page to an overflow page
+static uint64_t overflow_record_ptr(struct idx_seq_file *file, uint64_t page_number, size_t pos)
+{
+    assert(file != NULL);
+    assert(page_number > 0);
+
+    return (page_number - 1) * file->records_per_page + pos;
+}
+
+// Returns true if ovf_ptr points to a record on page_number
+static bool on_page(struct idx_seq_file *file, uint64_t ovf_ptr, uint64_t page_number)
+{
+    return page_number != 0 && slot_page(file->records_per_page, ovf_ptr) == page_number;
+}
+
+/**
+ * Puts a free record of the bucket of the primary page with header into
+ * *ptr, giving the page one first if local_overflow is set. OVERFLOW_PTR_NULL
+ * if the bucket is full or there is none. Free bucket records have key 0,
+ * only callers latching the page exclusively use them. Called with
+ * alloc_lock held, returns 0 or a negative errno.
+ */
+static int allocate_bucket_record(struct idx_seq_file *file, struct page_header *header, uint64_t *ptr)
+{
+    assert(file != NULL);
+    assert(header != NULL);
+    assert(ptr != NULL);
+
+    *ptr = OVERFLOW_PTR_NULL;
+    if (header->bucket == 0 && !file->local_overflow) {
+        return 0;
+    }
+
+    if (header->bucket == 0) {
+        uint64_t bucket;
+        int rc = allocate_cleared_page(file, &bucket);
+        if (rc != 0) {
+            return rc;
         }
+        header->bucket = bucket;
+        *ptr = overflow_record_ptr(file, bucket, 0);
+        return 0;
+    }
+
+    struct buffer_frame *frame;
+    struct record *records = page_pin(file, header->bucket, &frame);
+    if (records == NULL) {
+        return -EIO;
+    }
+    size_t pos = 0;
+    while (pos < file->records_per_page && records[pos].key != 0) {
+        pos++;
     }
+    page_unpin(file, frame, false);
+
+    if (pos < file->records_per_page) {
+        *ptr = overflow_record_ptr(file, header->bucket, pos);
+    }
+    return 0;
+}
 
-    if (curr.key > r->key) { // znalazlem wiekszy
-        if (prev_ptr == OVERFLOW_PTR_NULL) { // poprzedni w main
-            r->overflow_pointer = curr_ptr;
-            ret = true;
+/**
+ * Puts a record for a chain of the primary page with header into *ptr,
+ * from the bucket of the page if it has room. Reuses a vacated overflow
+ * record if there is one, appends otherwise. Returns 0 or a negative errno.
+ */
+static int allocate_overflow_record(struct idx_seq_file *file, struct page_header *header, uint64_t *ptr)
+{
+    assert(file != NULL);
+    assert(ptr != NULL);
+
+    alloc_lock(file);
+
+    int rc = allocate_bucket_record(file, header, ptr);
+    if (rc == 0 && *ptr == OVERFLOW_PTR_NULL && file->overflow_free_head != OVERFLOW_PTR_NULL) {
+        struct record free_record;
+        rc = read_record_overflow_area(file, file->overflow_free_head, &free_record);
+        if (rc == 0) {
+            assert(free_record.key == 0);
+            *ptr = file->overflow_free_head;
+            file->overflow_free_head = free_record.overflow_pointer;
         }
-        else { // poprzedni w overflow
-            struct record prev = {};
-            read_record_overflow_area(file, prev_ptr, &prev);
+    }
 
-            r->overflow_pointer = prev.overflow_pointer;
-            prev.overflow_pointer = ptr;
-            save_record_overflow_area(file, prev_ptr, &prev);
-            ret = false;
+    if (rc == 0 && *ptr == OVERFLOW_PTR_NULL) {
+        if (file->overflow_page == 0 || file->overflow_page_fill == file->records_per_page) {
+            uint64_t page_number;
+            rc = allocate_cleared_page(file, &page_number);
+            if (rc == 0) {
+                file->overflow_page = page_number;
+                file->overflow_page_fill = 0;
+            }
+        }
+        if (rc == 0) {
+            *ptr = overflow_record_ptr(file, file->overflow_page, file->overflow_page_fill++);
         }
-    } else { // nie znalazlem wiekszego
-        curr.overflow_pointer = ptr;
-        save_record_overflow_area(file, curr_ptr, &curr);
-        r->overflow_pointer = OVERFLOW_PTR_NULL;
-        ret = false;
     }
 
-    save_record_overflow_area(file, ptr, r);
-    file->overflow_area_size += RECORD_SIZE;
-    return ret;
+    if (rc == 0) {
+        file->overflow_records++;
+    }
+    alloc_unlock(file);
+    return rc;
 }
 
-int add_record(struct idx_seq_file *file, struct record *r)
+/**
+ * Puts the overflow record at ovf_ptr on the free list, keys of free records
+ * are 0. Records of bucket, the bucket of their page, are only cleared.
+ */
+static int free_overflow_record(struct idx_seq_file *file, uint64_t ovf_ptr, uint64_t bucket)
 {
-    LOG_ENTRY("add_record");
-    if (file == NULL) {
-        fprintf(stderr, "file is NULL\n");
-        return -EINVAL;
+    assert(file != NULL);
+
+    alloc_lock(file);
+    assert(file->overflow_records > 0);
+
+    struct record free_record = {};
+    bool in_bucket = on_page(file, ovf_ptr, bucket);
+    if (!in_bucket) {
+        free_record.overflow_pointer = file->overflow_free_head;
     }
 
-    if (file->index_file_path == NULL) {
-        fprintf(stderr, "index_file is NULL\n");
-        return -EINVAL;
+    int rc = save_record_overflow_area(file, ovf_ptr, &free_record);
+    if (rc == 0) {
+        if (!in_bucket) {
+            file->overflow_free_head = ovf_ptr;
+        }
+        file->overflow_records--;
     }
 
-    if (file->data_file_path == NULL) {
-        fprintf(stderr, "data_file is NULL\n");
+    alloc_unlock(file);
+    return rc;
+}
+
+// State of the files kept in the superblock and in the log, which holds the changes since
+struct file_state {
+    uint32_t page_size;
+    uint32_t records_per_page;
+    uint64_t number_of_pages;
+    uint64_t free_page_head;
+    uint64_t overflow_page;
+    uint64_t overflow_page_fill;
+    uint64_t overflow_records;
+    uint64_t overflow_free_head;
+    uint64_t records;
+    uint64_t inserts;
+};
+
+// Payload of WAL_CHECKPOINT. The images before it hold every add and delete
+// logged up to replayed_to.
+struct wal_checkpoint {
+    struct file_state state;
+    uint64_t replayed_to;
+};
+
+static void get_file_state(struct idx_seq_file *file, struct file_state *state)
+{
+    assert(file != NULL);
+    assert(state != NULL);
+
+    state->page_size = file->page_size;
+    state->records_per_page = file->records_per_page;
+    state->number_of_pages = file->number_of_pages;
+    state->free_page_head = file->free_page_head;
+    state->overflow_page = file->overflow_page;
+    state->overflow_page_fill = file->overflow_page_fill;
+    state->overflow_records = file->overflow_records;
+    state->overflow_free_head = file->overflow_free_head;
+    state->records = __atomic_load_n(&file->records, __ATOMIC_RELAXED);
+    state->inserts = __atomic_load_n(&file->inserts, __ATOMIC_RELAXED);
+}
+
+static int set_file_state(struct idx_seq_file *file, const struct file_state *state)
+{
+    assert(file != NULL);
+    assert(state != NULL);
+
+    if (state->page_size != file->page_size || state->records_per_page != file->records_per_page) {
+        fprintf(stderr, "The files were written with %u records per page and %u byte pages\n",
+                state->records_per_page, state->page_size);
         return -EINVAL;
     }
 
-    if (r == NULL) {
-        fprintf(stderr, "record is NULL\n");
-        return -EINVAL;
+    file->number_of_pages = state->number_of_pages;
+    file->free_page_head = state->free_page_head;
+    file->overflow_page = state->overflow_page;
+    file->overflow_page_fill = state->overflow_page_fill;
+    file->overflow_records = state->overflow_records;
+    file->overflow_free_head = state->overflow_free_head;
+    file->records = state->records;
+    file->inserts = state->inserts;
+    return 0;
+}
+
+#define SUPERBLOCK_MAGIC 0x51534449 // "IDSQ"
+#define FORMAT_VERSION 5 // LEGACY_FORMAT_VERSION files are converted by idx_seq_file_upgrade()
+
+// Start of the data file, the pages follow at SUPERBLOCK_SIZE
+struct superblock {
+    uint32_t magic; // magic and version start the superblock of every version
+    uint32_t version;
+    uint32_t clean; // set by close once all pages and the index are written, cleared by open
+    uint32_t reserved;
+    uint64_t primary_pages; // entries of the index file
+    struct file_state state;
+};
+
+_Static_assert(sizeof(struct superblock) <= SUPERBLOCK_SIZE, "struct superblock has to fit SUPERBLOCK_SIZE");
+_Static_assert(SUPERBLOCK_SIZE % IO_ALIGNMENT == 0, "pages have to stay aligned for O_DIRECT");
+
+// Writes the superblock of a data file with state, the caller syncs it
+static int write_superblock(int fd, const struct file_state *state, uint64_t primary_pages, bool clean,
+                            struct stats *stats)
+{
+    assert(fd >= 0);
+    assert(state != NULL);
+
+    // a whole aligned block, the data file may be opened with O_DIRECT
+    uint8_t *block = io_alloc_aligned(SUPERBLOCK_SIZE);
+    if (block == NULL) {
+        return -ENOMEM;
+    }
+
+    struct superblock sb = {
+        .magic = SUPERBLOCK_MAGIC,
+        .version = FORMAT_VERSION,
+        .clean = clean,
+        .primary_pages = primary_pages,
+        .state = *state,
+    };
+    memcpy(block, &sb, sizeof(struct superblock));
+
+    ssize_t written = io_write_at(fd, block, SUPERBLOCK_SIZE, 0);
+    free(block);
+    if (written != SUPERBLOCK_SIZE) {
+        fprintf(stderr, "Couldn't write the superblock\n");
+        return written < 0 ? written : -EIO;
+    }
+    stats_add(&stats->bytes_written, written);
+
+    return 0;
+}
+
+static int read_superblock(int fd, struct superblock *sb, struct stats *stats)
+{
+    assert(fd >= 0);
+    assert(sb != NULL);
+
+    uint8_t *block = io_alloc_aligned(SUPERBLOCK_SIZE);
+    if (block == NULL) {
+        return -ENOMEM;
     }
 
-    if (is_file_empty(file->data_file_path) || is_file_empty(file->index_file_path)) {
+    ssize_t read = io_read_at(fd, block, SUPERBLOCK_SIZE, 0);
+    memcpy(sb, block, sizeof(struct superblock));
+    free(block);
+    if (read < 0) {
+        return read;
+    }
+    stats_add(&stats->bytes_read, read);
+
+    if (read != SUPERBLOCK_SIZE || sb->magic != SUPERBLOCK_MAGIC) {
+        fprintf(stderr, "The data file has no superblock\n");
         return -EINVAL;
     }
 
-    if (r->key <= 1) {
-        fprintf(stderr, "Key has to be greater than 1\n");
+    if (sb->version != FORMAT_VERSION) {
+        fprintf(stderr, "The data file has format version %u, expected %u%s\n", sb->version, FORMAT_VERSION,
+                sb->version == LEGACY_FORMAT_VERSION ? ", idx_seq_file_upgrade() converts it" : "");
         return -EINVAL;
     }
 
-    number_of_disk_operations = 0;
+    return 0;
+}
 
-    uint16_t page_number = get_page_number_from_index_file(file, r->key);
-    if (page_number == 0) {
-        fprintf(stderr, "Failed to get page number for key: %d\n", r->key);
-        return -1;
-    }
+// Writes the superblock of the handle, open files are marked as not closed cleanly
+static int store_superblock(struct idx_seq_file *file, bool clean)
+{
+    assert(file != NULL);
 
-    struct record page[RECORDS_PER_PAGE] = {};
-    r->overflow_pointer = OVERFLOW_PTR_NULL;
-    read_page_from_data_file(file, page, page_number);
+    struct file_state state;
+    get_file_state(file, &state);
 
-    /* find position for the new record */
-    size_t idx = 0;
-    bool found = false;
-    for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
-        if (page[i].key == r->key) {
-            fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
-            return -1;
-        }
-        if (page[i].key > r->key) {
-            idx = i;
-            found = true;
-            break;
-        }
+    int rc = write_superblock(file->data_fd, &state, file->index.size, clean, &file->stats);
+    if (rc == 0 && fsync(file->data_fd) != 0) {
+        rc = -errno;
     }
 
-    int last_rec_idx;
-    for (last_rec_idx = RECORDS_PER_PAGE-1; last_rec_idx >= 0; last_rec_idx--) {
-        if (page[last_rec_idx].key != 0) {
-            break;
+    return rc;
+}
+
+// Called with the page of the write latched, writes of a key are logged in the order they happen
+static void log_write(struct idx_seq_file *file, uint16_t type, const void *payload, size_t size)
+{
+    assert(file != NULL);
+
+    if (!file->use_wal || file->wal.replaying) {
+        return;
+    }
+
+    // a failed append fails every later commit
+    struct iovec iov = { (void *)payload, size };
+    wal_append(&file->wal, type, &iov, 1);
+}
+
+// Makes n logged writes durable, wal_group_commit writes share a sync
+static int commit_writes(struct idx_seq_file *file, size_t n)
+{
+    assert(file != NULL);
+
+    if (!file->use_wal || n == 0) {
+        return 0;
+    }
+
+    return wal_commit(&file->wal, n);
+}
+
+// Writes the changed index pages, with a log the index file is only written by checkpoints
+static int store_index(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    if (file->use_wal) {
+        file->index_dirty = true;
+        return 0;
+    }
+
+    return index_store(&file->index, file->index_fd);
+}
+
+static int log_page_image(void *arg, uint64_t page_number, const void *data)
+{
+    struct idx_seq_file *file = arg;
+    struct iovec iov[2] = {
+        { &page_number, sizeof(uint64_t) },
+        { (void *)data, file->page_size },
+    };
+
+    return wal_append(&file->wal, WAL_PAGE, iov, 2);
+}
+
+static int log_index_part(void *arg, uint64_t offset, const void *data, size_t size)
+{
+    struct idx_seq_file *file = arg;
+    struct iovec iov[2] = {
+        { &offset, sizeof(uint64_t) },
+        { (void *)data, size },
+    };
+
+    return wal_append(&file->wal, WAL_INDEX, iov, 2);
+}
+
+/**
+ * Writes the pages and the index changed since the last checkpoint into
+ * the files and starts a new log holding tail, the records recovery hasn't
+ * replayed yet. The images are logged first, a crash while the files are
+ * written leaves them to recovery. Has to be called with the index latched
+ * exclusively.
+ */
+static int checkpoint_locked(struct idx_seq_file *file, const void *tail, size_t tail_size)
+{
+    LOG_ENTRY("checkpoint_locked");
+    assert(file != NULL);
+    assert(file->use_wal);
+
+    // half done writes must not reach the files, recovery replays the log instead
+    int rc = write_error(file);
+    if (rc != 0) {
+        return rc;
+    }
+
+    struct wal_checkpoint checkpoint;
+    checkpoint.replayed_to = wal_size(&file->wal) - tail_size;
+    get_file_state(file, &checkpoint.state);
+
+    rc = bufpool_visit_dirty(&file->pool, log_page_image, file);
+    if (rc == 0 && file->index_dirty) {
+        rc = index_visit_dirty(&file->index, log_index_part, file);
+    }
+    if (rc == 0) {
+        struct iovec iov = { &checkpoint, sizeof(struct wal_checkpoint) };
+        rc = wal_append(&file->wal, WAL_CHECKPOINT, &iov, 1);
+    }
+    if (rc == 0) {
+        rc = wal_flush(&file->wal);
+    }
+
+    if (rc == 0) {
+        rc = bufpool_flush(&file->pool);
+    }
+    if (rc == 0 && file->index_dirty) {
+        rc = index_store(&file->index, file->index_fd);
+    }
+    if (rc == 0 && (fsync(file->data_fd) != 0 || fsync(file->index_fd) != 0)) {
+        rc = -errno;
+    }
+
+    if (rc == 0) {
+        file->index_dirty = false;
+        rc = wal_reset(&file->wal, &checkpoint.state, sizeof(struct file_state), tail, tail_size);
+    }
+    if (rc == 0) {
+        stats_add(&file->stats.checkpoints, 1);
+    } else {
+        fprintf(stderr, "Checkpoint failed: %s\n", strerror(-rc));
+    }
+
+    return rc;
+}
+
+// The pool keeps written pages until a checkpoint, half of it is left for the writes in between
+static bool checkpoint_needed(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    if (!file->use_wal) {
+        return false;
+    }
+
+    return bufpool_dirty_pages(&file->pool) >= file->pool.capacity / 2 || wal_size(&file->wal) >= WAL_CHECKPOINT_BYTES;
+}
+
+// Whether the pool can keep pages more written pages until the next checkpoint
+static bool pool_has_room(struct idx_seq_file *file, size_t pages)
+{
+    assert(file != NULL);
+
+    // a reader and a writer pin one page each on top of that
+    return !file->use_wal || bufpool_dirty_pages(&file->pool) + pages + 2 <= file->pool.capacity;
+}
+
+// Has to be called without holding any latch
+static void checkpoint_if_needed(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    if (!checkpoint_needed(file)) {
+        return;
+    }
+
+    // another thread may have done it in the meantime
+    index_latch(file, true);
+    if (checkpoint_needed(file)) {
+        checkpoint_locked(file, NULL, 0);
+    }
+    index_unlatch(file);
+}
+
+/**
+ * Merges m records sorted by key into the overflow chain starting at *head,
+ * a chain of the primary page with header. Records whose key is already in
+ * the chain are skipped. Returns the number of records added or a negative
+ * errno, *head is updated if the chain gets a new first record.
+ */
+static ssize_t merge_into_overflow_chain(struct idx_seq_file *file, struct page_header *header, uint64_t *head,
+                                         struct record *rs, size_t m)
+{
+    LOG_ENTRY("merge_into_overflow_chain");
+    assert(file != NULL);
+    assert(header != NULL);
+    assert(head != NULL);
+    assert(rs != NULL);
+
+    uint64_t prev_ptr = OVERFLOW_PTR_NULL; // OVERFLOW_PTR_NULL while *head is the link
+    struct record prev = {};
+    uint64_t curr_ptr = *head;
+    struct record curr = {};
+    int rc = 0;
+    if (curr_ptr != OVERFLOW_PTR_NULL) {
+        rc = read_record_overflow_area(file, curr_ptr, &curr);
+    }
+
+    size_t added = 0;
+    for (size_t i = 0; i < m && rc == 0; i++) {
+        struct record *r = &rs[i];
+
+        while (curr_ptr != OVERFLOW_PTR_NULL && curr.key < r->key && rc == 0) {
+            prev_ptr = curr_ptr;
+            memcpy(&prev, &curr, RECORD_SIZE);
+            curr_ptr = curr.overflow_pointer;
+            if (curr_ptr != OVERFLOW_PTR_NULL) {
+                rc = read_record_overflow_area(file, curr_ptr, &curr);
+            }
+        }
+        if (rc != 0) {
+            break;
+        }
+
+        if (curr_ptr != OVERFLOW_PTR_NULL && curr.key == r->key) {
+            fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
+            continue;
+        }
+
+        uint64_t ptr;
+        rc = allocate_overflow_record(file, header, &ptr);
+        r->overflow_pointer = curr_ptr;
+        if (rc == 0) {
+            rc = save_record_overflow_area(file, ptr, r);
+        }
+        if (rc != 0) {
+            break;
+        }
+
+        if (prev_ptr == OVERFLOW_PTR_NULL) {
+            *head = ptr;
+        } else {
+            prev.overflow_pointer = ptr;
+            rc = save_record_overflow_area(file, prev_ptr, &prev);
+            if (rc != 0) {
+                break;
+            }
+        }
+
+        prev_ptr = ptr;
+        memcpy(&prev, r, RECORD_SIZE);
+        added++;
+    }
+
+    return rc != 0 ? rc : (ssize_t)added;
+}
+
+/**
+ * Cuts the overflow chain starting at *head before the first key greater
+ * than key and returns the pointer to the detached rest in *rest. Returns
+ * 0, -EEXIST if key is already in the chain or a negative errno.
+ */
+static int split_overflow_chain(struct idx_seq_file *file, uint64_t *head, int32_t key, uint64_t *rest)
+{
+    assert(file != NULL);
+    assert(head != NULL);
+    assert(rest != NULL);
+
+    *rest = OVERFLOW_PTR_NULL;
+
+    uint64_t prev_ptr = OVERFLOW_PTR_NULL;
+    struct record prev = {};
+    uint64_t curr_ptr = *head;
+
+    while (curr_ptr != OVERFLOW_PTR_NULL) {
+        struct record curr;
+        int rc = read_record_overflow_area(file, curr_ptr, &curr);
+        if (rc != 0) {
+            return rc;
+        }
+
+        if (curr.key == key) {
+            fprintf(stderr, "Record with a key %d already exists. Aborting\n", key);
+            return -EEXIST;
+        }
+
+        if (curr.key > key) {
+            break;
+        }
+
+        prev_ptr = curr_ptr;
+        memcpy(&prev, &curr, RECORD_SIZE);
+        curr_ptr = curr.overflow_pointer;
+    }
+
+    if (curr_ptr == OVERFLOW_PTR_NULL) {
+        return 0;
+    }
+
+    if (prev_ptr != OVERFLOW_PTR_NULL) {
+        prev.overflow_pointer = OVERFLOW_PTR_NULL;
+        int rc = save_record_overflow_area(file, prev_ptr, &prev);
+        if (rc != 0) {
+            return rc;
+        }
+    } else {
+        *head = OVERFLOW_PTR_NULL;
+    }
+
+    *rest = curr_ptr;
+    return 0;
+}
+
+/**
+ * Inserts m records sorted by key, all belonging to page_number, reading
+ * and writing the page only once. Records go into free slots of the page
+ * first, the rest is merged into the overflow chains, one pass per chain.
+ * Returns the number of records inserted, duplicates are skipped, or a
+ * negative errno. A failed insert may have left the page half written.
+ */
+static ssize_t insert_records_into_page(struct idx_seq_file *file, uint64_t page_number, struct record *rs, size_t m)
+{
+    LOG_ENTRY("insert_records_into_page");
+    assert(file != NULL);
+    assert(rs != NULL);
+
+    const struct page_layout *layout = &file->layout;
+    page_latch(file, page_number, true);
+    struct buffer_frame *frame;
+    void *page = page_pin(file, page_number, &frame);
+    if (page == NULL) {
+        page_unlatch(file, page_number);
+        return -EIO;
+    }
+    struct page_header *header = page_header(page);
+    int32_t *keys = page_keys(layout, page);
+    bool dirty = false;
+    size_t added = 0;
+    size_t appended = 0;
+    int rc = 0;
+
+    // keys past the last page need no free slots in between
+    bool last_page = index_page_number(&file->index, file->index.size - 1) == page_number;
+
+    size_t i = 0;
+    while (i < m && rc == 0) {
+        struct record *r = &rs[i];
+        size_t idx = page_lower_bound(layout, page, r->key);
+        bool append = last_page && idx == header->count;
+
+        if (idx < header->count && keys[idx] == r->key) {
+            fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
+            i++;
+            continue;
+        }
+
+        // the keys between the neighbours of the new record, below the first one in the header
+        uint64_t *head = page_chain(layout, page, idx);
+
+        if (header->count < layout->capacity) {
+            /* The keys of the chain before us that are greater than ours
+             * follow us now. */
+            uint64_t chain = *head;
+            uint64_t rest;
+            rc = split_overflow_chain(file, &chain, r->key, &rest);
+            if (rc == -EEXIST) {
+                rc = 0;
+                i++;
+                continue;
+            }
+            if (rc != 0) {
+                break;
+            }
+            *head = chain;
+            r->overflow_pointer = rest;
+
+            page_insert(layout, page, idx, r);
+            dirty = true;
+            added++;
+            appended += append;
+            i++;
+            continue;
+        }
+
+        // all the records up to the next key on the page go into the same chain
+        size_t j = m;
+        if (idx < header->count) {
+            j = i + 1;
+            while (j < m && rs[j].key < keys[idx]) {
+                j++;
+            }
+        }
+
+        uint64_t chain = *head;
+        ssize_t merged = merge_into_overflow_chain(file, header, &chain, &rs[i], j - i);
+        *head = chain;
+        if (merged < 0) {
+            rc = merged;
+            break;
+        }
+        header->chained += merged;
+        dirty |= merged > 0;
+        added += merged;
+        appended += append ? merged : 0;
+        i = j;
+    }
+
+    if (rc != 0) {
+        page_unpin(file, frame, true);
+        page_unlatch(file, page_number);
+        return fail_write(file, rc);
+    }
+    header->inserts += added - appended;
+
+    // replaying a duplicate skips it again, so the skipped records may go along
+    for (size_t k = 0; k < m && added > 0; k++) {
+        log_write(file, WAL_ADD, &rs[k], RECORD_SIZE);
+    }
+    __atomic_add_fetch(&file->records, added, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&file->inserts, added - appended, __ATOMIC_RELAXED);
+    stats_add(&file->activity.writes, added);
+
+    page_unpin(file, frame, dirty);
+    page_unlatch(file, page_number);
+
+    return added;
+}
+
+// Counts a lookup that went walked records deep into a chain, reading
+// reads of them. Batched lookups read the first part of a chain only once.
+static void count_lookup(struct idx_seq_file *file, size_t walked, size_t reads)
+{
+    stats_record_chain(&file->stats, walked);
+    stats_add(&file->activity.gets, 1);
+    stats_add(&file->activity.get_overflow_reads, reads);
+
+    uint64_t max = __atomic_load_n(&file->activity.max_chain, __ATOMIC_RELAXED);
+    while (walked > max && !__atomic_compare_exchange_n(&file->activity.max_chain, &max, walked, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Looks key up in the file, leaving out the delta. Returns 0, -1 if it isn't there or a negative errno.
+static int lookup_record(struct idx_seq_file *file, int32_t key, struct record *r)
+{
+    assert(file != NULL);
+    assert(r != NULL);
+
+    uint64_t page_number = get_page_number_from_index(file, key);
+    if (page_number == 0) {
+        return -EIO;
+    }
+
+    // the latch of the page covers its chains
+    page_latch(file, page_number, false);
+    struct buffer_frame *frame;
+    void *page = page_pin(file, page_number, &frame);
+    if (page == NULL) {
+        page_unlatch(file, page_number);
+        return -EIO;
+    }
+    size_t idx = page_lower_bound(&file->layout, page, key);
+
+    if (idx < page_header(page)->count && page_keys(&file->layout, page)[idx] == key) {
+        page_get(&file->layout, page, idx, r);
+        page_unpin(file, frame, false);
+        page_unlatch(file, page_number);
+        count_lookup(file, 0, 0);
+        return 0;
+    }
+
+    // the key can only be in the chain before that position
+    uint64_t overflow_ptr = *page_chain(&file->layout, page, idx);
+    page_unpin(file, frame, false);
+
+    int rc = -1;
+    size_t walked = 0;
+    while (overflow_ptr != OVERFLOW_PTR_NULL) {
+        struct record tmp = {};
+        if (read_record_overflow_area(file, overflow_ptr, &tmp) != 0) {
+            rc = -EIO;
+            break;
+        }
+        walked++;
+        if (tmp.key == key) {
+            memcpy(r, &tmp, RECORD_SIZE);
+            rc = 0;
+            break;
+        }
+        if (tmp.key > key) {
+            break;
+        }
+        overflow_ptr = tmp.overflow_pointer;
+    }
+
+    page_unlatch(file, page_number);
+    count_lookup(file, walked, walked);
+    return rc;
+}
+
+// Adds r to the delta of a background reorganization, unless its key is in use
+static int delta_add_record(struct idx_seq_file *file, const struct record *r)
+{
+    assert(file != NULL);
+    assert(r != NULL);
+
+    struct idx_seq_delta_entry *entry = delta_find(&file->delta, r->key);
+    struct record tmp;
+    int rc = (entry == NULL) ? lookup_record(file, r->key, &tmp) : -1;
+    if (rc < -1) {
+        return rc;
+    }
+    if ((entry != NULL && !entry->deleted) || rc == 0) {
+        fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
+        return -1;
+    }
+
+    rc = delta_put(&file->delta, r, false);
+    if (rc == 0) {
+        file->records++;
+    }
+    return rc;
+}
+
+static int delta_delete_record(struct idx_seq_file *file, int32_t key)
+{
+    assert(file != NULL);
+
+    struct idx_seq_delta_entry *entry = delta_find(&file->delta, key);
+    struct record tmp = {};
+    int rc = (entry == NULL) ? lookup_record(file, key, &tmp) : 0;
+    if (rc < -1) {
+        return rc;
+    }
+    if ((entry != NULL && entry->deleted) || rc != 0) {
+        return -1;
+    }
+
+    tmp.key = key;
+    rc = delta_put(&file->delta, &tmp, true);
+    if (rc == 0) {
+        file->records--;
+    }
+    return rc;
+}
+
+// Has to be called with the index latched
+static void get_reorganize_stats(struct idx_seq_file *file, struct reorganize_stats *stats)
+{
+    assert(file != NULL);
+    assert(stats != NULL);
+
+    memset(stats, 0x0, sizeof(struct reorganize_stats));
+    alloc_lock(file);
+    stats->overflow_records = file->overflow_records;
+    size_t pages = file->number_of_pages;
+    alloc_unlock(file);
+
+    stats->primary_pages = file->index.size;
+    stats->records = __atomic_load_n(&file->records, __ATOMIC_RELAXED);
+    stats->records_per_page = file->records_per_page;
+    stats->alpha = file->alpha;
+    stats->beta = file->beta;
+
+    const struct idx_seq_activity *activity = &file->activity;
+    stats->gets = __atomic_load_n(&activity->gets, __ATOMIC_RELAXED);
+    stats->get_overflow_reads = __atomic_load_n(&activity->get_overflow_reads, __ATOMIC_RELAXED);
+    stats->overflow_reads = __atomic_load_n(&activity->overflow_reads, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&activity->writes, __ATOMIC_RELAXED);
+    stats->max_chain = __atomic_load_n(&activity->max_chain, __ATOMIC_RELAXED);
+    stats->elapsed_ns = stats_now() - activity->start_ns;
+
+    // a step reads and writes its pages, a rewrite reads the whole file and writes the records to alpha
+    size_t stride = file->local_overflow ? 2 : 1;
+    if (file->incremental_reorganize) {
+        size_t step = file->reorganize_step_pages < stats->primary_pages ? file->reorganize_step_pages
+                                                                         : stats->primary_pages;
+        stats->rewrite_pages = 2 * stride * step;
+    } else {
+        size_t fill_limit = file->alpha * file->records_per_page;
+        size_t per_page = fill_limit ? fill_limit : 1;
+        stats->rewrite_pages = pages + stride * ((stats->records + per_page - 1) / per_page);
+    }
+}
+
+// Has to be called with the index latched
+static bool reorganize_wanted(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    struct reorganize_stats stats;
+    get_reorganize_stats(file, &stats);
+    return file->reorganize_policy(file->reorganize_policy_arg, &stats);
+}
+
+// Starts counting for the reorganize policy over, the index has to be latched exclusively
+static void reset_activity(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    memset(&file->activity, 0x0, sizeof(struct idx_seq_activity));
+    file->activity.start_ns = stats_now();
+}
+
+static int reorganize_locked(struct idx_seq_file *file);
+
+// Has to be called without holding any latch
+static void reorganize_if_needed(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    // the running one replaces all overflow records anyway
+    if (file->rebuild != NULL) {
+        return;
+    }
+
+    index_latch(file, false);
+    bool wanted = reorganize_wanted(file);
+    index_unlatch(file);
+    if (!wanted) {
+        return;
+    }
+
+    if (file->incremental_reorganize) {
+        idx_seq_file_reorganize_step(file, file->reorganize_step_pages);
+    } else if (!file->background_reorganize || start_background_reorganize(file) != 0) {
+        // another thread may have reorganized in the meantime
+        // the write itself is done, a failed rewrite leaves the file as it was
+        index_latch(file, true);
+        if (reorganize_wanted(file)) {
+            int rc = reorganize_locked(file);
+            if (rc != 0) {
+                fprintf(stderr, "Reorganization failed: %s\n", strerror(-rc));
+            }
+        }
+        index_unlatch(file);
+    }
+}
+
+static int insert_record(struct idx_seq_file *file, struct record *r)
+{
+    assert(file != NULL);
+    assert(r != NULL);
+
+    // inserts never change the index, the page is latched on its own
+    index_latch(file, false);
+    uint64_t page_number = get_page_number_from_index(file, r->key);
+    if (page_number == 0) {
+        index_unlatch(file);
+        fprintf(stderr, "Failed to get page number for key: %d\n", r->key);
+        return -EIO;
+    }
+
+    ssize_t added = insert_records_into_page(file, page_number, r, 1);
+    index_unlatch(file);
+
+    if (added < 0) {
+        return added;
+    }
+    return added == 1 ? 0 : -1;
+}
+
+int add_record(struct idx_seq_file *file, struct record *r)
+{
+    LOG_ENTRY("add_record");
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!is_open(file)) {
+        fprintf(stderr, "file isn't open\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    if (r == NULL) {
+        fprintf(stderr, "record is NULL\n");
+        return -EINVAL;
+    }
+
+    if (r->key <= 1) {
+        fprintf(stderr, "Key has to be greater than 1\n");
+        return -EINVAL;
+    }
+
+    uint64_t start = stats_now();
+    int rc;
+
+    finish_background_reorganize(file, false);
+    if (file->rebuild != NULL) {
+        rc = delta_add_record(file, r);
+    } else {
+        checkpoint_if_needed(file);
+        rc = reserve_mapped_pages(file, 1);
+        if (rc == 0) {
+            rc = insert_record(file, r);
+        }
+        if (rc == 0) {
+            rc = commit_writes(file, 1);
+            reorganize_if_needed(file);
+        }
+    }
+
+    stats_record_latency(&file->stats, STATS_OP_ADD, start);
+    return rc;
+}
+
+int add_records(struct idx_seq_file *file, const struct record *records, size_t n)
+{
+    LOG_ENTRY("add_records");
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!is_open(file)) {
+        fprintf(stderr, "file isn't open\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    if (records == NULL && n > 0) {
+        fprintf(stderr, "records is NULL\n");
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].key <= 1) {
+            fprintf(stderr, "Key has to be greater than 1\n");
+            return -EINVAL;
+        }
+    }
+
+    struct record *sorted = malloc(n * RECORD_SIZE);
+    if (n > 0 && sorted == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(sorted, records, n * RECORD_SIZE);
+    qsort(sorted, n, RECORD_SIZE, compare_records);
+
+    uint64_t start = stats_now();
+
+    finish_background_reorganize(file, false);
+
+    size_t added = 0;
+    size_t i = 0;
+    int rc = file->rebuild == NULL ? reserve_mapped_pages(file, n) : 0;
+    while (i < n && file->rebuild != NULL && rc == 0) {
+        rc = delta_add_record(file, &sorted[i]);
+        added += (rc == 0);
+        rc = rc < -1 ? rc : 0;
+        i++;
+    }
+
+    // every record may write two overflow pages, which the pool keeps until a checkpoint with a log
+    size_t max_group = file->use_wal ? file->pool.capacity / 8 : n;
+
+    checkpoint_if_needed(file);
+    index_latch(file, false);
+    while (i < n && rc == 0) {
+        uint64_t page_number = get_page_number_from_index(file, sorted[i].key);
+        if (page_number == 0) {
+            rc = -EIO;
+            break;
+        }
+
+        // the index doesn't change before the reorganization, so the group is a contiguous run
+        size_t j = i + 1;
+        while (j < n && j - i < max_group && get_page_number_from_index(file, sorted[j].key) == page_number) {
+            j++;
+        }
+
+        ssize_t group_added = insert_records_into_page(file, page_number, &sorted[i], j - i);
+        if (group_added < 0) {
+            rc = group_added;
+            break;
+        }
+        added += group_added;
+        i = j;
+
+        if (i < n && checkpoint_needed(file)) {
+            index_unlatch(file);
+            checkpoint_if_needed(file);
+            index_latch(file, false);
+        }
+    }
+    index_unlatch(file);
+
+    free(sorted);
+
+    if (rc == 0) {
+        rc = commit_writes(file, added);
+        reorganize_if_needed(file);
+    }
+
+    stats_record_latency(&file->stats, STATS_OP_ADD_BATCH, start);
+
+    return rc != 0 ? rc : (int)added;
+}
+
+static int add_first_record(struct idx_seq_file *file, struct record *r)
+{
+    assert(file != NULL);
+    assert(r != NULL);
+
+    // allocate whole page, followed by its empty bucket
+    size_t pages = file->local_overflow ? 2 : 1;
+    void *page = io_alloc_aligned(pages * file->page_size);
+    if (page == NULL) {
+        return -ENOMEM;
+    }
+    r->overflow_pointer = OVERFLOW_PTR_NULL;
+    page_format(&file->layout, page);
+    page_insert(&file->layout, page, 0, r);
+    page_header(page)->bucket = file->local_overflow ? 2 : 0;
+
+    ssize_t written = io_write_at(file->data_fd, page, pages * file->page_size, page_offset(file->page_size, 1));
+    free(page);
+    if (written != (ssize_t)(pages * file->page_size)) {
+        fprintf(stderr, "Couldn't write file: %s\n", file->data_file_path);
+        return -1;
+    }
+    stats_add(&file->stats.page_writes, pages);
+    stats_add(&file->stats.bytes_written, written);
+
+    if (index_append(&file->index, r->key, 1) != 0) {
+        return -ENOMEM;
+    }
+
+    if (index_store(&file->index, file->index_fd) != 0) {
+        fprintf(stderr, "Couldn't write file: %s\n", file->index_file_path);
+        return -1;
+    }
+
+    file->number_of_pages = pages;
+    file->records = 1;
+    return 0;
+}
+
+static char *path_with_suffix(const char *path, const char *suffix)
+{
+    assert(path != NULL);
+    assert(suffix != NULL);
+
+    char *result = malloc(strlen(path) + strlen(suffix) + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    strcpy(result, path);
+    strcat(result, suffix);
+    return result;
+}
+
+static char *tmp_path(const char *path)
+{
+    return path_with_suffix(path, ".tmp");
+}
+
+static int open_file(const char *path, int flags)
+{
+    assert(path != NULL);
+
+    int fd = open(path, O_RDWR | O_CREAT | flags, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open file: %s\n", path);
+    }
+
+    return fd;
+}
+
+int idx_seq_file_init(struct idx_seq_file *file, const char *index_file, const char *data_file)
+{
+    return idx_seq_file_init_with_options(file, index_file, data_file, NULL);
+}
+
+// Writes the first page and the index of new files
+static int create_new(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    struct record dummy_record;
+    dummy_record.key = 1;
+    dummy_record.overflow_pointer = OVERFLOW_PTR_NULL;
+    memset(&dummy_record.numbers, 0, RECORD_LEN);
+
+    int rc = add_first_record(file, &dummy_record);
+    if (rc == 0 && file->use_mmap) {
+        rc = mapped_file_init(&file->map, file->data_fd);
+    }
+
+    // a log left behind by files that were removed since
+    if (rc == 0 && file->use_wal) {
+        struct file_state state;
+        get_file_state(file, &state);
+        rc = wal_reset(&file->wal, &state, sizeof(struct file_state), NULL, 0);
+    }
+
+    return rc;
+}
+
+/**
+ * Loads the index of files described by sb. Files that weren't closed
+ * cleanly are recovered from their log, the log of clean ones is started
+ * over from sb.
+ */
+static int open_existing(struct idx_seq_file *file, const struct superblock *sb)
+{
+    assert(file != NULL);
+    assert(sb != NULL);
+
+    if (file->use_wal && !sb->clean) {
+        return recover(file);
+    }
+
+    int rc = index_load(&file->index, file->index_fd);
+    if (rc == 0 && (file->index.size == 0 || file->index.size != sb->primary_pages)) {
+        fprintf(stderr, "The index file has %zu entries, the superblock expects %" PRIu64 "\n", file->index.size,
+                sb->primary_pages);
+        rc = -EINVAL;
+    }
+
+    if (rc == 0 && file->use_mmap) {
+        rc = mapped_file_init(&file->map, file->data_fd);
+    }
+
+    if (rc == 0 && file->use_wal) {
+        rc = wal_reset(&file->wal, &sb->state, sizeof(struct file_state), NULL, 0);
+    }
+
+    return rc;
+}
+
+// Takes the geometry and the state of an existing data file from its superblock
+static int load_superblock(struct idx_seq_file *file, struct superblock *sb)
+{
+    assert(file != NULL);
+    assert(sb != NULL);
+
+    int rc = read_superblock(file->data_fd, sb, &file->stats);
+    if (rc != 0) {
+        return rc;
+    }
+
+    size_t records_per_page = sb->state.records_per_page;
+    if (records_per_page == 0 || records_per_page > UINT16_MAX) {
+        fprintf(stderr, "The superblock has %zu records per page\n", records_per_page);
+        return -EINVAL;
+    }
+    file->records_per_page = records_per_page;
+    page_layout_init(&file->layout, file->records_per_page);
+
+    if (sb->state.page_size < file->layout.size
+        || (file->direct_io && sb->state.page_size % IO_ALIGNMENT != 0)) {
+        fprintf(stderr, "The superblock has %u byte pages, which doesn't fit %zu records per page%s\n",
+                sb->state.page_size, records_per_page, file->direct_io ? " and direct_io" : "");
+        return -EINVAL;
+    }
+    file->page_size = sb->state.page_size;
+
+    return set_file_state(file, &sb->state);
+}
+
+// Sets the handle up, existing files are opened and new ones created
+static int setup(struct idx_seq_file *file, const char *index_file, const char *data_file,
+                 const struct idx_seq_file_options *options, bool existing)
+{
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    file->index_fd = -1;
+    file->data_fd = -1;
+    index_init(&file->index, &file->stats);
+    memset(&file->pool, 0x0, sizeof(struct buffer_pool));
+    memset(&file->map, 0x0, sizeof(struct mapped_file));
+    memset(&file->delta, 0x0, sizeof(struct idx_seq_delta));
+    file->rebuild = NULL;
+    file->thread_safe = false;
+    file->page_latches = NULL;
+    file->use_wal = false;
+    file->wal.fd = -1;
+    file->index_dirty = false;
+    file->has_superblock = false;
+    file->error = 0;
+    stats_reset(&file->stats);
+
+    struct idx_seq_file_options defaults = {
+        .alpha = ALPHA,
+        .beta = BETA,
+        .buffer_pool_pages = BUFFER_POOL_PAGES,
+        .readahead_pages = READAHEAD_PAGES,
+        .use_mmap = false,
+        .records_per_page = RECORDS_PER_PAGE,
+        .page_alignment = 1,
+        .direct_io = false,
+        .incremental_reorganize = false,
+        .reorganize_step_pages = REORGANIZE_STEP_PAGES,
+        .background_reorganize = false,
+        .thread_safe = false,
+        .use_wal = false,
+        .wal_group_commit = 1,
+    };
+    if (options == NULL) {
+        options = &defaults;
+    }
+    file->readahead_pages = options->readahead_pages;
+    file->incremental_reorganize = options->incremental_reorganize;
+    file->background_reorganize = options->background_reorganize;
+    file->local_overflow = options->local_overflow;
+    file->reorganize_step_pages = options->reorganize_step_pages ? options->reorganize_step_pages : REORGANIZE_STEP_PAGES;
+    file->use_mmap = options->use_mmap;
+    file->direct_io = options->direct_io;
+    file->reorganize_policy = options->reorganize_policy ? options->reorganize_policy : reorganize_cost_policy;
+    file->reorganize_policy_arg = options->reorganize_policy_arg;
+
+    file->alpha = options->alpha ? options->alpha : ALPHA;
+    file->adaptive_fill = options->adaptive_fill;
+    file->beta = options->beta ? options->beta : BETA;
+    if (file->alpha < 0 || file->alpha > 1 || file->beta < 0) {
+        fprintf(stderr, "alpha has to be in (0, 1] and beta positive\n");
+        return -EINVAL;
+    }
+
+    file->records_per_page = options->records_per_page ? options->records_per_page : RECORDS_PER_PAGE;
+    if (file->records_per_page > UINT16_MAX) {
+        fprintf(stderr, "records_per_page can't exceed %d\n", UINT16_MAX);
+        return -EINVAL;
+    }
+    page_layout_init(&file->layout, file->records_per_page);
+
+    // a primary page always takes more than records_per_page packed overflow records
+    size_t alignment = options->page_alignment ? options->page_alignment : 1;
+    if ((alignment & (alignment - 1)) != 0) {
+        fprintf(stderr, "page_alignment has to be a power of two\n");
+        return -EINVAL;
+    }
+    file->page_size = (file->layout.size + alignment - 1) / alignment * alignment;
+
+    if (file->direct_io && (file->use_mmap || file->page_size % IO_ALIGNMENT != 0)) {
+        fprintf(stderr, "direct_io needs pages aligned to %d bytes and no mmap\n", IO_ALIGNMENT);
+        return -EINVAL;
+    }
+
+    // the delta of a background reorganization isn't latched
+    if (options->thread_safe && options->background_reorganize) {
+        fprintf(stderr, "thread_safe can't be combined with background_reorganize\n");
+        return -EINVAL;
+    }
+
+    // the log needs every page write to go through the pool, the delta would have to be logged too
+    if (options->use_wal && (options->use_mmap || options->background_reorganize
+                             || options->buffer_pool_pages < WAL_MIN_POOL_PAGES)) {
+        fprintf(stderr, "use_wal needs %d buffer pool pages, no mmap and no background_reorganize\n",
+                WAL_MIN_POOL_PAGES);
+        return -EINVAL;
+    }
+
+    if (index_file == NULL) {
+        fprintf(stderr, "index_file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (data_file == NULL) {
+        fprintf(stderr, "data_file is NULL\n");
+        return -EINVAL;
+    }
+
+    file->index_file_path = index_file;
+    file->data_file_path = data_file;
+    file->reorganize_pos = 0;
+    file->number_of_pages = 0;
+    file->free_page_head = 0;
+    file->overflow_page = 0;
+    file->overflow_page_fill = 0;
+    file->overflow_records = 0;
+    file->overflow_free_head = OVERFLOW_PTR_NULL;
+    file->records = 0;
+    file->inserts = 0;
+
+    // open_file() would create missing ones
+    if (existing && (access(index_file, F_OK) != 0 || access(data_file, F_OK) != 0)) {
+        fprintf(stderr, "Couldn't find files: %s, %s\n", index_file, data_file);
+        return -ENOENT;
+    }
+
+    if (options->thread_safe) {
+        file->page_latches = malloc(PAGE_LATCHES * sizeof(pthread_rwlock_t));
+        if (file->page_latches == NULL) {
+            return -ENOMEM;
+        }
+
+        // waiting writers go first, readers would otherwise keep reorganizations out
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&file->index_latch, &attr);
+        pthread_rwlockattr_destroy(&attr);
+
+        for (size_t i = 0; i < PAGE_LATCHES; i++) {
+            pthread_rwlock_init(&file->page_latches[i], NULL);
+        }
+        pthread_mutex_init(&file->alloc_lock, NULL);
+        file->thread_safe = true;
+    }
+
+    file->index_fd = open_file(index_file, 0);
+    if (file->index_fd < 0) {
+        return -EIO;
+    }
+
+    file->data_fd = open_file(data_file, file->direct_io ? O_DIRECT : 0);
+    if (file->data_fd < 0) {
+        idx_seq_file_close(file);
+        return -EIO;
+    }
+
+    if (!existing && !is_file_empty(file->index_fd)) {
+        fprintf(stderr, "index_file isn't empty as expected\n");
+        idx_seq_file_close(file);
+        return -EINVAL;
+    }
+
+    if (!existing && !is_file_empty(file->data_fd)) {
+        fprintf(stderr, "data_file isn't empty as expected\n");
+        idx_seq_file_close(file);
+        return -EINVAL;
+    }
+
+    int rc = 0;
+    struct superblock sb = {};
+    if (existing) {
+        rc = load_superblock(file, &sb);
+        if (rc == 0 && !sb.clean && !options->use_wal) {
+            fprintf(stderr, "The files weren't closed cleanly, only use_wal can recover them\n");
+            rc = -EINVAL;
+        }
+        if (rc != 0) {
+            idx_seq_file_close(file);
+            return rc;
+        }
+    }
+
+    if (!file->use_mmap) {
+        rc = bufpool_init(&file->pool, file->data_fd, SUPERBLOCK_SIZE, file->page_size, options->buffer_pool_pages,
+                          &file->stats);
+        if (rc != 0) {
+            fprintf(stderr, "Couldn't set up the buffer pool\n");
+            idx_seq_file_close(file);
+            return rc;
+        }
+    }
+
+    if (options->use_wal) {
+        char *wal_path = path_with_suffix(data_file, ".wal");
+        rc = (wal_path == NULL) ? -ENOMEM : wal_open(&file->wal, wal_path, options->wal_group_commit, &file->stats);
+        free(wal_path);
+        if (rc != 0) {
+            idx_seq_file_close(file);
+            return rc;
+        }
+        file->use_wal = true;
+        file->pool.keep_dirty = true;
+    }
+
+    if (existing) {
+        rc = open_existing(file, &sb);
+    } else {
+        rc = create_new(file);
+    }
+
+    // the next close marks the files clean again
+    if (rc == 0) {
+        rc = store_superblock(file, false);
+    }
+    if (rc == 0) {
+        file->has_superblock = true;
+        reset_activity(file);
+    } else {
+        idx_seq_file_close(file);
+    }
+
+    return rc;
+}
+
+int idx_seq_file_init_with_options(struct idx_seq_file *file, const char *index_file, const char *data_file,
+                                   const struct idx_seq_file_options *options)
+{
+    return setup(file, index_file, data_file, options, false);
+}
+
+int idx_seq_file_open(struct idx_seq_file *file, const char *index_file, const char *data_file,
+                      const struct idx_seq_file_options *options)
+{
+    return setup(file, index_file, data_file, options, true);
+}
+
+// Writes cached or mapped changes of the data file back to the file
+static int flush_data_file(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    if (file->use_mmap) {
+        return mapped_file_sync(&file->map);
+    }
+
+    return bufpool_flush(&file->pool);
+}
+
+int idx_seq_file_sync(struct idx_seq_file *file)
+{
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!is_open(file)) {
+        fprintf(stderr, "file isn't open\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    // writes in the delta aren't in the file yet
+    finish_background_reorganize(file, true);
+
+    uint64_t start = stats_now();
+    int rc;
+
+    if (file->use_wal) {
+        // the log is enough to recover every write
+        rc = wal_flush(&file->wal);
+    } else {
+        // pages can't be written while they are flushed
+        index_latch(file, true);
+        rc = flush_data_file(file);
+        if (rc == 0 && (fsync(file->data_fd) != 0 || fsync(file->index_fd) != 0)) {
+            rc = -errno;
+        }
+        index_unlatch(file);
+    }
+
+    stats_record_latency(&file->stats, STATS_OP_SYNC, start);
+    return rc;
+}
+
+int idx_seq_file_checkpoint(struct idx_seq_file *file)
+{
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!is_open(file)) {
+        fprintf(stderr, "file isn't open\n");
+        return -EINVAL;
+    }
+
+    if (!file->use_wal) {
+        return 0;
+    }
+
+    index_latch(file, true);
+    int rc = checkpoint_locked(file, NULL, 0);
+    index_unlatch(file);
+
+    return rc;
+}
+
+int idx_seq_file_close(struct idx_seq_file *file)
+{
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    int rc = 0;
+    bool clean = file->has_superblock && is_open(file) && write_error(file) == 0;
+
+    finish_background_reorganize(file, true);
+    delta_clear(&file->delta);
+
+    // with a log pages only reach the data file through a checkpoint, the log has the rest
+    if (file->use_wal && (file->wal.fd < 0 || file->wal.replaying || !is_open(file)
+                          || checkpoint_locked(file, NULL, 0) != 0)) {
+        bufpool_reset(&file->pool, file->data_fd);
+        clean = false;
+    }
+    wal_close(&file->wal);
+    file->use_wal = false;
+
+    // the next open can trust the files once everything is on disk
+    if (clean) {
+        rc = flush_data_file(file);
+        if (rc == 0 && (fsync(file->data_fd) != 0 || fsync(file->index_fd) != 0)) {
+            rc = -errno;
+        }
+        if (rc == 0) {
+            rc = store_superblock(file, true);
+        }
+    }
+    file->has_superblock = false;
+
+    // writes back dirty pages
+    bufpool_free(&file->pool);
+    mapped_file_free(&file->map, page_offset(file->page_size, file->number_of_pages + 1));
+
+    if (file->data_fd >= 0 && close(file->data_fd) != 0) {
+        rc = -errno;
+    }
+
+    if (file->index_fd >= 0 && close(file->index_fd) != 0) {
+        rc = -errno;
+    }
+
+    file->data_fd = -1;
+    file->index_fd = -1;
+    index_free(&file->index);
+
+    if (file->thread_safe) {
+        pthread_rwlock_destroy(&file->index_latch);
+        for (size_t i = 0; i < PAGE_LATCHES; i++) {
+            pthread_rwlock_destroy(&file->page_latches[i]);
+        }
+        pthread_mutex_destroy(&file->alloc_lock);
+        file->thread_safe = false;
+    }
+    free(file->page_latches);
+    file->page_latches = NULL;
+
+    return rc;
+}
+
+static void print_overflow_pointer(struct idx_seq_file *file, uint64_t ovf_ptr)
+{
+    if (ovf_ptr == OVERFLOW_PTR_NULL) {
+        printf("| null\n");
+    } else {
+        printf("| %" PRIu64 " (page:%" PRIu64 " idx:%" PRIu64 ")\n", ovf_ptr,
+               slot_page(file->records_per_page, ovf_ptr), ovf_ptr % file->records_per_page);
+    }
+}
+
+static void print_record(struct idx_seq_file *file, struct record *rec)
+{
+    printf("%d   |", rec->key);
+    for (size_t i = 0; i < RECORD_LEN; i++) {
+        printf("%hu ", rec->numbers[i]);
+    }
+    print_overflow_pointer(file, rec->overflow_pointer);
+}
+
+// Reads page_no straight from the data file, a missing page reads as zeros
+static void print_read_page(struct idx_seq_file *file, void *page, uint64_t page_no)
+{
+    ssize_t read = io_read_at(file->data_fd, page, file->page_size, page_offset(file->page_size, page_no));
+    if (read > 0) {
+        stats_add(&file->stats.page_reads, 1);
+        stats_add(&file->stats.bytes_read, read);
+    }
+    if (read != (ssize_t)file->page_size) {
+        memset(page, 0x0, file->page_size);
+    }
+}
+
+void print_data_file(struct idx_seq_file *file)
+{
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return;
+    }
+
+    if (!is_open(file)) {
+        return;
+    }
+
+    index_latch(file, true);
+
+    // print what is on disk, not what is cached
+    if (file->use_wal) {
+        checkpoint_locked(file, NULL, 0);
+    } else {
+        flush_data_file(file);
+    }
+
+    void *page = io_alloc_aligned(file->page_size);
+    bool *is_overflow_page = malloc((file->number_of_pages + 1) * sizeof(bool));
+    if (page == NULL || is_overflow_page == NULL) {
+        index_unlatch(file);
+        free(page);
+        free(is_overflow_page);
+        return;
+    }
+
+    // pages are overflow pages unless they are in the index or on the free list
+    for (uint64_t page_no = 0; page_no <= file->number_of_pages; page_no++) {
+        is_overflow_page[page_no] = true;
+    }
+    for (size_t i = 0; i < file->index.size; i++) {
+        is_overflow_page[index_page_number(&file->index, i)] = false;
+    }
+    for (uint64_t page_no = file->free_page_head; page_no != 0; page_no = page_header(page)->overflow_head) {
+        is_overflow_page[page_no] = false;
+        print_read_page(file, page, page_no);
+    }
+
+    printf("\n*** MAIN AREA ***\n");
+
+    for (size_t i = 0; i < file->index.size; i++) {
+        uint64_t page_no = index_page_number(&file->index, i);
+        if (page_no == 0) {
+            fprintf(stderr, "Couldn't read the index\n");
+            break;
+        }
+        print_read_page(file, page, page_no);
+
+        struct page_header *header = page_header(page);
+        printf("Page: %" PRIu64 "\n", page_no);
+        if (header->bucket != 0) {
+            printf("Bucket: %" PRIu64 "\n", header->bucket);
+        }
+        if (header->overflow_head != OVERFLOW_PTR_NULL) {
+            printf("Head ");
+            print_overflow_pointer(file, header->overflow_head);
+        }
+
+        for (size_t j = 0; j < header->count; j++) {
+            struct record r;
+            page_get(&file->layout, page, j, &r);
+            print_record(file, &r);
+        }
+    }
+
+    printf("*** OVERFLOW AREA ***\n");
+
+    for (uint64_t page_no = 1; page_no <= file->number_of_pages; page_no++) {
+        if (!is_overflow_page[page_no]) {
+            continue;
+        }
+
+        print_read_page(file, page, page_no);
+        printf("Page: %" PRIu64 "\n", page_no);
+
+        size_t records = (page_no == file->overflow_page) ? file->overflow_page_fill : file->records_per_page;
+        for (size_t i = 0; i < records; i++) {
+            print_record(file, (struct record *)page + i);
+        }
+    }
+
+    index_unlatch(file);
+    free(is_overflow_page);
+    free(page);
+}
+
+void idx_seq_file_stats(struct idx_seq_file *file, struct stats *out)
+{
+    if (file == NULL || out == NULL) {
+        fprintf(stderr, "file or out is NULL\n");
+        return;
+    }
+
+    stats_snapshot(&file->stats, out);
+}
+
+void idx_seq_file_reset_stats(struct idx_seq_file *file)
+{
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return;
+    }
+
+    stats_reset(&file->stats);
+}
+
+void idx_seq_file_reorganize_stats(struct idx_seq_file *file, struct reorganize_stats *out)
+{
+    if (file == NULL || out == NULL) {
+        fprintf(stderr, "file or out is NULL\n");
+        return;
+    }
+
+    index_latch(file, false);
+    get_reorganize_stats(file, out);
+    index_unlatch(file);
+}
+
+int get_record(struct idx_seq_file *file, int32_t key, struct record *r)
+{
+    LOG_ENTRY("get_record");
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!is_open(file)) {
+        fprintf(stderr, "file isn't open\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    if (r == NULL) {
+        fprintf(stderr, "record is NULL\n");
+        return -EINVAL;
+    }
+
+    if (key <= 1) {
+        fprintf(stderr, "Invalid key: %d\n", key);
+        return -EINVAL;
+    }
+
+    uint64_t start = stats_now();
+    int rc;
+
+    // writes during a background reorganization are only in the delta
+    struct idx_seq_delta_entry *entry = delta_find(&file->delta, key);
+    if (entry != NULL) {
+        rc = entry->deleted ? -1 : 0;
+        if (!entry->deleted) {
+            memcpy(r, &entry->record, RECORD_SIZE);
+        }
+    } else {
+        index_latch(file, false);
+        rc = lookup_record(file, key, r);
+        index_unlatch(file);
+    }
+
+    stats_record_latency(&file->stats, STATS_OP_GET, start);
+    return rc;
+}
+
+struct key_position {
+    int32_t key;
+    size_t pos;
+};
+
+static int compare_key_positions(const void *a, const void *b)
+{
+    int32_t ka = ((const struct key_position *)a)->key;
+    int32_t kb = ((const struct key_position *)b)->key;
+
+    return (ka > kb) - (ka < kb);
+}
+
+int get_records(struct idx_seq_file *file, const int32_t *keys, size_t n, struct record *out, int *status)
+{
+    LOG_ENTRY("get_records");
+    if (file == NULL) {
+        fprintf(stderr, "file is NULL\n");
+        return -EINVAL;
+    }
+
+    if (!is_open(file)) {
+        fprintf(stderr, "file isn't open\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    if (n > 0 && (keys == NULL || out == NULL || status == NULL)) {
+        fprintf(stderr, "keys, out or status is NULL\n");
+        return -EINVAL;
+    }
+
+    struct key_position *order = malloc(n * sizeof(struct key_position));
+    if (n > 0 && order == NULL) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        order[i].key = keys[i];
+        order[i].pos = i;
+    }
+    qsort(order, n, sizeof(struct key_position), compare_key_positions);
+
+    uint64_t start = stats_now();
+    index_latch(file, false);
+    if (file->index.size == 0) {
+        index_unlatch(file);
+        free(order);
+        return -EINVAL;
+    }
+
+    struct buffer_frame *frame = NULL;
+    void *page = NULL;
+    uint64_t page_number = 0;
+    size_t gap = 0;
+    int32_t found = 0;
+    int rc = 0;
+
+    // position in the chain before the page position gap, reused while the keys stay in it
+    struct record chain_rec = {};
+    uint64_t chain_ptr = OVERFLOW_PTR_NULL;
+    bool chain_started = false;
+    size_t chain_walked = 0;
+
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        size_t pos = order[i].pos;
+        int32_t key = order[i].key;
+        status[pos] = -1;
+
+        if (key <= 1) {
+            status[pos] = -EINVAL;
+            continue;
+        }
+
+        uint64_t key_page = get_page_number_from_index(file, key);
+        if (key_page == 0) {
+            rc = -EIO;
+            break;
+        }
+        if (key_page != page_number) {
+            if (page != NULL) {
+                page_unpin(file, frame, false);
+                page_unlatch(file, page_number);
+            }
+            page_number = key_page;
+            page_latch(file, page_number, false);
+            page = page_pin(file, page_number, &frame);
+            chain_started = false;
+            if (page == NULL) {
+                page_unlatch(file, page_number);
+                rc = -EIO;
+                break;
+            }
+        }
+
+        size_t idx = page_lower_bound(&file->layout, page, key);
+        if (idx < page_header(page)->count && page_keys(&file->layout, page)[idx] == key) {
+            page_get(&file->layout, page, idx, &out[pos]);
+            status[pos] = 0;
+            found++;
+            count_lookup(file, 0, 0);
+            continue;
+        }
+
+        if (idx != gap) {
+            gap = idx;
+            chain_started = false;
+        }
+
+        if (!chain_started) {
+            chain_ptr = *page_chain(&file->layout, page, gap);
+            chain_rec.key = 0;
+            chain_started = true;
+            chain_walked = 0;
+        }
+
+        size_t walked = chain_walked;
+        while (chain_rec.key < key && chain_ptr != OVERFLOW_PTR_NULL && rc == 0) {
+            rc = read_record_overflow_area(file, chain_ptr, &chain_rec);
+            chain_ptr = chain_rec.overflow_pointer;
+            chain_walked++;
+        }
+        count_lookup(file, chain_walked, chain_walked - walked);
+
+        if (chain_rec.key == key) {
+            memcpy(&out[pos], &chain_rec, RECORD_SIZE);
+            status[pos] = 0;
+            found++;
+        }
+    }
+
+    if (page != NULL) {
+        page_unpin(file, frame, false);
+        page_unlatch(file, page_number);
+    }
+    index_unlatch(file);
+
+    // writes during a background reorganization are only in the delta
+    for (size_t i = 0; i < n && file->delta.size > 0 && rc == 0; i++) {
+        struct idx_seq_delta_entry *entry = delta_find(&file->delta, keys[i]);
+        if (entry == NULL) {
+            continue;
+        }
+
+        found -= (status[i] == 0);
+        status[i] = -1;
+        if (!entry->deleted) {
+            memcpy(&out[i], &entry->record, RECORD_SIZE);
+            status[i] = 0;
+            found++;
+        }
+    }
+
+    free(order);
+    stats_record_latency(&file->stats, STATS_OP_GET_BATCH, start);
+    return rc != 0 ? rc : found;
+}
+
+// Loads the page of index entry pos into the cursor and prefetches the pages after it
+static int cursor_load_page(struct idx_seq_cursor *cursor, size_t pos)
+{
+    assert(cursor != NULL);
+
+    struct idx_seq_file *file = cursor->file;
+    assert(pos < file->index.size);
+
+    cursor->index_pos = pos;
+    cursor->page_number = index_page_number(&file->index, pos);
+    cursor->slot = 0;
+    if (cursor->page_number == 0) {
+        return -EIO;
+    }
+    page_latch(file, cursor->page_number, false);
+    int rc = read_page_from_data_file(file, cursor->page, cursor->page_number);
+    page_unlatch(file, cursor->page_number);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // the header chain holds the keys below the first one, skip it if they are below the lower bound
+    struct page_header *header = page_header(cursor->page);
+    bool chain_below = (header->count > 0 && header->min_key <= cursor->lower_bound);
+    cursor->ovf_ptr = chain_below ? OVERFLOW_PTR_NULL : header->overflow_head;
+
+    // prefetch the following pages as long as they are consecutive on disk, buckets in between
+    size_t stride = file->local_overflow ? 2 : 1;
+    size_t count = 0;
+    uint64_t first = 0;
+    for (size_t i = pos + 1; i < file->index.size && count < file->readahead_pages; i++) {
+        uint64_t page_number = index_page_number(&file->index, i);
+        if (page_number == 0 || (count > 0 && page_number != first + count)) {
+            break;
+        }
+        if (count == 0) {
+            first = page_number;
+        }
+        count += stride;
+    }
+
+    if (count > 0 && file->use_mmap) {
+        mapped_file_prefetch(&file->map, page_offset(file->page_size, first), count * file->page_size);
+    } else if (count > 0) {
+        bufpool_prefetch(&file->pool, first, count);
+    }
+
+    return 0;
+}
+
+int idx_seq_cursor_open(struct idx_seq_file *file, struct idx_seq_cursor *cursor, int32_t lower_bound, int32_t upper_bound)
+{
+    LOG_ENTRY("idx_seq_cursor_open");
+    if (file == NULL || cursor == NULL) {
+        fprintf(stderr, "file or cursor is NULL\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    // the dummy record with key 1 isn't visible
+    if (lower_bound < 2) {
+        lower_bound = 2;
+    }
+
+    memset(cursor, 0x0, sizeof(struct idx_seq_cursor));
+    cursor->page = malloc(file->page_size);
+    if (cursor->page == NULL) {
+        return -ENOMEM;
+    }
+    cursor->file = file;
+    cursor->lower_bound = lower_bound;
+    cursor->upper_bound = upper_bound;
+    cursor->done = (lower_bound > upper_bound);
+
+    index_latch(file, false);
+    int rc = (file->index.size == 0) ? -EINVAL : 0;
+    size_t pos;
+    if (rc == 0 && !cursor->done) {
+        rc = index_lookup(&file->index, lower_bound, &pos);
+    }
+    if (rc == 0 && !cursor->done) {
+        rc = cursor_load_page(cursor, pos);
+    }
+    index_unlatch(file);
+    if (rc != 0) {
+        idx_seq_cursor_close(cursor);
+        return rc;
+    }
+    cursor->delta_pos = delta_lower_bound(&file->delta, lower_bound);
+
+    return 0;
+}
+
+// Returns the next record of the file itself, leaving out the delta. -1 past the end or a negative errno.
+static int cursor_next_base(struct idx_seq_cursor *cursor, struct record *r)
+{
+    assert(cursor != NULL);
+    assert(r != NULL);
+
+    const struct page_layout *layout = &cursor->file->layout;
+    while (!cursor->done) {
+        size_t count = page_header(cursor->page)->count;
+
+        if (cursor->ovf_ptr != OVERFLOW_PTR_NULL) {
+            page_latch(cursor->file, cursor->page_number, false);
+            int rc = read_record_overflow_area(cursor->file, cursor->ovf_ptr, r);
+            page_unlatch(cursor->file, cursor->page_number);
+            if (rc != 0) {
+                cursor->done = true;
+                return rc;
+            }
+            cursor->ovf_ptr = r->overflow_pointer;
+        } else if (cursor->slot < count) {
+            page_get(layout, cursor->page, cursor->slot++, r);
+
+            // skip chains that end below the lower bound
+            bool chain_below = (cursor->slot < count
+                                && page_keys(layout, cursor->page)[cursor->slot] <= cursor->lower_bound);
+            if (!chain_below) {
+                cursor->ovf_ptr = r->overflow_pointer;
+            }
+        } else if (cursor->index_pos + 1 < cursor->file->index.size) {
+            int rc = cursor_load_page(cursor, cursor->index_pos + 1);
+            if (rc != 0) {
+                cursor->done = true;
+                return rc;
+            }
+            continue;
+        } else {
+            cursor->done = true;
+            break;
+        }
+
+        if (r->key < cursor->lower_bound) {
+            continue;
+        }
+
+        if (r->key > cursor->upper_bound) {
+            cursor->done = true;
+            break;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+static int cursor_next(struct idx_seq_cursor *cursor, struct record *r)
+{
+    assert(cursor != NULL);
+    assert(r != NULL);
+
+    // merge the delta of a background reorganization in, its entries win over the file
+    const struct idx_seq_delta *delta = &cursor->file->delta;
+    while (true) {
+        if (!cursor->base_ready) {
+            index_latch(cursor->file, false);
+            int rc = cursor_next_base(cursor, &cursor->base_record);
+            index_unlatch(cursor->file);
+            if (rc < -1) {
+                return rc;
+            }
+            cursor->base_ready = (rc == 0);
+        }
+
+        const struct idx_seq_delta_entry *entry = NULL;
+        if (cursor->delta_pos < delta->size && delta->entries[cursor->delta_pos].record.key <= cursor->upper_bound) {
+            entry = &delta->entries[cursor->delta_pos];
+        }
+
+        if (entry == NULL && !cursor->base_ready) {
+            return -1;
+        }
+
+        if (entry == NULL || (cursor->base_ready && cursor->base_record.key < entry->record.key)) {
+            memcpy(r, &cursor->base_record, RECORD_SIZE);
+            cursor->base_ready = false;
+            return 0;
+        }
+
+        if (cursor->base_ready && cursor->base_record.key == entry->record.key) {
+            cursor->base_ready = false;
+        }
+        cursor->delta_pos++;
+
+        if (!entry->deleted) {
+            memcpy(r, &entry->record, RECORD_SIZE);
+            return 0;
+        }
+    }
+}
+
+int idx_seq_cursor_next(struct idx_seq_cursor *cursor, struct record *r)
+{
+    LOG_ENTRY("idx_seq_cursor_next");
+    if (cursor == NULL || r == NULL) {
+        fprintf(stderr, "cursor or record is NULL\n");
+        return -EINVAL;
+    }
+
+    if (cursor->file == NULL) {
+        return -1;
+    }
+
+    uint64_t start = stats_now();
+    int rc = cursor_next(cursor, r);
+    stats_record_latency(&cursor->file->stats, STATS_OP_SCAN, start);
+
+    return rc;
+}
+
+void idx_seq_cursor_close(struct idx_seq_cursor *cursor)
+{
+    if (cursor == NULL) {
+        return;
+    }
+
+    free(cursor->page);
+    cursor->page = NULL;
+    cursor->done = true;
+    cursor->file = NULL;
+}
+
+int update_record(struct idx_seq_file *file, struct record *r)
+{
+    if (file == NULL) {
+        fprintf(stderr, "File is NULL\n");
+        return -EINVAL;
+    }
+
+    int ret = delete_record(file, r->key);
+
+    ret += add_record(file, r);
+
+    return ret;
+}
+
+/**
+ * Removes key from the file, leaving out the delta. Returns 0, -1 if it
+ * isn't there or a negative errno. The index latch has to be held
+ * exclusively if key is the key of an index entry.
+ */
+static int remove_record(struct idx_seq_file *file, int32_t key)
+{
+    assert(file != NULL);
+
+    uint64_t page_number = get_page_number_from_index(file, key);
+    if (page_number == 0) {
+        return -EIO;
+    }
+    const struct page_layout *layout = &file->layout;
+    page_latch(file, page_number, true);
+    struct buffer_frame *frame;
+    void *page = page_pin(file, page_number, &frame);
+    if (page == NULL) {
+        page_unlatch(file, page_number);
+        return -EIO;
+    }
+    struct page_header *header = page_header(page);
+
+    // find record
+    size_t idx = page_lower_bound(layout, page, key);
+    bool found = false;
+    bool dirty = false;
+    int rc = 0;
+
+    if (idx < header->count && page_keys(layout, page)[idx] == key) {
+        uint64_t ovf_ptr = page_overflow(layout, page)[idx];
+        if (ovf_ptr != OVERFLOW_PTR_NULL) { // simply replace with the first record of its chain
+            struct record tmp;
+            rc = read_record_overflow_area(file, ovf_ptr, &tmp);
+            if (rc == 0) {
+                page_replace(layout, page, idx, &tmp);
+                header->chained--;
+                dirty = true;
+                rc = free_overflow_record(file, ovf_ptr, header->bucket);
+            }
+        } else {
+            page_remove(layout, page, idx);
+            dirty = true;
+        }
+        found = (rc == 0);
+
+    } else {
+        // record can only be in the chain before that position
+        uint64_t *head = page_chain(layout, page, idx);
+        uint64_t prev_ptr = OVERFLOW_PTR_NULL; // OVERFLOW_PTR_NULL while *head is the link
+        struct record prev = {};
+        uint64_t curr_ptr = *head;
+
+        while (curr_ptr != OVERFLOW_PTR_NULL) {
+            struct record current;
+            rc = read_record_overflow_area(file, curr_ptr, &current);
+            if (rc != 0 || current.key > key) {
+                break;
+            }
+
+            if (current.key == key) {
+                if (prev_ptr == OVERFLOW_PTR_NULL) {
+                    *head = current.overflow_pointer;
+                    dirty = true;
+                } else {
+                    prev.overflow_pointer = current.overflow_pointer;
+                    rc = save_record_overflow_area(file, prev_ptr, &prev);
+                }
+
+                if (rc == 0) {
+                    header->chained--;
+                    dirty = true;
+                    rc = free_overflow_record(file, curr_ptr, header->bucket);
+                }
+                found = (rc == 0);
+                break;
+            }
+
+            prev_ptr = curr_ptr;
+            memcpy(&prev, &current, RECORD_SIZE);
+            curr_ptr = current.overflow_pointer;
+        }
+    }
+
+    if (found) {
+        log_write(file, WAL_DELETE, &key, sizeof(int32_t));
+        __atomic_sub_fetch(&file->records, 1, __ATOMIC_RELAXED);
+        stats_add(&file->activity.writes, 1);
+    }
+
+    // the smallest key of the page was deleted
+    size_t pos;
+    int32_t first_key = 0;
+    if (found) {
+        rc = index_lookup(&file->index, key, &pos);
+    }
+    if (found && rc == 0) {
+        rc = index_key(&file->index, pos, &first_key);
+    }
+    if (found && rc == 0 && first_key == key) {
+        int32_t new_first_key = header->min_key;
+        if (header->overflow_head != OVERFLOW_PTR_NULL) {
+            struct record r = {};
+            rc = read_record_overflow_area(file, header->overflow_head, &r);
+            new_first_key = r.key;
+        }
+
+        // an emptied page keeps its old key as the lower bound
+        if (rc == 0 && new_first_key != 0) {
+            rc = index_set_key(&file->index, pos, new_first_key);
+        }
+        if (rc == 0 && new_first_key != 0) {
+            store_index(file);
+        }
+    }
+
+    page_unpin(file, frame, dirty);
+    page_unlatch(file, page_number);
+
+    if (rc != 0) {
+        return dirty ? fail_write(file, rc) : rc;
+    }
+    return found ? 0 : -1;
+}
+
+int delete_record(struct idx_seq_file *file, int32_t key)
+{
+    if (file == NULL) {
+        fprintf(stderr, "File is NULL\n");
+        return -EINVAL;
+    }
+
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
+
+    if (key <= 1) {
+        fprintf(stderr, "Invalid key\n");
+        return -EINVAL;
+    }
+
+    uint64_t start = stats_now();
+    int rc;
+
+    finish_background_reorganize(file, false);
+    if (file->rebuild != NULL) {
+        rc = delta_delete_record(file, key);
+    } else {
+        checkpoint_if_needed(file);
+
+        // only deleting the first key of a page changes the index, which can't
+        // happen to any other key while the index is latched shared
+        // a failed lookup takes the exclusive latch too, remove_record reports it
+        index_latch(file, false);
+        size_t pos;
+        int32_t first_key;
+        if (file->thread_safe && (index_lookup(&file->index, key, &pos) != 0
+                                  || index_key(&file->index, pos, &first_key) != 0 || first_key == key)) {
+            index_unlatch(file);
+            index_latch(file, true);
+        }
+
+        rc = remove_record(file, key);
+        index_unlatch(file);
+
+        if (rc == 0) {
+            rc = commit_writes(file, 1);
+        }
+    }
+
+    stats_record_latency(&file->stats, STATS_OP_DELETE, start);
+    return rc;
+}
+
+#define WRITER_BATCH_PAGES 64
+#define READER_BATCH_PAGES 64
+#define READER_POOL_PAGES 64
+
+/**
+ * Returns the number of records to put on each page rewritten from a key
+ * range holding records that got inserts since it was last reorganized.
+ * With adaptive_fill the range is left a free slot for every insert it is
+ * expected to get again, cold ranges are packed.
+ */
+static size_t range_fill_limit(struct idx_seq_file *file, uint64_t inserts, uint64_t records)
+{
+    assert(file != NULL);
+
+    if (!file->adaptive_fill || records == 0 || __atomic_load_n(&file->inserts, __ATOMIC_RELAXED) == 0) {
+        size_t fill_limit = file->alpha * file->records_per_page;
+        return fill_limit ? fill_limit : 1;
+    }
+
+    size_t fill_limit = file->records_per_page * records / (records + inserts);
+    return fill_limit ? fill_limit : 1;
+}
+
+// Appends pages to a new data file in batches and collects their index entries
+struct page_writer {
+    int fd;
+    struct index *index;
+    const struct page_layout *layout;
+    struct stats *stats;
+    uint8_t *buffer;
+    size_t page_size;
+    size_t buffered_pages;
+    size_t page_fill;
+    size_t fill_limit; // records put on each page, may change between pages
+    size_t stride; // 2 if every page is followed by its bucket
+    uint64_t page_number; // number of the page being filled
+    uint64_t records; // added so far
+};
+
+static int page_writer_init(struct page_writer *writer, struct idx_seq_file *file, int fd, struct index *index)
+{
+    assert(writer != NULL);
+    assert(file != NULL);
+    assert(index != NULL);
+
+    writer->fd = fd;
+    writer->index = index;
+    writer->layout = &file->layout;
+    writer->stats = &file->stats;
+    writer->page_size = file->page_size;
+    writer->buffered_pages = 0;
+    writer->page_fill = 0;
+    writer->page_number = 1;
+    writer->records = 0;
+    writer->fill_limit = range_fill_limit(file, 0, 0);
+    writer->stride = file->local_overflow ? 2 : 1;
+
+    writer->buffer = io_alloc_aligned(WRITER_BATCH_PAGES * writer->page_size);
+    if (writer->buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int page_writer_flush(struct page_writer *writer)
+{
+    LOG_ENTRY("page_writer_flush");
+    assert(writer != NULL);
+
+    if (writer->buffered_pages == 0) {
+        return 0;
+    }
+
+    uint64_t first_page = writer->page_number - writer->buffered_pages;
+    size_t size = writer->buffered_pages * writer->page_size;
+    ssize_t written = io_write_at(writer->fd, writer->buffer, size, page_offset(writer->page_size, first_page));
+    if (written != (ssize_t)size) {
+        return written < 0 ? written : -EIO;
+    }
+    stats_add(&writer->stats->page_writes, writer->buffered_pages);
+    stats_add(&writer->stats->bytes_written, size);
+
+    memset(writer->buffer, 0x0, size);
+    writer->buffered_pages = 0;
+    return 0;
+}
+
+static int page_writer_add(struct page_writer *writer, const struct record *r)
+{
+    assert(writer != NULL);
+    assert(r != NULL);
+
+    void *page = writer->buffer + writer->buffered_pages * writer->page_size;
+
+    if (writer->page_fill == 0) {
+        int rc = index_append(writer->index, r->key, writer->page_number);
+        if (rc != 0) {
+            return rc;
+        }
+        page_format(writer->layout, page);
+        page_header(page)->bucket = writer->stride > 1 ? writer->page_number + 1 : 0;
+    }
+
+    struct record tmp;
+    memcpy(&tmp, r, RECORD_SIZE);
+    tmp.overflow_pointer = OVERFLOW_PTR_NULL;
+    page_insert(writer->layout, page, writer->page_fill, &tmp);
+    writer->page_fill++;
+    writer->records++;
+
+    // the buffer is zeroed, so are the buckets
+    if (writer->page_fill >= writer->fill_limit) {
+        writer->page_fill = 0;
+        writer->page_number += writer->stride;
+        writer->buffered_pages += writer->stride;
+        if (writer->buffered_pages + writer->stride > WRITER_BATCH_PAGES) {
+            return page_writer_flush(writer);
+        }
+    }
+
+    return 0;
+}
+
+// Writes out the partially filled page and everything buffered, returns the number of pages
+static int page_writer_finish(struct page_writer *writer, uint64_t *number_of_pages)
+{
+    assert(writer != NULL);
+    assert(number_of_pages != NULL);
+
+    if (writer->page_fill > 0) {
+        writer->page_fill = 0;
+        writer->page_number += writer->stride;
+        writer->buffered_pages += writer->stride;
+    }
+
+    int rc = page_writer_flush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+
+    *number_of_pages = writer->page_number - 1;
+    return rc;
+}
+
+// Sorted records merged into the file while it is being rebuilt. Once they
+// are used up refill, if there is one, hands out the next ones, leaving size
+// at 0 past the last of them.
+struct merge_input {
+    const struct record *records;
+    size_t size;
+    size_t pos;
+    int (*refill)(void *arg, struct merge_input *input);
+    void *arg;
+};
+
+// Returns 1 if input has a record at pos, 0 if it has run out or a negative errno
+static int merge_input_ready(struct merge_input *input)
+{
+    if (input->pos == input->size && input->refill != NULL) {
+        int rc = input->refill(input->arg, input);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return input->pos < input->size;
+}
+
+// Adds r to writer, preceded by all merged records with smaller keys
+static int rebuild_add(struct page_writer *writer, struct merge_input *input, const struct record *r)
+{
+    assert(writer != NULL);
+    assert(input != NULL);
+
+    int ready;
+    while ((ready = merge_input_ready(input)) > 0 && (r == NULL || input->records[input->pos].key <= r->key)) {
+        if (r != NULL && input->records[input->pos].key == r->key) {
+            fprintf(stderr, "Record with a key %d already exists. Aborting\n", r->key);
+            return -EEXIST;
+        }
+
+        int rc = page_writer_add(writer, &input->records[input->pos]);
+        if (rc != 0) {
+            return rc;
+        }
+        input->pos++;
+    }
+
+    if (ready < 0 || r == NULL) {
+        return ready < 0 ? ready : 0;
+    }
+
+    return page_writer_add(writer, r);
+}
+
+// A rebuild of the file into temporary files. The handle is only read and
+// pages come through a pool of its own, so the rebuild can run on another
+// thread as long as nobody writes to the file.
+struct idx_seq_rebuild {
+    struct idx_seq_file *file;
+    struct merge_input input;
+    struct buffer_pool reader;
+    uint64_t start_ns;
+    char *data_tmp;
+    char *index_tmp;
+    int data_fd;
+    int index_fd;
+    struct index index;
+    uint64_t number_of_pages;
+    uint64_t records;
+    pthread_t thread;
+    int rc; // result of a background rebuild
+    bool done; // set by the worker thread once rc is there
+};
+
+static int rebuild_read_overflow(struct idx_seq_rebuild *rb, uint64_t ovf_ptr, struct record *r)
+{
+    assert(rb != NULL);
+    assert(r != NULL);
+
+    size_t records_per_page = rb->file->records_per_page;
+    struct buffer_frame *frame = bufpool_pin(&rb->reader, slot_page(records_per_page, ovf_ptr), true);
+    if (frame == NULL) {
+        return -EIO;
+    }
+    memcpy(r, frame->data + slot_offset(records_per_page, ovf_ptr), RECORD_SIZE);
+    bufpool_unpin(&rb->reader, frame, false);
+    stats_add(&rb->file->stats.overflow_reads, 1);
+
+    return 0;
+}
+
+// Streams all records of the file in key order into writer, merging the
+// input in. Primary pages are read straight from disk in batches of
+// consecutive pages, overflow chains go through the reader pool.
+static int rebuild_copy_records(struct idx_seq_rebuild *rb, struct page_writer *writer)
+{
+    LOG_ENTRY("rebuild_copy_records");
+    assert(rb != NULL);
+    assert(writer != NULL);
+
+    struct idx_seq_file *file = rb->file;
+    uint64_t number_of_pages = file->number_of_pages;
+    uint8_t *pages = io_alloc_aligned(READER_BATCH_PAGES * file->page_size);
+    if (pages == NULL) {
+        return -ENOMEM;
+    }
+
+    uint64_t batch_first = 0;
+    uint64_t batch_count = 0;
+    int rc = 0;
+
+    for (size_t i = 0; i < file->index.size && rc == 0; i++) {
+        uint64_t page_number = index_page_number(&file->index, i);
+        if (page_number == 0) {
+            rc = -EIO;
+            break;
+        }
+
+        if (page_number < batch_first || page_number >= batch_first + batch_count) {
+            batch_first = page_number;
+            batch_count = number_of_pages - page_number + 1;
+            if (batch_count > READER_BATCH_PAGES) {
+                batch_count = READER_BATCH_PAGES;
+            }
+
+            size_t size = batch_count * file->page_size;
+            ssize_t read = io_read_at(file->data_fd, pages, size, page_offset(file->page_size, batch_first));
+            if (read != (ssize_t)size) {
+                rc = read < 0 ? read : -EIO;
+                break;
+            }
+            stats_add(&file->stats.page_reads, batch_count);
+            stats_add(&file->stats.bytes_read, size);
+        }
+
+        void *page = pages + (page_number - batch_first) * file->page_size;
+        struct page_header *header = page_header(page);
+        size_t count = header->count;
+
+        // pages from here on are filled for this range
+        writer->fill_limit = range_fill_limit(file, header->inserts, count + header->chained);
+
+        // the header chain comes first, every other chain holds the keys between two records
+        for (size_t j = 0; j <= count && rc == 0; j++) {
+            if (j > 0) {
+                struct record r;
+                page_get(&file->layout, page, j - 1, &r);
+                rc = rebuild_add(writer, &rb->input, &r);
+            }
+
+            uint64_t ovf_ptr = *page_chain(&file->layout, page, j);
+            while (ovf_ptr != OVERFLOW_PTR_NULL && rc == 0) {
+                struct record tmp;
+                rc = rebuild_read_overflow(rb, ovf_ptr, &tmp);
+                if (rc == 0) {
+                    rc = rebuild_add(writer, &rb->input, &tmp);
+                }
+                ovf_ptr = tmp.overflow_pointer;
+            }
+        }
+    }
+
+    free(pages);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // merged records greater than every key in the file
+    return rebuild_add(writer, &rb->input, NULL);
+}
+
+
+static int rebuild_init(struct idx_seq_rebuild *rb, struct idx_seq_file *file, const struct merge_input *input)
+{
+    assert(rb != NULL);
+    assert(file != NULL);
+    assert(input != NULL);
+
+    memset(rb, 0x0, sizeof(struct idx_seq_rebuild));
+    rb->file = file;
+    rb->start_ns = stats_now();
+    rb->input = *input;
+    rb->data_fd = -1;
+    rb->index_fd = -1;
+    index_init(&rb->index, &file->stats);
+
+    rb->data_tmp = tmp_path(file->data_file_path);
+    rb->index_tmp = tmp_path(file->index_file_path);
+    if (rb->data_tmp == NULL || rb->index_tmp == NULL) {
+        return -ENOMEM;
+    }
+
+    return bufpool_init(&rb->reader, file->data_fd, SUPERBLOCK_SIZE, file->page_size, READER_POOL_PAGES, &file->stats);
+}
+
+// State of the rebuilt files, they have neither overflow nor free pages
+static void rebuild_state(struct idx_seq_rebuild *rb, struct file_state *state)
+{
+    assert(rb != NULL);
+    assert(state != NULL);
+
+    state->page_size = rb->file->page_size;
+    state->records_per_page = rb->file->records_per_page;
+    state->number_of_pages = rb->number_of_pages;
+    state->free_page_head = 0;
+    state->overflow_page = 0;
+    state->overflow_page_fill = 0;
+    state->overflow_records = 0;
+    state->overflow_free_head = OVERFLOW_PTR_NULL;
+    state->records = rb->records;
+    state->inserts = 0;
+}
+
+// Writes the new data and index files, the old ones aren't touched
+static int rebuild_build(struct idx_seq_rebuild *rb)
+{
+    LOG_ENTRY("rebuild_build");
+    assert(rb != NULL);
+
+    struct idx_seq_file *file = rb->file;
+    struct page_writer writer = {};
+
+    rb->data_fd = open(rb->data_tmp, O_RDWR | O_CREAT | O_TRUNC | (file->direct_io ? O_DIRECT : 0), 0644);
+    rb->index_fd = open(rb->index_tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (rb->data_fd < 0 || rb->index_fd < 0) {
+        fprintf(stderr, "Couldn't create temporary files for reorganization\n");
+        return -EIO;
+    }
+
+    int rc = page_writer_init(&writer, file, rb->data_fd, &rb->index);
+    if (rc != 0) {
+        free(writer.buffer);
+        return rc;
+    }
+
+    rc = rebuild_copy_records(rb, &writer);
+    int finish_rc = page_writer_finish(&writer, &rb->number_of_pages);
+    if (rc != 0 || finish_rc != 0) {
+        fprintf(stderr, "Couldn't write data after reorganization\n");
+        return rc != 0 ? rc : finish_rc;
+    }
+    rb->records = writer.records;
+
+    struct file_state state;
+    rebuild_state(rb, &state);
+    rc = write_superblock(rb->data_fd, &state, rb->index.size, false, &file->stats);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = index_store(&rb->index, rb->index_fd);
+    if (rc != 0) {
+        fprintf(stderr, "Couldn't write index after reorganization\n");
+        return rc;
+    }
+
+    // the log refers to the new files once they are installed
+    if (file->use_wal && (fsync(rb->data_fd) != 0 || fsync(rb->index_fd) != 0)) {
+        rc = -errno;
+    }
+
+    return rc;
+}
+
+// Replaces the files of the handle with the rebuilt ones
+static int rebuild_install(struct idx_seq_file *file, struct idx_seq_rebuild *rb)
+{
+    assert(file != NULL);
+    assert(rb != NULL);
+
+    // the new files are complete, recovery finishes the renames from here on
+    struct file_state state;
+    rebuild_state(rb, &state);
+    if (file->use_wal) {
+        struct iovec iov = { &state, sizeof(struct file_state) };
+        int rc = wal_append(&file->wal, WAL_INSTALL, &iov, 1);
+        if (rc == 0) {
+            rc = wal_flush(&file->wal);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    // mapped before the renames, a file too big for the mapping leaves the old one in place
+    struct mapped_file map = {};
+    if (file->use_mmap) {
+        int rc = mapped_file_init(&map, rb->data_fd);
+        if (rc != 0) {
+            fprintf(stderr, "Couldn't map the data file after reorganization\n");
+            return rc;
         }
     }
 
-    if (is_page_free(page)) {
-        if (found) { /* Add at (idx), move all the greater */
-            memmove(&page[idx+1], &page[idx], RECORD_SIZE * (last_rec_idx - idx + 1));
-            memcpy(&page[idx], r, RECORD_SIZE);
+    // rename() atomically replaces the old files, so they are never missing
+    if (rename(rb->data_tmp, file->data_file_path) != 0 || rename(rb->index_tmp, file->index_file_path) != 0) {
+        fprintf(stderr, "Couldn't replace files after reorganization\n");
+        int rc = -errno;
+        mapped_file_free(&map, page_offset(file->page_size, rb->number_of_pages + 1));
+        // the data file may be replaced already
+        return fail_write(file, rc);
+    }
+
+    // cached pages belong to the replaced file
+    if (file->use_mmap) {
+        mapped_file_free(&file->map, page_offset(file->page_size, file->number_of_pages + 1));
+        file->map = map;
+    } else {
+        bufpool_reset(&file->pool, rb->data_fd);
+    }
+
+    close(file->data_fd);
+    close(file->index_fd);
+    __atomic_store_n(&file->data_fd, rb->data_fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&file->index_fd, rb->index_fd, __ATOMIC_RELAXED);
+    rb->data_fd = -1;
+    rb->index_fd = -1;
+
+    index_free(&file->index);
+    file->index = rb->index;
+    memset(&rb->index, 0x0, sizeof(struct index));
+
+    file->reorganize_pos = 0;
+    file->number_of_pages = rb->number_of_pages;
+    file->free_page_head = 0;
+    file->overflow_page = 0;
+    file->overflow_page_fill = 0;
+    file->overflow_records = 0;
+    file->overflow_free_head = OVERFLOW_PTR_NULL;
+    file->records = rb->records;
+    file->inserts = 0;
+    reset_activity(file);
+
+    if (file->use_wal) {
+        file->index_dirty = false;
+        int rc = io_sync_dir(file->data_file_path);
+        if (rc == 0) {
+            rc = wal_reset(&file->wal, &state, sizeof(struct file_state), NULL, 0);
+        }
+        return rc;
+    }
+
+    return 0;
+}
+
+// Releases what is left of a rebuild, temporary files that weren't installed are removed
+static void rebuild_free(struct idx_seq_rebuild *rb)
+{
+    assert(rb != NULL);
+
+    bufpool_free(&rb->reader);
+    if (rb->data_fd >= 0) {
+        close(rb->data_fd);
+        unlink(rb->data_tmp);
+    }
+    if (rb->index_fd >= 0) {
+        close(rb->index_fd);
+        unlink(rb->index_tmp);
+    }
+    index_free(&rb->index);
+    free(rb->data_tmp);
+    free(rb->index_tmp);
+}
+
+// Rewrites the file without overflow records, merging input into it
+static int rebuild(struct idx_seq_file *file, struct merge_input *input)
+{
+    LOG_ENTRY("rebuild");
+    assert(file != NULL);
+    assert(input != NULL);
+
+    // shared mappings and pread() see the same page cache, the pool has to be
+    // flushed. With a log only a checkpoint may write the data file.
+    int rc = file->use_wal ? checkpoint_locked(file, NULL, 0) : bufpool_flush(&file->pool);
+    if (rc != 0) {
+        return rc;
+    }
+
+    struct idx_seq_rebuild rb;
+    rc = rebuild_init(&rb, file, input);
+    if (rc == 0) {
+        rc = rebuild_build(&rb);
+    }
+    if (rc == 0) {
+        rc = rebuild_install(file, &rb);
+    }
+    if (rc == 0) {
+        stats_add(&file->stats.reorganizations, 1);
+        stats_add(&file->stats.reorganize_ns, stats_now() - rb.start_ns);
+    }
+
+    rebuild_free(&rb);
+    return rc;
+}
+
+static void *rebuild_worker(void *arg)
+{
+    struct idx_seq_rebuild *rb = arg;
+
+    rb->rc = rebuild_build(rb);
+    __atomic_store_n(&rb->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Starts rebuilding the file on a worker thread. Until it is installed
+// writes go to the delta and the old files are only read.
+static int start_background_reorganize(struct idx_seq_file *file)
+{
+    LOG_ENTRY("start_background_reorganize");
+    assert(file != NULL);
+    assert(file->rebuild == NULL);
+
+    int rc = bufpool_flush(&file->pool);
+    if (rc != 0) {
+        return rc;
+    }
+
+    struct idx_seq_rebuild *rb = malloc(sizeof(struct idx_seq_rebuild));
+    if (rb == NULL) {
+        return -ENOMEM;
+    }
+
+    struct merge_input input = {};
+    rc = rebuild_init(rb, file, &input);
+    if (rc == 0) {
+        rc = -pthread_create(&rb->thread, NULL, rebuild_worker, rb);
+    }
+
+    if (rc != 0) {
+        rebuild_free(rb);
+        free(rb);
+        return rc;
+    }
+
+    file->rebuild = rb;
+    return 0;
+}
+
+/**
+ * Installs the background reorganization once the worker is done and
+ * replays the delta onto the file. If the rebuild failed the old file stays
+ * and the delta is replayed onto it. The replay may start another
+ * reorganization, with wait set the function returns only once none runs.
+ */
+static void finish_background_reorganize(struct idx_seq_file *file, bool wait)
+{
+    assert(file != NULL);
+
+    while (file->rebuild != NULL) {
+        struct idx_seq_rebuild *rb = file->rebuild;
+        if (!wait && !__atomic_load_n(&rb->done, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+
+        LOG_ENTRY("finish_background_reorganize");
+        pthread_join(rb->thread, NULL);
+        file->rebuild = NULL;
+
+        int rc = rb->rc;
+        if (rc == 0) {
+            rc = rebuild_install(file, rb);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Background reorganization failed: %s\n", strerror(-rc));
+        } else {
+            stats_add(&file->stats.reorganizations, 1);
+            stats_add(&file->stats.reorganize_ns, stats_now() - rb->start_ns);
+        }
+
+        rebuild_free(rb);
+        free(rb);
+
+        // a record in the delta replaces the one in the file, losing one fails the handle
+        for (size_t i = 0; i < file->delta.size && write_error(file) == 0; i++) {
+            struct idx_seq_delta_entry *entry = &file->delta.entries[i];
+            rc = remove_record(file, entry->record.key);
+            if (rc >= -1 && !entry->deleted) {
+                uint64_t page_number = get_page_number_from_index(file, entry->record.key);
+                ssize_t added = page_number == 0 ? -EIO : insert_records_into_page(file, page_number, &entry->record, 1);
+                rc = added < 0 ? added : 0;
+            }
+            if (rc < -1) {
+                fail_write(file, rc);
+            }
+        }
+        delta_clear(&file->delta);
+
+        reorganize_if_needed(file);
+        if (!wait) {
+            return;
+        }
+    }
+}
+
+// Renames rebuilt files over the old ones unless that happened before the crash
+static int finish_install(struct idx_seq_file *file)
+{
+    assert(file != NULL);
+
+    const char *paths[2] = { file->data_file_path, file->index_file_path };
+    int rc = 0;
+    for (size_t i = 0; i < 2 && rc == 0; i++) {
+        char *tmp = tmp_path(paths[i]);
+        if (tmp == NULL) {
+            rc = -ENOMEM;
+        } else if (access(tmp, F_OK) == 0 && rename(tmp, paths[i]) != 0) {
+            rc = -errno;
+        }
+        free(tmp);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Couldn't replace files after reorganization\n");
+        return rc;
+    }
+
+    rc = io_sync_dir(file->data_file_path);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // the old files are still open
+    close(file->data_fd);
+    close(file->index_fd);
+    file->data_fd = open_file(file->data_file_path, file->direct_io ? O_DIRECT : 0);
+    file->index_fd = open_file(file->index_file_path, 0);
+    if (file->data_fd < 0 || file->index_fd < 0) {
+        return -EIO;
+    }
+
+    bufpool_reset(&file->pool, file->data_fd);
+    return 0;
+}
+
+// Writes the page and index images logged in [start, end) into the files
+static int apply_images(struct idx_seq_file *file, const uint8_t *log, size_t start, size_t end)
+{
+    assert(file != NULL);
+    assert(log != NULL);
+
+    // aligned for O_DIRECT
+    void *page = io_alloc_aligned(file->page_size);
+    if (page == NULL) {
+        return -ENOMEM;
+    }
+
+    struct wal_record_header header;
+    const uint8_t *payload;
+    size_t pos = start;
+    int rc = 0;
+    while (rc == 0 && wal_next(log, end, &pos, &header, &payload)) {
+        if (header.type == WAL_PAGE) {
+            uint64_t page_number;
+            if (header.size != sizeof(uint64_t) + file->page_size) {
+                rc = -EINVAL;
+                break;
+            }
+            memcpy(&page_number, payload, sizeof(uint64_t));
+            memcpy(page, payload + sizeof(uint64_t), file->page_size);
+
+            ssize_t written = io_write_at(file->data_fd, page, file->page_size, page_offset(file->page_size, page_number));
+            if (written != (ssize_t)file->page_size) {
+                rc = written < 0 ? written : -EIO;
+                break;
+            }
+            stats_add(&file->stats.page_writes, 1);
+            stats_add(&file->stats.bytes_written, written);
+        } else if (header.type == WAL_INDEX) {
+            uint64_t offset;
+            if (header.size < sizeof(uint64_t)) {
+                rc = -EINVAL;
+                break;
+            }
+            memcpy(&offset, payload, sizeof(uint64_t));
+
+            size_t size = header.size - sizeof(uint64_t);
+            ssize_t written = io_write_at(file->index_fd, payload + sizeof(uint64_t), size, offset);
+            if (written != (ssize_t)size) {
+                rc = written < 0 ? written : -EIO;
+                break;
+            }
+            stats_add(&file->stats.index_writes, 1);
+            stats_add(&file->stats.bytes_written, written);
+        }
+    }
+    free(page);
+
+    if (rc == 0 && (fsync(file->data_fd) != 0 || fsync(file->index_fd) != 0)) {
+        rc = -errno;
+    }
+
+    return rc;
+}
+
+/**
+ * Brings files that weren't closed cleanly to the state their log
+ * describes. Rebuilt files whose installation was logged replace the old
+ * ones, the images of a checkpoint that was cut short are written again
+ * and the adds and deletes logged since are replayed. Ends with a
+ * checkpoint, the log is left with just the state of the files.
+ */
+static int recover(struct idx_seq_file *file)
+{
+    LOG_ENTRY("recover");
+    assert(file != NULL);
+    assert(file->use_wal);
+
+    uint8_t *log = NULL;
+    size_t size = 0;
+    int rc = wal_read(&file->wal, &log, &size);
+    if (rc != 0) {
+        return rc;
+    }
+
+    struct wal_record_header header;
+    const uint8_t *payload;
+    size_t pos = 0;
+    if (!wal_next(log, size, &pos, &header, &payload) || header.type != WAL_STATE
+        || header.size != sizeof(struct file_state)) {
+        fprintf(stderr, "The files have no log to recover from\n");
+        free(log);
+        return -EINVAL;
+    }
+    struct file_state state;
+    memcpy(&state, payload, sizeof(struct file_state));
+
+    // adds and deletes to replay are in [ops_start, ops_end), images of a checkpoint in [images_start, images_end)
+    size_t ops_start = pos;
+    size_t ops_end = pos;
+    size_t images_start = 0;
+    size_t images_end = 0;
+    size_t run_start = 0; // first image not followed by WAL_CHECKPOINT yet
+    bool installed = false;
+    size_t record_start = pos;
+
+    // a torn record at the end was never committed
+    while (wal_next(log, size, &pos, &header, &payload)) {
+        struct wal_checkpoint checkpoint;
+
+        switch (header.type) {
+        case WAL_ADD:
+        case WAL_DELETE:
+            ops_end = pos;
+            break;
+        case WAL_PAGE:
+        case WAL_INDEX:
+            if (run_start == 0) {
+                run_start = record_start;
+            }
+            break;
+        case WAL_CHECKPOINT:
+            if (header.size != sizeof(struct wal_checkpoint)) {
+                rc = -EINVAL;
+                break;
+            }
+            memcpy(&checkpoint, payload, sizeof(struct wal_checkpoint));
+            images_start = run_start ? run_start : record_start;
+            images_end = record_start;
+            run_start = 0;
+            state = checkpoint.state;
+            // everything before replayed_to is in the images
+            ops_start = checkpoint.replayed_to;
+            ops_end = images_start;
+            if (ops_start > ops_end) {
+                rc = -EINVAL;
+            }
+            break;
+        case WAL_INSTALL:
+            if (header.size != sizeof(struct file_state)) {
+                rc = -EINVAL;
+                break;
+            }
+            memcpy(&state, payload, sizeof(struct file_state));
+            installed = true;
+            ops_start = pos;
+            ops_end = pos;
+            break;
+        }
+        record_start = pos;
+    }
+
+    if (rc == 0) {
+        rc = set_file_state(file, &state);
+    }
+    if (rc == 0 && installed) {
+        rc = finish_install(file);
+    } else if (rc == 0 && images_end > 0) {
+        rc = apply_images(file, log, images_start, images_end);
+    }
+
+    // what is left to replay goes into a clean log starting from the files as they are now
+    if (rc == 0) {
+        rc = wal_reset(&file->wal, &state, sizeof(struct file_state), log + ops_start, ops_end - ops_start);
+    }
+
+    if (rc == 0) {
+        rc = index_load(&file->index, file->index_fd);
+    }
+    if (rc == 0 && file->index.size == 0) {
+        fprintf(stderr, "The index file is empty\n");
+        rc = -EINVAL;
+    }
 
-        } else { /* Add at the end */
-            memcpy(&page[last_rec_idx+1], r, RECORD_SIZE);
+    file->wal.replaying = true;
+    pos = ops_start;
+    while (rc == 0 && pos < ops_end) {
+        // the log holds the records from pos on as its tail
+        if (checkpoint_needed(file)) {
+            rc = checkpoint_locked(file, log + pos, ops_end - pos);
+            if (rc != 0) {
+                break;
+            }
         }
-        save_page_to_data_file(file, page, page_number);
 
-    } else { 
-        size_t i = 0;
-        if (found == false) {
-            i = last_rec_idx;
-        } else {
-            i = idx-1;
+        // duplicates and missing keys are skipped as they were the first time
+        wal_next(log, ops_end, &pos, &header, &payload);
+        int op_rc = 0;
+        if (header.type == WAL_ADD && header.size == RECORD_SIZE) {
+            struct record r;
+            memcpy(&r, payload, RECORD_SIZE);
+            op_rc = insert_record(file, &r);
+        } else if (header.type == WAL_DELETE && header.size == sizeof(int32_t)) {
+            int32_t key;
+            memcpy(&key, payload, sizeof(int32_t));
+            index_latch(file, true);
+            op_rc = remove_record(file, key);
+            index_unlatch(file);
         }
-        bool ret = add_record_overflow_area(file, r, page[i].overflow_pointer);
-        if (ret) {
-            page[i].overflow_pointer = file->overflow_area_size + file->primary_area_size - RECORD_SIZE;
-            save_page_to_data_file(file, page, page_number);
+        if (op_rc < -1) {
+            rc = op_rc;
         }
     }
 
-    double a = (double)file->overflow_area_size;
-    double b = (double)file->primary_area_size;
-    double overflow_ratio = a / (a+b);
-    if (overflow_ratio > BETA) {
-        reorganize(file);
+    if (rc == 0) {
+        file->wal.replaying = false;
+        rc = checkpoint_locked(file, NULL, 0);
     }
 
-    return number_of_disk_operations;
+    free(log);
+    return rc;
 }
 
-static int add_first_record(struct idx_seq_file *file, struct record *r)
+// Has to be called with the index latched exclusively
+static int reorganize_locked(struct idx_seq_file *file)
 {
     assert(file != NULL);
-    assert(r != NULL);
-
-    FILE *data_file = fopen(file->data_file_path, "wb");
-    if (data_file == NULL) {
-        fprintf(stderr, "Couldn't open file: %s\n", file->data_file_path);
-        return -1;
-    }
 
-    FILE *index_file = fopen(file->index_file_path, "wb");
-    if (index_file == NULL) {
-        fprintf(stderr, "Couldn't open file: %s\n", file->index_file_path);
-        fclose(data_file);
-        return -1;
+    // the background reorganization leaves nothing to do
+    if (file->rebuild != NULL) {
+        finish_background_reorganize(file, true);
+        return write_error(file);
     }
 
-    // allocate whole page
-    struct record page[RECORDS_PER_PAGE] = {};
-    r->overflow_pointer = OVERFLOW_PTR_NULL;
-    memcpy(&page[0], r, RECORD_SIZE);
-
-    size_t written = fwrite(page, RECORD_SIZE, RECORDS_PER_PAGE, data_file);
-    assert(written == RECORDS_PER_PAGE);
-    number_of_disk_operations += 1;
-
-    struct index_entry idx_ent = {
-        .key = 1,
-        .page_number = 1
-    };
-
-    written = fwrite(&idx_ent, sizeof(struct index_entry), 1, index_file);
-    number_of_disk_operations += 1;
-    assert(written == 1);
-
-    fclose(index_file);
-    fclose(data_file);
-
-    file->primary_area_size = PAGESIZE;
-    return 0;
+    struct merge_input input = {};
+    return rebuild(file, &input);
 }
 
-int idx_seq_file_init(struct idx_seq_file *file, const char *index_file, const char *data_file)
+int reorganize(struct idx_seq_file *file)
 {
+    LOG_ENTRY("reorganize");
     if (file == NULL) {
-        fprintf(stderr, "file is NULL\n");
+        fprintf(stderr, "File is NULL\n");
         return -EINVAL;
     }
 
-    if (index_file == NULL) {
-        fprintf(stderr, "index_file is NULL\n");
-        return -EINVAL;
+    int rc = write_error(file);
+    if (rc != 0) {
+        return rc;
     }
 
-    if (data_file == NULL) {
-        fprintf(stderr, "data_file is NULL\n");
-        return -EINVAL;
-    }
+    index_latch(file, true);
+    rc = reorganize_locked(file);
+    index_unlatch(file);
 
-    if (!is_file_empty(index_file)) {
-        fprintf(stderr, "index_file isn't empty as expected\n");
-        return -EINVAL;
-    }
+    return rc;
+}
 
-    if (!is_file_empty(data_file)) {
-        fprintf(stderr, "index_file isn't empty as expected\n");
-        return -EINVAL;
+// Records of a primary page and its overflow chains in key order
+struct page_records {
+    struct record *records;
+    size_t size;
+    size_t capacity;
+    uint64_t *overflow_ptrs; // where the records from overflow chains were
+    size_t overflow;
+    size_t overflow_capacity;
+    uint64_t inserts; // got by the pages since they were last reorganized
+    uint64_t bucket; // of the page collected last
+};
+
+static int page_records_push(struct page_records *pr, const struct record *r, uint64_t ovf_ptr)
+{
+    assert(pr != NULL);
+    assert(r != NULL);
+
+    if (pr->size == pr->capacity) {
+        size_t capacity = pr->capacity ? pr->capacity * 2 : 16;
+        struct record *records = realloc(pr->records, capacity * RECORD_SIZE);
+        if (records == NULL) {
+            return -ENOMEM;
+        }
+        pr->records = records;
+        pr->capacity = capacity;
     }
 
-    file->index_file_path = index_file;
-    file->data_file_path = data_file;
-    file->overflow_area_size = 0;
-    file->primary_area_size = 0;
+    if (ovf_ptr != OVERFLOW_PTR_NULL && pr->overflow == pr->overflow_capacity) {
+        size_t capacity = pr->overflow_capacity ? pr->overflow_capacity * 2 : 16;
+        uint64_t *ptrs = realloc(pr->overflow_ptrs, capacity * sizeof(uint64_t));
+        if (ptrs == NULL) {
+            return -ENOMEM;
+        }
+        pr->overflow_ptrs = ptrs;
+        pr->overflow_capacity = capacity;
+    }
 
-    struct record dummy_record;
-    dummy_record.key = 1;
-    dummy_record.overflow_pointer = OVERFLOW_PTR_NULL;
-    memset(&dummy_record.numbers, 0, RECORD_LEN);
+    memcpy(&pr->records[pr->size], r, RECORD_SIZE);
+    pr->records[pr->size].overflow_pointer = OVERFLOW_PTR_NULL;
+    pr->size++;
 
-    int rc = add_first_record(file, &dummy_record);
+    if (ovf_ptr != OVERFLOW_PTR_NULL) {
+        pr->overflow_ptrs[pr->overflow++] = ovf_ptr;
+    }
 
-    return rc;
+    return 0;
 }
 
-static inline uint32_t _ovf_ptr_translate(struct idx_seq_file *file, uint32_t ovf_ptr)
+// Appends the records of page_number and its chains to pr
+static int collect_page_records(struct idx_seq_file *file, uint64_t page_number, struct page_records *pr)
 {
     assert(file != NULL);
-    return (ovf_ptr - file->primary_area_size) / RECORD_SIZE;
-}
+    assert(pr != NULL);
 
-void print_data_file(struct idx_seq_file *file)
-{
-    if (file == NULL) {
-        fprintf(stderr, "file is NULL\n");
-        return;
+    const struct page_layout *layout = &file->layout;
+    struct buffer_frame *frame;
+    void *page = page_pin(file, page_number, &frame);
+    if (page == NULL) {
+        return -EIO;
     }
+    size_t count = page_header(page)->count;
+    pr->inserts += page_header(page)->inserts;
+    pr->bucket = page_header(page)->bucket;
+    int rc = 0;
+
+    for (size_t i = 0; i <= count && rc == 0; i++) {
+        if (i > 0) {
+            struct record r;
+            page_get(layout, page, i - 1, &r);
+            rc = page_records_push(pr, &r, OVERFLOW_PTR_NULL);
+        }
 
-    struct record rec = {};
-    FILE *fp = fopen(file->data_file_path, "rb");
-    if (fp == NULL) {
-        return;
+        uint64_t ovf_ptr = *page_chain(layout, page, i);
+        while (ovf_ptr != OVERFLOW_PTR_NULL && rc == 0) {
+            struct record tmp;
+            rc = read_record_overflow_area(file, ovf_ptr, &tmp);
+            if (rc == 0) {
+                rc = page_records_push(pr, &tmp, ovf_ptr);
+            }
+            ovf_ptr = tmp.overflow_pointer;
+        }
     }
 
-    bool ovf_info = false;
-    uint16_t page_no = 1;
-    size_t records_read = 0;
-    size_t rc = 0;
+    page_unpin(file, frame, false);
+    return rc;
+}
 
-    printf("\n*** MAIN AREA ***\n");
+// Frees the overflow records pr was collected from
+static int release_page_records(struct idx_seq_file *file, struct page_records *pr)
+{
+    assert(file != NULL);
+    assert(pr != NULL);
 
-    while ((rc = fread(&rec, RECORD_SIZE, 1, fp)) > 0) {
-        records_read += rc;
-        if (ovf_info == false && (records_read-1) % RECORDS_PER_PAGE == 0) {
-            printf("Page: %hu\n", page_no);
-            page_no++;
-        }
+    int rc = 0;
+    for (size_t i = 0; i < pr->overflow && rc == 0; i++) {
+        rc = free_overflow_record(file, pr->overflow_ptrs[i], pr->bucket);
+    }
+    pr->overflow = 0;
 
+    return rc;
+}
 
-        printf("%d   |", rec.key);
-        for (size_t i = 0; i < RECORD_LEN; i++) {
-            printf("%hu ", rec.numbers[i]);
-        }
-        if (rec.overflow_pointer == OVERFLOW_PTR_NULL || rec.overflow_pointer == 0) {
-            printf("| %x\n", rec.overflow_pointer);
-        } else {
-            printf("| %x (ovf_idx:%u)\n", rec.overflow_pointer, _ovf_ptr_translate(file, rec.overflow_pointer));
-        }
+// Replaces the contents of page_number with n records sorted by key, the page keeps its bucket
+static int write_page_records(struct idx_seq_file *file, uint64_t page_number, const struct record *rs, size_t n)
+{
+    assert(file != NULL);
+    assert(n <= file->records_per_page);
 
-        if (ovf_info == false && ftell(fp) >= file->primary_area_size) {
-            printf("*** OVERFLOW AREA ***\n");
-            ovf_info = true;
-        }
+    struct buffer_frame *frame;
+    void *page = page_pin(file, page_number, &frame);
+    if (page == NULL) {
+        return -EIO;
+    }
+    uint64_t bucket = page_header(page)->bucket;
+    page_format(&file->layout, page);
+    page_header(page)->bucket = bucket;
+    for (size_t i = 0; i < n; i++) {
+        page_insert(&file->layout, page, i, &rs[i]);
     }
-    number_of_disk_operations += records_read;
+    page_unpin(file, frame, true);
 
-    fclose(fp);
+    return 0;
 }
 
-int get_record(struct idx_seq_file *file, int32_t key, struct record *r)
+// Frees a primary page whose chains were released, along with its bucket
+static int free_primary_page(struct idx_seq_file *file, uint64_t page_number)
 {
-    LOG_ENTRY("get_record");
-    if (file == NULL) {
-        fprintf(stderr, "file is NULL\n");
-        return -EINVAL;
-    }
+    assert(file != NULL);
 
-    if (r == NULL) {
-        fprintf(stderr, "record is NULL\n");
-        return -EINVAL;
+    struct buffer_frame *frame;
+    struct page_header *header = page_pin(file, page_number, &frame);
+    if (header == NULL) {
+        return -EIO;
     }
+    uint64_t bucket = header->bucket;
+    page_unpin(file, frame, false);
 
-    if (key <= 1) {
-        fprintf(stderr, "Invalid key: %d\n", key);
-        return -EINVAL;
+    int rc = free_page(file, page_number);
+    if (rc == 0 && bucket != 0) {
+        rc = free_page(file, bucket);
     }
+    return rc;
+}
 
-    uint16_t page_number = get_page_number_from_index_file(file, key);
-    
-    struct record page[RECORDS_PER_PAGE];
-    read_page_from_data_file(file, page, page_number);
-
-    size_t idx = 0;
-    bool found = false;
-    for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
-        if (page[i].key == key) {
-            memcpy(r, &page[i], RECORD_SIZE);
-            return 0;
-        }
-        if (page[i].key > key) {
-            idx = i-1;
-            found = true;
-            break;
+/**
+ * Spreads the records of pr over the page of index entry pos and as many
+ * new pages as it takes to fill them to fill_limit. The new pages get
+ * index entries right after pos. Returns the number of pages written or a
+ * negative errno.
+ */
+static int split_page(struct idx_seq_file *file, size_t pos, struct page_records *pr, size_t fill_limit)
+{
+    assert(file != NULL);
+    assert(pr != NULL);
+    assert(pr->size > 0);
+
+    size_t number_of_pages = (pr->size + fill_limit - 1) / fill_limit;
+    size_t per_page = (pr->size + number_of_pages - 1) / number_of_pages;
+
+    // the first page keeps its index entry, its key is a lower bound
+    for (size_t i = 1; i < number_of_pages; i++) {
+        uint64_t page_number;
+        int rc = allocate_page(file, &page_number);
+        if (rc == 0) {
+            rc = index_insert(&file->index, pos + i, pr->records[i * per_page].key, page_number);
+            if (rc != 0) {
+                free_page(file, page_number);
+            }
         }
-    }
-
-    if (!found) {
-        for (int last_rec_idx = RECORDS_PER_PAGE-1; last_rec_idx >= 0; last_rec_idx--) {
-            if (page[last_rec_idx].key != 0) {
-                idx = last_rec_idx;
-                break;
+        if (rc != 0) {
+            while (--i > 0) {
+                free_page(file, index_page_number(&file->index, pos + i));
+                index_remove(&file->index, pos + i);
             }
+            return rc;
         }
     }
 
-    uint32_t overflow_ptr = page[idx].overflow_pointer;
-    while (overflow_ptr != OVERFLOW_PTR_NULL) {
-        struct record tmp = {};
-        read_record_overflow_area(file, overflow_ptr, &tmp);
-        if (tmp.key == key) {
-            memcpy(r, &tmp, RECORD_SIZE);
-            return 0;
-        }
-        if (tmp.key > key) {
-            return -1;
-        }
-        overflow_ptr = tmp.overflow_pointer;
+    int rc = release_page_records(file, pr);
+    for (size_t i = 0; i < number_of_pages && rc == 0; i++) {
+        size_t first = i * per_page;
+        size_t n = (pr->size - first < per_page) ? pr->size - first : per_page;
+        uint64_t page_number = index_page_number(&file->index, pos + i);
+        rc = page_number == 0 ? -EIO : write_page_records(file, page_number, &pr->records[first], n);
     }
 
-    return -1;
-}
-
-static uint16_t get_number_of_pages(struct idx_seq_file *file)
-{
-    assert(file != NULL);
-    assert (file->primary_area_size % PAGESIZE == 0);
-
-    return (file->primary_area_size / PAGESIZE);
+    return rc != 0 ? fail_write(file, rc) : (int)number_of_pages;
 }
 
-static int32_t get_next_record_page(struct idx_seq_file *file, uint16_t page_no, struct record *next, size_t index)
+/**
+ * Checkpoints if the pool can't keep pages more written pages until the
+ * next checkpoint. Returns false if it can't even then. Has to be called
+ * with the index latched exclusively.
+ */
+static bool reserve_written_pages(struct idx_seq_file *file, size_t pages, bool index_changed)
 {
     assert(file != NULL);
-    assert(next != NULL);
-
-    struct record page[RECORDS_PER_PAGE] = {};
-    uint16_t pages_total = get_number_of_pages(file);
 
-    while (page_no <= pages_total) {
-        memset(page, 0x0, RECORD_SIZE * RECORDS_PER_PAGE);
-        read_page_from_data_file(file, page, page_no);
-
-        for (; index < RECORDS_PER_PAGE; index++) {
-            if (page[index].key != 0) {
-                memcpy(next, &page[index], RECORD_SIZE);
-                return page[index].key;
-            }
-        }
-        index = 0;
-        page_no++;
+    if (pool_has_room(file, pages)) {
+        return true;
     }
 
-    return 0;
+    if (index_changed) {
+        store_index(file);
+    }
 
+    return checkpoint_locked(file, NULL, 0) == 0 && pool_has_room(file, pages);
 }
 
-// return 0 if not found
-static int32_t get_next_record(struct idx_seq_file *file, int32_t key, struct record *next)
+// Has to be called with the index latched exclusively
+static int reorganize_step(struct idx_seq_file *file, size_t budget)
 {
-    LOG_ENTRY("get_next_record");
     assert(file != NULL);
-    assert(key > 0);
-    assert(next != NULL);
 
-    uint16_t page_number = get_page_number_from_index_file(file, key); 
-    struct record page[RECORDS_PER_PAGE] = {};
-    read_page_from_data_file(file, page, page_number);
+    if (file->number_of_pages == 0 || file->index.size == 0) {
+        return -EINVAL;
+    }
+
+    size_t long_chain = file->beta * file->records_per_page;
+    if (long_chain == 0) {
+        long_chain = 1;
+    }
 
-    bool found_current = false;
-    size_t idx = 0;
+    struct page_records current = {};
+    struct page_records next = {};
+    bool index_changed = false;
+    int rc = 0;
 
-    for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
-        if (page[i].key == key) {
-            idx = i;
-            found_current = true;
+    for (size_t visited = 0; visited < budget && rc == 0; visited++) {
+        if (file->reorganize_pos >= file->index.size) {
+            file->reorganize_pos = 0;
+        }
+        size_t pos = file->reorganize_pos;
+        uint64_t page_number = index_page_number(&file->index, pos);
+        if (page_number == 0) {
+            rc = -EIO;
             break;
         }
 
-        if (page[i].key > key) { // if key is greater, then current is in the overflow area
-            found_current = false;
-            idx = i - 1;
+        current.size = 0;
+        current.overflow = 0;
+        current.inserts = 0;
+        rc = collect_page_records(file, page_number, &current);
+        if (rc != 0) {
             break;
         }
+        size_t fill_limit = range_fill_limit(file, current.inserts, current.size);
 
-        if (i == RECORDS_PER_PAGE-1) {
-            found_current = false;
-            idx = i;
+        // chains longer than the pool can keep written are left to a rewrite of the whole file
+        size_t written_pages = current.overflow + (current.size + fill_limit - 1) / fill_limit + 2;
+        if (!reserve_written_pages(file, written_pages, index_changed)) {
+            rc = reorganize_locked(file);
+            index_changed = false;
+            break;
         }
-    }
-
 
-    if (found_current) { // current in the main area
-        if (page[idx].overflow_pointer != OVERFLOW_PTR_NULL) {
-            read_record_overflow_area(file, page[idx].overflow_pointer, next);
-            return next->key;
-        } else { // the next is page[idx+1] // TODO: jak zero to nie dziala
-            return get_next_record_page(file, page_number, next, idx+1);
+        // the keys of an empty page belong to the chain of the previous page's last record now
+        if (current.size == 0 && pos > 0) {
+            rc = index_remove(&file->index, pos);
+            if (rc != 0) {
+                break;
+            }
+            index_changed = true;
+            rc = free_primary_page(file, page_number);
+            if (rc != 0) {
+                fail_write(file, rc);
+            }
+            continue;
         }
-    } else { // current in the overflow area
-        struct record current = {.key = 0};
-        uint32_t ovf_ptr = page[idx].overflow_pointer;
-        while (true) {
-            read_record_overflow_area(file, ovf_ptr, &current);
-            if (current.key == key) {
+
+        if (current.size <= fill_limit / 2 && pos + 1 < file->index.size) {
+            uint64_t next_page_number = index_page_number(&file->index, pos + 1);
+            if (next_page_number == 0) {
+                rc = -EIO;
+                break;
+            }
+            next.size = 0;
+            next.overflow = 0;
+            next.inserts = 0;
+            rc = collect_page_records(file, next_page_number, &next);
+            if (rc != 0) {
                 break;
-            } else {
-                ovf_ptr = current.overflow_pointer;
-                assert(ovf_ptr != OVERFLOW_PTR_NULL);
-            }
-        }
-
-        if (current.overflow_pointer != OVERFLOW_PTR_NULL) { // next is the next one in the overflow area
-            read_record_overflow_area(file, current.overflow_pointer, next);
-            return next->key;
-        } else { // next is on the next page (if the page exists) // TODO: jak zero to nie dziala
-            // two cases
-            // 1. next is on the 
-            for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
-                if (page[i].key > current.key) {
-                    memcpy(next, &page[i], RECORD_SIZE);
-                    return next->key;
+            }
+
+            // the merged page takes the inserts of both
+            if (current.size + next.size <= range_fill_limit(file, current.inserts + next.inserts,
+                                                             current.size + next.size)) {
+                // the next page goes with its bucket
+                if (!reserve_written_pages(file, current.overflow + next.overflow + 3, index_changed)) {
+                    rc = reorganize_locked(file);
+                    index_changed = false;
+                    break;
                 }
-            }            
 
+                for (size_t i = 0; i < next.size && rc == 0; i++) {
+                    rc = page_records_push(&current, &next.records[i], OVERFLOW_PTR_NULL);
+                }
+                if (rc != 0) {
+                    break;
+                }
 
-            if (page_number + 1 > get_number_of_pages(file)) {
-                return 0;
+                rc = release_page_records(file, &current);
+                if (rc == 0) {
+                    rc = release_page_records(file, &next);
+                }
+                if (rc == 0) {
+                    rc = write_page_records(file, page_number, current.records, current.size);
+                }
+                if (rc == 0) {
+                    rc = index_remove(&file->index, pos + 1);
+                }
+                if (rc == 0) {
+                    index_changed = true;
+                    rc = free_primary_page(file, next_page_number);
+                }
+                if (rc != 0) {
+                    fail_write(file, rc);
+                    break;
+                }
+                file->reorganize_pos = pos + 1;
+                continue;
             }
-            return get_next_record_page(file, page_number+1, next, 0);
         }
+
+        if (current.overflow < long_chain) {
+            file->reorganize_pos = pos + 1;
+            continue;
+        }
+
+        rc = split_page(file, pos, &current, fill_limit);
+        if (rc < 0) {
+            break;
+        }
+        file->reorganize_pos = pos + rc;
+        index_changed = true;
+        rc = 0;
     }
 
-    return 0;
+    if (index_changed) {
+        int store_rc = store_index(file);
+        if (rc == 0) {
+            rc = store_rc;
+        }
+    }
+
+    free(current.records);
+    free(current.overflow_ptrs);
+    free(next.records);
+    free(next.overflow_ptrs);
+    return rc;
 }
 
-int update_record(struct idx_seq_file *file, struct record *r)
+int idx_seq_file_reorganize_step(struct idx_seq_file *file, size_t budget)
 {
+    LOG_ENTRY("idx_seq_file_reorganize_step");
     if (file == NULL) {
-        fprintf(stderr, "File is NULL\n");
+        fprintf(stderr, "file is NULL\n");
         return -EINVAL;
     }
 
-    int ret = delete_record(file, r->key);
+    if (write_error(file) != 0) {
+        return write_error(file);
+    }
 
-    ret += add_record(file, r);
+    // pages can't change under a background reorganization
+    finish_background_reorganize(file, true);
 
-    return ret;
+    uint64_t start = stats_now();
+
+    index_latch(file, true);
+    int rc = reorganize_step(file, budget);
+    reset_activity(file);
+    index_unlatch(file);
+
+    stats_record_latency(&file->stats, STATS_OP_REORGANIZE_STEP, start);
+    return rc;
 }
 
-int delete_record(struct idx_seq_file *file, int32_t key)
+int idx_seq_file_bulk_load(struct idx_seq_file *file, const struct record *records, size_t n)
 {
+    LOG_ENTRY("idx_seq_file_bulk_load");
     if (file == NULL) {
-        fprintf(stderr, "File is NULL\n");
+        fprintf(stderr, "file is NULL\n");
         return -EINVAL;
     }
 
-    if (key <= 1) {
-        fprintf(stderr, "Invalid key\n");
-        return -EINVAL;
+    if (write_error(file) != 0) {
+        return write_error(file);
     }
 
-    number_of_disk_operations = 0;
-
-    uint16_t page_number = get_page_number_from_index_file(file, key);
-    struct record page[RECORDS_PER_PAGE] = {};
-    read_page_from_data_file(file, page, page_number);
-
-    size_t idx = 0;
-    bool found_in_main_area = false;
-
-    // find record
-    for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
-        if (page[i].key == key) {
-            idx = i;
-            found_in_main_area = true;
-            break;
-        }
-        else if (page[i].key > key) {
-            idx = i - 1;
-            break;
-        }
+    if (records == NULL && n > 0) {
+        fprintf(stderr, "records is NULL\n");
+        return -EINVAL;
     }
 
-    // first record on page
-    if (found_in_main_area && idx == 0) {
-        FILE *fp = fopen(file->index_file_path, "rb");
-        struct index_entry tmp = {};
-        size_t read = 0;
-        size_t rc = 0;
-        while ((rc = fread(&tmp, sizeof(struct index_entry), 1, fp)) > 0) {
-            read += rc;
-            if (tmp.key == key) {
+    uint64_t start = stats_now();
 
-                if (page[idx].overflow_pointer != OVERFLOW_PTR_NULL) {
-                    struct record r = {};
-                    read_record_overflow_area(file, page[idx].overflow_pointer, &r);
-                    tmp.key = r.key;
-                } else {
-                    tmp.key = page[idx+1].key;
-                }
+    finish_background_reorganize(file, true);
 
-                fclose(fp);
-                fopen(file->index_file_path, "ab");
-                fseek(fp, (read-1)*(sizeof(struct index_entry)), SEEK_SET);
-                fwrite(&tmp, sizeof(struct index_entry), 1, fp);
-                number_of_disk_operations++;
-                break;
-            }
+    bool sorted = true;
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].key <= 1) {
+            fprintf(stderr, "Key has to be greater than 1\n");
+            return -EINVAL;
+        }
+        if (i > 0 && records[i-1].key >= records[i].key) {
+            sorted = false;
         }
-        number_of_disk_operations += read;
     }
 
-    // if the record is in the main area we gotta move records[idx+1:last]
-    if (found_in_main_area) {
-        if (page[idx].overflow_pointer != OVERFLOW_PTR_NULL) { // simply replace
-            uint32_t ovf_ptr = page[idx].overflow_pointer;
-            struct record tmp;
-            read_record_overflow_area(file, ovf_ptr, &tmp);
-
-            memcpy(&page[idx], &tmp, RECORD_SIZE);
-            memset(&tmp, 0x0, RECORD_SIZE);
-
-            save_record_overflow_area(file, ovf_ptr, &tmp);
-            save_page_to_data_file(file, page, page_number);
-            return number_of_disk_operations;
+    struct record *copy = NULL;
+    if (!sorted) {
+        copy = malloc(n * RECORD_SIZE);
+        if (copy == NULL) {
+            return -ENOMEM;
         }
-
-        if (idx == RECORDS_PER_PAGE-1) { // last 
-            memset(&page[idx], 0x0, RECORD_SIZE);
-        } else {
-            for (size_t i = idx; i+1 < RECORDS_PER_PAGE; i++) {
-                memcpy(&page[i], &page[i+1], RECORD_SIZE);
+        memcpy(copy, records, n * RECORD_SIZE);
+        qsort(copy, n, RECORD_SIZE, compare_records);
+
+        for (size_t i = 1; i < n; i++) {
+            if (copy[i-1].key == copy[i].key) {
+                fprintf(stderr, "Record with a key %d is repeated. Aborting\n", copy[i].key);
+                free(copy);
+                return -EEXIST;
             }
-            memset(&page[RECORDS_PER_PAGE-1], 0x0, RECORD_SIZE);
         }
-
-        save_page_to_data_file(file, page, page_number);
-        return number_of_disk_operations;
+        records = copy;
     }
 
-    // record is in the overflow area
-    struct record prev = {};
-    struct record current = {};
-    memcpy(&prev, &page[idx], RECORD_SIZE);
-    uint32_t ovf_ptr = prev.overflow_pointer;
+    struct merge_input input = {
+        .records = records,
+        .size = n,
+        .pos = 0,
+    };
 
-    read_record_overflow_area(file, ovf_ptr, &current);
+    index_latch(file, true);
+    int rc = (file->index.size == 0) ? -EINVAL : rebuild(file, &input);
+    index_unlatch(file);
+    free(copy);
 
-    if (current.key == key) { // prev is on page in the main area, current in ovf
-        // delete from overflow
-        struct record tmp = {};
-        read_record_overflow_area(file, ovf_ptr, &tmp);
-        memset(&tmp, 0x0, RECORD_SIZE);
-        save_record_overflow_area(file, ovf_ptr, &tmp);
+    stats_record_latency(&file->stats, STATS_OP_BULK_LOAD, start);
+    return rc;
+}
 
-        // update pointer
-        page[idx].overflow_pointer = current.overflow_pointer;
-        save_page_to_data_file(file, page, page_number);
+#define UPGRADE_BATCH_RECORDS 4096
 
-    } else {
-        uint32_t prev_ovf_ptr;
-        while (true) {
-            prev_ovf_ptr = prev.overflow_pointer;
-            memcpy(&prev, &current, RECORD_SIZE);
-            read_record_overflow_area(file, current.overflow_pointer, &current);
-            if (current.key == key) {
-                break;
-            }
-            assert(current.overflow_pointer != OVERFLOW_PTR_NULL);
-        }
+// Records of the legacy files handed to the rebuild of the new ones
+struct upgrade_source {
+    struct legacy_reader reader;
+    struct record records[UPGRADE_BATCH_RECORDS];
+};
 
-        uint32_t curr_ovf_ptr = prev.overflow_pointer;
-        prev.overflow_pointer = current.overflow_pointer;
-        save_record_overflow_area(file, prev_ovf_ptr, &prev);
+static int upgrade_refill(void *arg, struct merge_input *input)
+{
+    struct upgrade_source *source = arg;
 
-        memset(&current, 0x0, RECORD_SIZE);
-        save_record_overflow_area(file, curr_ovf_ptr, &current);
+    size_t n = 0;
+    int rc = 0;
+    while (n < UPGRADE_BATCH_RECORDS && (rc = legacy_reader_next(&source->reader, &source->records[n])) == 0) {
+        n++;
     }
 
-    return number_of_disk_operations;
+    input->records = source->records;
+    input->size = n;
+    input->pos = 0;
+    return rc == -1 ? 0 : rc;
 }
 
-void reorganize_save_page(const char *data_tmp_path, const char *index_tmp_path, struct record *page, uint16_t page_no)
+// Reads the format version from the superblock of a data file
+static int data_file_version(const char *data_file, uint32_t *version)
 {
-    LOG_ENTRY("reorganize_save_page");
-    assert(index_tmp_path != NULL);
-    assert(data_tmp_path != NULL);
-    assert(page != NULL);
-
-    FILE *data = fopen(data_tmp_path, "a+b");
-    FILE *index = fopen(index_tmp_path, "a+b");
-
-    fseek(data, 0, SEEK_END);
-    fseek(index, 0, SEEK_END);
-
-    struct index_entry idx_entry = {
-        .key = page[0].key,
-        .page_number = page_no
-    };
-
-    fwrite(page, RECORD_SIZE, RECORDS_PER_PAGE, data);
-    fwrite(&idx_entry, sizeof(struct index_entry), 1, index);
+    int fd = open(data_file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open file: %s\n", data_file);
+        return -errno;
+    }
 
-    number_of_disk_operations += 2;
+    uint32_t start[2]; // magic and version
+    ssize_t read = io_read_at(fd, start, sizeof(start), 0);
+    close(fd);
+    if (read != sizeof(start) || start[0] != SUPERBLOCK_MAGIC) {
+        fprintf(stderr, "The data file has no superblock\n");
+        return read < 0 ? read : -EINVAL;
+    }
 
-    fclose(index);
-    fclose(data);
+    *version = start[1];
+    return 0;
 }
 
-void reorganize(struct idx_seq_file *file)
+// Writes the records of the legacy files into new files at index_new and data_new
+static int upgrade_write(const char *index_file, const char *data_file, const char *index_new, const char *data_new,
+                         struct upgrade_source *source, const struct idx_seq_file_options *options)
 {
-    LOG_ENTRY("reorganize");
-    if (file == NULL) {
-        fprintf(stderr, "File is NULL\n");
-        return;
+    int index_fd = open(index_file, O_RDONLY);
+    int data_fd = open(data_file, O_RDONLY);
+    if (index_fd < 0 || data_fd < 0) {
+        int rc = -errno;
+        fprintf(stderr, "Couldn't open files: %s, %s\n", index_file, data_file);
+        if (index_fd >= 0) {
+            close(index_fd);
+        }
+        if (data_fd >= 0) {
+            close(data_fd);
+        }
+        return rc;
     }
 
-    const char *data_tmp = "data_tmp.bin";
-    const char *index_tmp = "index_tmp.bin";
-
-    struct record new_page[RECORDS_PER_PAGE] = {};
-    uint16_t new_page_number = 1;
-
-    // set up a dummy record
-    struct record tmp = {.key = 1, .overflow_pointer = OVERFLOW_PTR_NULL};
-    memset(&tmp.numbers, 0x0, RECORD_LEN);
-
-    memcpy(&new_page[0], &tmp, RECORD_SIZE);
-    size_t new_page_idx = 1;
-    int32_t key = 1;
+    struct idx_seq_file file;
+    stats_reset(&file.stats);
+    int rc = legacy_reader_open(&source->reader, index_fd, data_fd, &file.stats);
+    if (rc == 0) {
+        // the new files are only written once, by the rebuild
+        struct idx_seq_file_options new_options = {};
+        if (options != NULL) {
+            new_options = *options;
+        }
+        new_options.records_per_page = source->reader.records_per_page;
+        new_options.use_mmap = false;
+        new_options.background_reorganize = false;
+        new_options.thread_safe = false;
+        new_options.use_wal = false;
+        new_options.buffer_pool_pages = new_options.buffer_pool_pages ? new_options.buffer_pool_pages
+                                                                      : BUFFER_POOL_PAGES;
+
+        rc = idx_seq_file_init_with_options(&file, index_new, data_new, &new_options);
+        if (rc == 0) {
+            struct merge_input input = { .refill = upgrade_refill, .arg = source };
+            rc = rebuild(&file, &input);
+            if (rc == 0 && file.records != source->reader.records) {
+                fprintf(stderr, "Converted %" PRIu64 " records, the superblock has %" PRIu64 "\n", file.records,
+                        source->reader.records);
+                rc = -EINVAL;
+            }
 
-    while (get_next_record(file, key, &tmp) > 0) {
-        tmp.overflow_pointer = OVERFLOW_PTR_NULL;
-        key = tmp.key;
+            int close_rc = idx_seq_file_close(&file);
+            rc = rc != 0 ? rc : close_rc;
+        }
+        legacy_reader_close(&source->reader);
+    }
 
-        memcpy(&new_page[new_page_idx], &tmp, RECORD_SIZE);
-        new_page_idx++;
+    close(index_fd);
+    close(data_fd);
+    return rc;
+}
 
-        if (new_page_idx == ALPHA * RECORDS_PER_PAGE) {
-            reorganize_save_page(data_tmp, index_tmp, new_page, new_page_number);
-            memset(new_page, 0x0, PAGESIZE);
-            new_page_idx = 0;
-            new_page_number++;
-        }
+int idx_seq_file_upgrade(const char *index_file, const char *data_file, const struct idx_seq_file_options *options)
+{
+    LOG_ENTRY("idx_seq_file_upgrade");
+    if (index_file == NULL || data_file == NULL) {
+        fprintf(stderr, "index_file and data_file can't be NULL\n");
+        return -EINVAL;
     }
 
-    if (new_page_idx > 0) {
-        reorganize_save_page(data_tmp, index_tmp, new_page, new_page_number);
+    char *index_new = path_with_suffix(index_file, ".upgrade");
+    char *data_new = path_with_suffix(data_file, ".upgrade");
+    struct upgrade_source *source = malloc(sizeof(struct upgrade_source));
+    if (index_new == NULL || data_new == NULL || source == NULL) {
+        free(index_new);
+        free(data_new);
+        free(source);
+        return -ENOMEM;
     }
 
-    remove(file->data_file_path);
-    remove(file->index_file_path);
+    uint32_t version = 0;
+    int rc = data_file_version(data_file, &version);
+    if (rc == 0 && version == FORMAT_VERSION) {
+        // the data file is replaced first, a converted one may still wait for its index
+        if (access(index_new, F_OK) == 0 && rename(index_new, index_file) != 0) {
+            rc = -errno;
+        }
+        if (rc == 0) {
+            rc = io_sync_dir(index_file);
+        }
+    } else if (rc == 0) {
+        // left behind by a conversion that didn't get to the renames
+        unlink(index_new);
+        unlink(data_new);
+
+        rc = upgrade_write(index_file, data_file, index_new, data_new, source, options);
+        if (rc != 0) {
+            unlink(index_new);
+            unlink(data_new);
+        }
 
-    rename(data_tmp, file->data_file_path);
-    rename(index_tmp, file->index_file_path);
+        if (rc == 0 && rename(data_new, data_file) != 0) {
+            rc = -errno;
+        }
+        if (rc == 0) {
+            rc = io_sync_dir(data_file);
+        }
+        if (rc == 0 && rename(index_new, index_file) != 0) {
+            rc = -errno;
+        }
+        if (rc == 0) {
+            rc = io_sync_dir(index_file);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Couldn't convert %s and %s\n", index_file, data_file);
+        }
+    }
 
-    file->primary_area_size = get_file_size(file->data_file_path);
-    file->overflow_area_size = 0;
-}
\ No newline at end of file
+    free(index_new);
+    free(data_new);
+    free(source);
+    return rc;
+}
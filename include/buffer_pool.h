@@ -0,0 +1,87 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stats.h>
+
+#define BUFPOOL_LOCKS 64 // the hash buckets share this many locks
+
+struct buffer_frame {
+    uint64_t page_number; // 0 if the frame is free
+    uint32_t pin_count;
+    bool loading; // the page is being read, pinning it waits for that
+    bool dirty;
+    bool referenced;
+    int32_t hash_next;
+    uint8_t *data;
+};
+
+struct bufpool_lock {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded; // signalled when a frame of its buckets was read
+};
+
+/* Caches pages of a file, evicting with the CLOCK algorithm and writing
+ * dirty pages back only on eviction or flush. All functions may be called
+ * from several threads, the data of a pinned frame isn't protected though.
+ * Hash bucket b and the frames in it are guarded by
+ * locks[b % BUFPOOL_LOCKS], which is all a hit takes. A miss takes the
+ * pool lock to find a victim, before any bucket lock, and reads the page
+ * without holding a lock while the frame is marked loading. */
+struct buffer_pool {
+    pthread_mutex_t lock; // guards clock_hand and taking free frames
+    pthread_cond_t unpinned; // signalled when a frame is no longer pinned and somebody waits
+    size_t waiting; // threads waiting for unpinned
+    uint64_t unpins; // times a frame became unpinned, a victim search that raced one looks again
+    size_t pinned_frames;
+    size_t dirty_frames;
+    bool keep_dirty; // dirty pages are only written by bufpool_flush, never evicted
+    int fd;
+    size_t offset; // page 1 starts there, pages are numbered from 1
+    size_t page_size;
+    size_t capacity;
+    struct buffer_frame *frames;
+    int32_t *buckets;
+    size_t number_of_buckets;
+    struct bufpool_lock locks[BUFPOOL_LOCKS];
+    size_t clock_hand;
+    struct stats *stats; // page reads and writes are counted there
+    uint64_t hits;
+    uint64_t misses;
+};
+
+int bufpool_init(struct buffer_pool *pool, int fd, size_t offset, size_t page_size, size_t capacity, struct stats *stats);
+
+// Writes back all dirty pages and releases the pool
+void bufpool_free(struct buffer_pool *pool);
+
+// Returns the frame holding page_number with its pin count increased or
+// NULL if it couldn't be read. Page numbers start at 1. If load is false
+// the caller is going to overwrite the whole page and it isn't read from
+// disk. While other threads have every frame pinned the call waits.
+struct buffer_frame *bufpool_pin(struct buffer_pool *pool, uint64_t page_number, bool load);
+
+// Reads the uncached pages among count pages starting at first_page into
+// the pool, each run of consecutive pages with a single read. Prefetching
+// never takes more than half of the pool.
+int bufpool_prefetch(struct buffer_pool *pool, uint64_t first_page, size_t count);
+
+void bufpool_unpin(struct buffer_pool *pool, struct buffer_frame *frame, bool dirty);
+
+// Writes back all dirty pages
+int bufpool_flush(struct buffer_pool *pool);
+
+typedef int (*bufpool_visit_fn)(void *arg, uint64_t page_number, const void *data);
+
+// Calls fn for every dirty page, stops at the first call returning non-zero
+int bufpool_visit_dirty(struct buffer_pool *pool, bufpool_visit_fn fn, void *arg);
+
+size_t bufpool_dirty_pages(struct buffer_pool *pool);
+
+// Drops all cached pages without writing them back and switches to fd
+void bufpool_reset(struct buffer_pool *pool, int fd);
+
+#endif // _BUFFER_POOL_H_
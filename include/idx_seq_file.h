@@ -1,33 +1,255 @@
 #ifndef _INDEXED_SEQUENTIAL_FILE_H_
 #define _INDEXED_SEQUENTIAL_FILE_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <record.h>
+#include <index.h>
+#include <page.h>
+#include <buffer_pool.h>
+#include <mapped_file.h>
+#include <stats.h>
+#include <wal.h>
+#include <reorganize_policy.h>
+#include <stdbool.h>
 
 #define ALPHA 0.5
 #define BETA 0.2
-#define RECORDS_PER_PAGE 10
-#define PAGESIZE (RECORDS_PER_PAGE * RECORD_SIZE)
+#define RECORDS_PER_PAGE 10 // default, see idx_seq_file_options
+#define BUFFER_POOL_PAGES 64
+#define READAHEAD_PAGES 8
+#define REORGANIZE_STEP_PAGES 4
+#define PAGE_LATCHES 256
+#define WAL_CHECKPOINT_BYTES (16u << 20) // log size that triggers a checkpoint
+#define WAL_MIN_POOL_PAGES 16
+#define SUPERBLOCK_SIZE 4096 // start of the data file, followed by the pages
+
+struct idx_seq_file_options {
+    double alpha; // fill factor of rewritten pages in (0, 1], ALPHA if 0
+    // Rewritten pages get as many free slots per record as their key range
+    // got inserts since it was last reorganized, alpha is only used while
+    // there were none in the whole file
+    bool adaptive_fill;
+    double beta; // share of overflow records the ratio policy reorganizes at, BETA if 0
+    size_t buffer_pool_pages;
+    size_t readahead_pages; // primary pages prefetched by cursors
+    bool use_mmap; // access the data file through a shared mapping instead of the buffer pool
+    size_t records_per_page;
+    size_t page_alignment; // pages are padded to a multiple of this power of two, e.g. 4096
+    bool direct_io; // O_DIRECT for the data file, pages have to be aligned to IO_ALIGNMENT
+    bool incremental_reorganize; // writes past beta run a reorganization step instead of a full rewrite
+    size_t reorganize_step_pages; // pages visited by each of those steps
+    bool background_reorganize; // writes past beta start a full rewrite on a worker thread
+    // Calls may come from several threads at once. Each of them pins up to
+    // two pages of the buffer pool. Can't be combined with background_reorganize.
+    bool thread_safe;
+    /* Log adds and deletes to <data_file>.wal. The data and index files
+     * only change at checkpoints, the buffer pool keeps written pages until
+     * then, so it needs WAL_MIN_POOL_PAGES and about 8 more per thread.
+     * Files that weren't closed cleanly are recovered from their log by
+     * idx_seq_file_open(). Can't be combined with use_mmap or
+     * background_reorganize. */
+    bool use_wal;
+    /* Writes sharing one sync of the log, 1 if 0. A write still returns
+     * only once its record is synced, it waits up to
+     * WAL_GROUP_COMMIT_WAIT_US for writes of other threads to join the
+     * sync, so more than 1 only pays off with several writing threads. */
+    size_t wal_group_commit;
+    /* Give every primary page an overflow bucket, a page of its own for the
+     * records of its chains. Rewrites place each bucket right after its
+     * page, other pages get one with their first overflow record. Records
+     * that don't fit go to the shared overflow pages. */
+    bool local_overflow;
+    reorganize_policy_fn reorganize_policy; // asked after adds, reorganize_cost_policy if NULL
+    void *reorganize_policy_arg;
+};
+
+struct idx_seq_delta_entry {
+    struct record record;
+    bool deleted;
+};
+
+// Writes that arrive while a background reorganization runs, sorted by key.
+// They take precedence over the file and are replayed onto the new one.
+struct idx_seq_delta {
+    struct idx_seq_delta_entry *entries;
+    size_t size;
+    size_t capacity;
+};
+
+struct idx_seq_rebuild;
+
+// Counted for the reorganize policy since the last reorganization, see
+// struct reorganize_stats
+struct idx_seq_activity {
+    uint64_t gets;
+    uint64_t get_overflow_reads;
+    uint64_t overflow_reads;
+    uint64_t writes;
+    uint64_t max_chain;
+    uint64_t start_ns;
+};
 
 struct idx_seq_file {
     const char *index_file_path;
     const char *data_file_path;
-    uint32_t primary_area_size;
-    uint32_t overflow_area_size;
+    int index_fd;
+    int data_fd;
+    struct index index;
+    bool use_mmap;
+    bool direct_io;
+    size_t records_per_page;
+    double alpha;
+    double beta;
+    bool adaptive_fill;
+    struct page_layout layout; // primary pages, overflow pages are arrays of records
+    size_t page_size; // layout.size plus padding
+    struct buffer_pool pool; // data file pages, see pool.hits and pool.misses
+    struct mapped_file map; // data file mapping if use_mmap is set
+    size_t readahead_pages;
+    bool incremental_reorganize;
+    size_t reorganize_step_pages;
+    bool background_reorganize;
+    struct idx_seq_rebuild *rebuild; // running background reorganization, NULL if there is none
+    struct idx_seq_delta delta;
+    size_t reorganize_pos; // index entry the next reorganization step starts at
+    bool local_overflow;
+    reorganize_policy_fn reorganize_policy;
+    void *reorganize_policy_arg;
+    struct idx_seq_activity activity;
+    uint64_t number_of_pages; // primary, overflow and free pages of the data file
+    uint64_t free_page_head; // free pages linked through their headers, 0 if none
+    uint64_t overflow_page; // page new overflow records are appended to, 0 if none
+    size_t overflow_page_fill; // records on overflow_page
+    uint64_t overflow_records; // live records in overflow pages
+    uint64_t overflow_free_head; // vacated overflow records, linked through overflow_pointer
+    uint64_t records; // live records, the dummy one included
+    uint64_t inserts; // records added since the last full reorganization, appends left out
+    /* Latching if thread_safe is set. Every call holds the index latch,
+     * exclusively only to change the index or to restructure the file.
+     * Page n is covered by page_latches[n % PAGE_LATCHES], which also
+     * covers the overflow chains of the page. alloc_lock guards the free
+     * lists and everything from number_of_pages to overflow_free_head. */
+    bool thread_safe;
+    pthread_rwlock_t index_latch;
+    pthread_rwlock_t *page_latches;
+    pthread_mutex_t alloc_lock;
+    bool use_wal;
+    struct wal wal; // write-ahead log if use_wal is set
+    bool index_dirty; // the index file is behind the index until the next checkpoint
+    bool has_superblock; // written by this handle, close marks the files clean
+    int error; // of a write that failed half way, every later call fails with it
+    struct stats stats;
+};
+
+// Iterates records in key order. Any modification of the file invalidates
+// open cursors, every opened cursor has to be closed. A cursor can be used
+// by one thread at a time.
+struct idx_seq_cursor {
+    struct idx_seq_file *file;
+    int32_t lower_bound;
+    int32_t upper_bound;
+    size_t index_pos; // index entry of the current page
+    uint64_t page_number; // the current page, latched while its chains are read
+    void *page;
+    size_t slot; // position of the next record on the page
+    uint64_t ovf_ptr; // next record in the overflow area
+    bool done;
+    struct record base_record; // next record of the file, merged with the delta
+    bool base_ready;
+    size_t delta_pos; // next entry of the delta
 };
 
-void reorganize(struct idx_seq_file *file);
+// Rewrites the file without overflow records. Waits for a background
+// reorganization instead if one is running. Returns 0 or a negative errno,
+// -EFBIG if a mapped file outgrew MAPPED_FILE_RESERVE, the old file is
+// kept then.
+int reorganize(struct idx_seq_file *file);
 
+// Visits up to budget primary pages, continuing where the previous step
+// stopped. Pages with long overflow chains are split, nearly empty ones
+// are merged with the next page and empty ones dropped. New pages are
+// appended to the data file or reuse freed ones.
+int idx_seq_file_reorganize_step(struct idx_seq_file *file, size_t budget);
+
+// Returns 0, -1 if there is no such record or a negative errno
 int delete_record(struct idx_seq_file *file, int32_t key);
 
 int update_record(struct idx_seq_file *file, struct record *r);
 
 int idx_seq_file_init(struct idx_seq_file *file, const char *index_file, const char *data_file);
 
+// Creates new files, they have to be empty. options may be NULL for defaults.
+int idx_seq_file_init_with_options(struct idx_seq_file *file, const char *index_file, const char *data_file,
+                                   const struct idx_seq_file_options *options);
+
+// Opens files written by an earlier handle. records_per_page and
+// page_alignment come from the superblock of the data file, options may be
+// NULL for defaults. Files that weren't closed cleanly can only be opened
+// with use_wal.
+int idx_seq_file_open(struct idx_seq_file *file, const char *index_file, const char *data_file,
+                      const struct idx_seq_file_options *options);
+
+/* Converts files of format version 4 (LEGACY_FORMAT_VERSION), with 16 bit
+ * page numbers and byte offset overflow pointers, to the current format in
+ * place. They have to be closed cleanly. records_per_page is kept, the
+ * pages are padded and filled as options say, which may be NULL for
+ * defaults. The new files are written next to the old ones with the suffix
+ * .upgrade and renamed over them, the data file first. Calling it again
+ * after a crash finishes the conversion, converted files are left alone. */
+int idx_seq_file_upgrade(const char *index_file, const char *data_file, const struct idx_seq_file_options *options);
+
+// Flushes both files to stable storage, with use_wal only the log
+int idx_seq_file_sync(struct idx_seq_file *file);
+
+// Writes the logged changes into the data and index files and starts a new
+// log. Returns 0 right away without use_wal.
+int idx_seq_file_checkpoint(struct idx_seq_file *file);
+
+// Closes the index and data files and marks them clean unless a write failed
+// half way, the handle can't be used afterwards
+int idx_seq_file_close(struct idx_seq_file *file);
+
+// Returns 0, -1 if the key is already in use or a negative errno, -EFBIG
+// if a mapped file has no room left in MAPPED_FILE_RESERVE
 int add_record(struct idx_seq_file *file, struct record *r);
 
+// Inserts n records, applying all records of a page with a single page read
+// and write. The reorganization is considered once, after the whole batch.
+// Returns the number of records inserted, duplicates are skipped, or a
+// negative errno, -EIO if a page couldn't be read, -EFBIG as add_record().
+int add_records(struct idx_seq_file *file, const struct record *records, size_t n);
+
+// Merges n records into the file in one sequential rewrite. Pages are filled
+// to alpha and no overflow area is created. Records are sorted first unless
+// they already come in ascending key order. Returns 0 or a negative errno.
+int idx_seq_file_bulk_load(struct idx_seq_file *file, const struct record *records, size_t n);
+
 int get_record(struct idx_seq_file *file, int32_t key, struct record *r);
 
+// Looks up n keys at once, reading every page and overflow chain only once.
+// status[i] is 0 if out[i] holds the record for keys[i] and -1 if there is
+// no such record. Returns the number of records found or a negative errno.
+int get_records(struct idx_seq_file *file, const int32_t *keys, size_t n, struct record *out, int *status);
+
+// Opens a cursor over the keys in [lower_bound, upper_bound]
+int idx_seq_cursor_open(struct idx_seq_file *file, struct idx_seq_cursor *cursor, int32_t lower_bound, int32_t upper_bound);
+
+// Returns 0 and the next record, -1 past the end of the range or a negative errno
+
+int idx_seq_cursor_next(struct idx_seq_cursor *cursor, struct record *r);
+
+void idx_seq_cursor_close(struct idx_seq_cursor *cursor);
+
 void print_data_file(struct idx_seq_file *file);
 
+// Copies the counters of the file, counted since it was opened or the
+// stats were reset. See stats_print_text() and stats_print_json().
+void idx_seq_file_stats(struct idx_seq_file *file, struct stats *out);
+
+void idx_seq_file_reset_stats(struct idx_seq_file *file);
+
+// Fills in what the reorganize policy of the file would be asked with now
+void idx_seq_file_reorganize_stats(struct idx_seq_file *file, struct reorganize_stats *out);
+
 #endif // _INDEXED_SEQUENTIAL_FILE_H_
\ No newline at end of file
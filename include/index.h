@@ -1,11 +1,93 @@
 #ifndef _INDEX_H_
 #define _INDEX_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stats.h>
 
+#define INDEX_PAGE_SIZE 4096
+#define INDEX_PAGE_ENTRIES (INDEX_PAGE_SIZE / sizeof(struct index_entry))
+
+// Entries are kept like this in the index pages of the index file
 struct index_entry {
     int32_t key;
-    uint16_t page_number;
+    uint64_t page_number;
 } __attribute__((packed));
 
-#endif // _INDEX_H_
\ No newline at end of file
+// The entries of an index page as plain arrays for the search kernels
+struct index_run {
+    int32_t keys[INDEX_PAGE_ENTRIES];
+    uint64_t page_numbers[INDEX_PAGE_ENTRIES];
+};
+
+// Root entry of an index page
+struct index_leaf {
+    uint32_t count;
+    uint32_t page; // in the index file
+    struct index_run *run; // NULL until it is loaded
+    bool dirty;
+};
+
+/* Sorted entries in two levels. The root is kept in memory and points to
+ * index pages of up to INDEX_PAGE_ENTRIES entries each, which are loaded
+ * from the index file the first time they are needed and stay loaded.
+ * The index file starts with a header page, the index pages follow and
+ * the root comes after the last of them. Lookups may load index pages from
+ * several threads at once, changes need the index to themselves. */
+struct index {
+    struct index_leaf *leaves;
+    int32_t *first_keys; // first key of every index page
+    size_t *tree; // Fenwick tree over the counts of the leaves, where their positions start
+    size_t leaf_count;
+    size_t leaf_capacity;
+    size_t size; // entries
+    uint32_t pages; // of the index file, the header page included
+    uint32_t *free_pages; // index pages no leaf uses
+    size_t free_count;
+    bool root_dirty; // the root and the header have to be written
+    int fd; // index pages are loaded from
+    struct stats *stats;
+};
+
+// Called with the offset and bytes of every part of the index file that
+// changed since the index was stored
+typedef int (*index_write_fn)(void *arg, uint64_t offset, const void *data, size_t size);
+
+// Makes idx an empty index, stats count its reads and writes
+void index_init(struct index *idx, struct stats *stats);
+
+// Reads the header and the root of the index file behind fd, an empty file
+// is an empty index. idx has to be initialized.
+int index_load(struct index *idx, int fd);
+
+// Writes what changed since the index was loaded or stored to fd, index
+// pages are loaded from it from now on
+int index_store(struct index *idx, int fd);
+
+// Passes the changes index_store() would write to fn, in the same order
+int index_visit_dirty(struct index *idx, index_write_fn fn, void *arg);
+
+int index_append(struct index *idx, int32_t key, uint64_t page_number);
+
+// Inserts an entry at pos, the entries have to stay sorted
+int index_insert(struct index *idx, size_t pos, int32_t key, uint64_t page_number);
+
+int index_remove(struct index *idx, size_t pos);
+
+// Changes the key of the entry at pos, the entries have to stay sorted
+int index_set_key(struct index *idx, size_t pos, int32_t key);
+
+void index_free(struct index *idx);
+
+// Stores the position of the last entry with key <= key (0 if there is
+// none) in *pos. Returns 0 or -EIO if its index page couldn't be read, as
+// the functions below.
+int index_lookup(struct index *idx, int32_t key, size_t *pos);
+
+int index_key(struct index *idx, size_t pos, int32_t *key);
+
+// Returns 0 if the index page of the entry couldn't be read
+uint64_t index_page_number(struct index *idx, size_t pos);
+
+#endif // _INDEX_H_
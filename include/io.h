@@ -0,0 +1,31 @@
+#ifndef _IO_H_
+#define _IO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Alignment of buffers, offsets and sizes for O_DIRECT
+#define IO_ALIGNMENT 4096
+
+// Allocates zeroed memory aligned to IO_ALIGNMENT, released with free()
+void *io_alloc_aligned(size_t size);
+
+// Reads exactly count bytes at offset, retrying on EINTR and short reads.
+// Returns number of bytes read (less than count only at end of file) or -errno.
+ssize_t io_read_at(int fd, void *buf, size_t count, off_t offset);
+
+// Scatter version of io_read_at, fills the buffers in order with one
+// system call in the common case
+ssize_t io_readv_at(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+// Writes exactly count bytes at offset. Returns count or -errno.
+ssize_t io_write_at(int fd, const void *buf, size_t count, off_t offset);
+
+// Returns size of the file behind fd or -errno
+off_t io_file_size(int fd);
+
+// Syncs the directory holding path, so a rename to path survives a crash
+int io_sync_dir(const char *path);
+
+#endif // _IO_H_
@@ -0,0 +1,52 @@
+#ifndef _LEGACY_FORMAT_H_
+#define _LEGACY_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <record.h>
+#include <stats.h>
+
+// Format version of data files with 16 bit page numbers in the index and
+// 32 bit byte offsets as overflow pointers
+#define LEGACY_FORMAT_VERSION 4
+
+struct legacy_root_entry;
+struct legacy_index_entry;
+
+/* Reads the records of a data and index file in LEGACY_FORMAT_VERSION in
+ * key order, the dummy record left out. Only files that were closed
+ * cleanly can be read. Besides the root of the index one index page, one
+ * primary page and one overflow page are kept in memory. */
+struct legacy_reader {
+    int index_fd;
+    int data_fd;
+    size_t page_size;
+    size_t records_per_page;
+    uint64_t pages; // of the data file
+    uint64_t records; // live records according to the superblock, the dummy one included
+    struct legacy_root_entry *root;
+    size_t leaves;
+    size_t leaf; // next index page to read
+    struct legacy_index_entry *entries; // of the index page read last
+    size_t entry_count;
+    size_t entry; // next primary page of entries
+    uint8_t *page; // primary page read last
+    size_t next; // record of page returned once the chain before it is done
+    uint32_t chain; // next record of the chain being read
+    uint8_t *overflow_page;
+    uint32_t overflow_page_number; // 0 if overflow_page holds none
+    int32_t last_key;
+    struct stats *stats; // reads are counted there
+};
+
+// Checks the superblock and loads the root of the index. The caller keeps
+// the files open until the reader is closed.
+int legacy_reader_open(struct legacy_reader *reader, int index_fd, int data_fd, struct stats *stats);
+
+// Returns 0 and the next record, -1 past the last one or -EIO and -EINVAL
+// for files that can't be read
+int legacy_reader_next(struct legacy_reader *reader, struct record *r);
+
+void legacy_reader_close(struct legacy_reader *reader);
+
+#endif // _LEGACY_FORMAT_H_
@@ -0,0 +1,38 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Address space reserved up front so the mapping can grow without moving,
+// the file can't grow past it
+#ifndef MAPPED_FILE_RESERVE
+#define MAPPED_FILE_RESERVE (1ull << 36)
+#endif
+#define MAPPED_FILE_GROWTH (1ull << 20)
+
+// A file mapped with MAP_SHARED at a fixed address. Pointers into it stay
+// valid while it grows.
+struct mapped_file {
+    int fd;
+    uint8_t *base;
+    size_t reserved;
+    size_t mapped; // bytes of the file currently mapped
+};
+
+int mapped_file_init(struct mapped_file *map, int fd);
+
+// Makes sure the first size bytes are mapped, extending the file with
+// ftruncate if needed
+int mapped_file_ensure(struct mapped_file *map, size_t size);
+
+// Asks the kernel to read the given range ahead
+void mapped_file_prefetch(struct mapped_file *map, size_t offset, size_t size);
+
+// Writes dirty pages of the mapping back with msync
+int mapped_file_sync(struct mapped_file *map);
+
+// Unmaps the file and truncates it to size
+void mapped_file_free(struct mapped_file *map, size_t size);
+
+#endif // _MAPPED_FILE_H_
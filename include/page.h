@@ -0,0 +1,87 @@
+#ifndef _PAGE_H_
+#define _PAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <record.h>
+
+#define PAGE_FREE 0x1 // not in use, overflow_head holds the number of the next free page
+
+struct page_header {
+    uint16_t count; // records on the page
+    uint16_t flags;
+    int32_t min_key; // 0 if the page is empty
+    int32_t max_key;
+    uint32_t chained; // records in the overflow chains of the page
+    uint32_t inserts; // records added since a reorganization wrote the page, appends left out
+    uint64_t overflow_head; // chain of the keys below min_key
+    uint64_t bucket; // overflow page holding the chains of this page only, 0 if none
+};
+
+// Offsets of the arrays following the header of a primary page, the
+// overflow pointers come first to stay aligned. keys and overflow
+// pointers are kept in key order, slots maps each of them to its
+// payload, slots[count..capacity) are the free payloads. The chain of
+// overflow[i] holds the keys between keys[i] and keys[i+1].
+struct page_layout {
+    size_t capacity;
+    size_t keys;
+    size_t overflow;
+    size_t slots;
+    size_t payload;
+    size_t size; // bytes taken by a page, a multiple of 8
+};
+
+void page_layout_init(struct page_layout *layout, size_t capacity);
+
+// Turns page into an empty page
+void page_format(const struct page_layout *layout, void *page);
+
+static inline struct page_header *page_header(void *page)
+{
+    return page;
+}
+
+static inline int32_t *page_keys(const struct page_layout *layout, void *page)
+{
+    return (int32_t *)((uint8_t *)page + layout->keys);
+}
+
+static inline uint64_t *page_overflow(const struct page_layout *layout, void *page)
+{
+    return (uint64_t *)((uint8_t *)page + layout->overflow);
+}
+
+static inline uint16_t *page_slots(const struct page_layout *layout, void *page)
+{
+    return (uint16_t *)((uint8_t *)page + layout->slots);
+}
+
+// Returns the payload of the record at position pos
+static inline uint8_t *page_payload(const struct page_layout *layout, void *page, size_t pos)
+{
+    return (uint8_t *)page + layout->payload + page_slots(layout, page)[pos] * RECORD_LEN;
+}
+
+// Returns the head of the chain holding the keys between the records at
+// pos - 1 and pos, the header chain for pos 0
+static inline uint64_t *page_chain(const struct page_layout *layout, void *page, size_t pos)
+{
+    return pos == 0 ? &page_header(page)->overflow_head : &page_overflow(layout, page)[pos - 1];
+}
+
+// Returns the position of the first key >= key, count if there is none
+size_t page_lower_bound(const struct page_layout *layout, void *page, int32_t key);
+
+// Copies the record at pos to r
+void page_get(const struct page_layout *layout, void *page, size_t pos, struct record *r);
+
+// Inserts r at pos, the page can't be full and pos has to keep keys sorted
+void page_insert(const struct page_layout *layout, void *page, size_t pos, const struct record *r);
+
+// Overwrites the record at pos with r, keys have to stay sorted
+void page_replace(const struct page_layout *layout, void *page, size_t pos, const struct record *r);
+
+void page_remove(const struct page_layout *layout, void *page, size_t pos);
+
+#endif // _PAGE_H_
@@ -5,12 +5,14 @@
 
 #define RECORD_LEN 15
 #define RECORD_SIZE (sizeof(struct record))
-#define OVERFLOW_PTR_NULL 0xdeaddead
+#define OVERFLOW_PTR_NULL UINT64_MAX
 
 struct record {
     uint8_t numbers[RECORD_LEN];
     int32_t key;
-    uint32_t overflow_pointer;
+    // Next record of the chain as a slot, (page - 1) * records_per_page plus
+    // its position on the overflow page, OVERFLOW_PTR_NULL at the end
+    uint64_t overflow_pointer;
 } __attribute__((packed));
 
 // Prints a record in a human-readable format
@@ -0,0 +1,51 @@
+#ifndef _REORGANIZE_POLICY_H_
+#define _REORGANIZE_POLICY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What a policy gets to see after writes. The activity counters start over
+// whenever the file is reorganized, fully or by a step.
+struct reorganize_stats {
+    uint64_t primary_pages;
+    uint64_t overflow_records; // live ones
+    uint64_t records;
+    size_t records_per_page;
+    double alpha;
+    double beta;
+    uint64_t gets; // keys looked up, also by get_records()
+    uint64_t get_overflow_reads; // overflow records walked by those lookups
+    uint64_t overflow_reads; // overflow records read by any call, writes and cursors too
+    uint64_t writes; // records added and deleted
+    uint64_t max_chain; // longest overflow walk of a lookup
+    uint64_t elapsed_ns;
+    uint64_t rewrite_pages; // pages the reorganization would read and write
+};
+
+// Returns true if the file should be reorganized now. arg is the one given
+// with the policy in idx_seq_file_options.
+typedef bool (*reorganize_policy_fn)(void *arg, const struct reorganize_stats *stats);
+
+// Overflow records per primary page
+double reorganize_mean_chain(const struct reorganize_stats *stats);
+
+// Overflow records read per lookup, the read amplification a reorganization removes
+double reorganize_read_amplification(const struct reorganize_stats *stats);
+
+// Records added and deleted per second
+double reorganize_write_rate(const struct reorganize_stats *stats);
+
+// Reorganizes once the share of overflow records in all record slots exceeds beta
+bool reorganize_ratio_policy(void *arg, const struct reorganize_stats *stats);
+
+// Expects the coming calls to read as many overflow records as the ones since
+// the last reorganization did and reorganizes once that exceeds the pages the
+// rewrite costs. Chains no call walks never trigger it, long ones that are
+// walked often do so soon.
+bool reorganize_cost_policy(void *arg, const struct reorganize_stats *stats);
+
+// Returns the policy called name ("ratio" or "cost"), NULL if there is none
+reorganize_policy_fn reorganize_policy(const char *name);
+
+#endif // _REORGANIZE_POLICY_H_
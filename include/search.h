@@ -0,0 +1,23 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns the number of keys[0..n) smaller than key
+typedef size_t (*search_kernel_fn)(const int32_t *keys, size_t n, int32_t key);
+
+size_t search_count_less_scalar(const int32_t *keys, size_t n, int32_t key);
+
+// Counts with the best kernel the CPU supports, picked on the first call
+size_t search_count_less(const int32_t *keys, size_t n, int32_t key);
+
+// Returns the kernel called name ("scalar", "sse2" or "avx2"), NULL if it
+// doesn't exist or the CPU can't run it
+search_kernel_fn search_kernel(const char *name);
+
+// Returns the position of the first key >= key in the sorted keys[0..n), n
+// if there is none. Long arrays are narrowed down by a binary search first.
+size_t search_lower_bound(const int32_t *keys, size_t n, int32_t key);
+
+#endif // _SEARCH_H_
@@ -0,0 +1,84 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Bucket i of a latency histogram counts latencies in [2^i, 2^(i+1)) ns,
+// the last one everything longer
+#define STATS_LATENCY_BUCKETS 40
+// Bucket i counts lookups that walked i overflow records, the last one longer walks
+#define STATS_CHAIN_BUCKETS 17
+
+enum stats_op {
+    STATS_OP_GET,
+    STATS_OP_GET_BATCH,
+    STATS_OP_ADD,
+    STATS_OP_ADD_BATCH,
+    STATS_OP_DELETE,
+    STATS_OP_SCAN, // a single idx_seq_cursor_next()
+    STATS_OP_BULK_LOAD,
+    STATS_OP_REORGANIZE_STEP,
+    STATS_OP_SYNC,
+    STATS_OPS,
+};
+
+struct stats_histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_LATENCY_BUCKETS];
+};
+
+// Counters of a file. Every field is a uint64_t, they are updated with
+// atomic adds and may be read while other threads update them.
+struct stats {
+    uint64_t page_reads;
+    uint64_t page_writes;
+    uint64_t overflow_reads; // overflow records
+    uint64_t overflow_writes;
+    uint64_t index_reads; // index pages loaded, the root counts as one
+    uint64_t index_writes; // index pages, roots and headers written
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t reorganizations; // full rewrites, also the background ones
+    uint64_t reorganize_ns;
+    uint64_t log_bytes; // written to the write-ahead log
+    uint64_t log_syncs;
+    uint64_t checkpoints;
+    uint64_t chain_lengths[STATS_CHAIN_BUCKETS];
+    struct stats_histogram latency[STATS_OPS];
+};
+
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Monotonic clock in nanoseconds
+uint64_t stats_now(void);
+
+// Adds the latency of op, started at start_ns
+void stats_record_latency(struct stats *stats, enum stats_op op, uint64_t start_ns);
+
+void stats_record_chain(struct stats *stats, size_t length);
+
+// Copies stats field by field, a concurrent update may fall on either side
+void stats_snapshot(const struct stats *stats, struct stats *out);
+
+void stats_reset(struct stats *stats);
+
+const char *stats_op_name(enum stats_op op);
+
+// Returns an upper bound of the latency below which a fraction p of the
+// recorded ones fall, 0 if there are none
+uint64_t stats_percentile(const struct stats_histogram *histogram, double p);
+
+// One "name value" line per counter, latencies as count, mean and percentiles
+void stats_print_text(const struct stats *stats, FILE *out);
+
+// The same as a single JSON object, histograms with all their buckets
+void stats_print_json(const struct stats *stats, FILE *out);
+
+#endif // _STATS_H_
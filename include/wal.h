@@ -0,0 +1,88 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <stats.h>
+
+enum wal_record_type {
+    WAL_STATE = 1, // first record of every log, the state of the files it starts from
+    WAL_ADD, // a record
+    WAL_DELETE, // a key
+    WAL_PAGE, // a page number followed by the page, written by checkpoints
+    WAL_INDEX, // an offset into the index file followed by what a checkpoint writes there
+    WAL_CHECKPOINT, // ends the images of a checkpoint
+    WAL_INSTALL, // rebuilt files are about to replace the old ones
+};
+
+#define WAL_GROUP_COMMIT_WAIT_US 200 // longest a commit waits for the rest of its group
+
+struct wal_record_header {
+    uint32_t size; // payload bytes following the header
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t checksum; // CRC-32 of the fields above and the payload
+};
+
+// A log appended through a buffer. Records reach the file when a commit,
+// a flush or a reset writes the buffer out. Appends and commits may come
+// from several threads, a thread that finds another one syncing the log
+// waits for it and then syncs what has been appended meanwhile. Positions
+// in the log count every byte appended since it was opened, resets don't
+// start them over.
+struct wal {
+    int fd;
+    char *path;
+    pthread_mutex_t lock;
+    pthread_cond_t flushed; // signalled when a sync is done
+    uint8_t *buffer; // appended, not handed to the file yet
+    size_t buffered;
+    size_t capacity;
+    uint8_t *spare; // written by the syncing thread while appends go to buffer
+    size_t spare_capacity;
+    uint64_t start; // position of the start of the file
+    uint64_t written; // position up to which the log was handed to the file
+    uint64_t durable; // position up to which the log is on stable storage
+    bool flushing;
+    int error; // a failed write loses records, every later call fails
+    size_t group_commit; // commits sharing one sync
+    size_t pending; // commits waiting for the next sync
+    bool replaying; // set while the log is replayed, writes aren't logged again
+    struct stats *stats; // log bytes and syncs are counted there
+};
+
+// Opens or creates the log at path, records already in it are kept
+int wal_open(struct wal *wal, const char *path, size_t group_commit, struct stats *stats);
+
+// Writes out what is buffered and closes the log file
+void wal_close(struct wal *wal);
+
+// Appends a record built from iovcnt buffers
+int wal_append(struct wal *wal, uint16_t type, const struct iovec *iov, int iovcnt);
+
+// Counts n commits and returns once everything appended before is synced.
+// The commit that makes group_commit of them pending syncs the log for all,
+// one that waited WAL_GROUP_COMMIT_WAIT_US for that syncs it by itself.
+int wal_commit(struct wal *wal, size_t n);
+
+// Syncs everything appended so far
+int wal_flush(struct wal *wal);
+
+// Returns the size of the log with the buffered records
+uint64_t wal_size(struct wal *wal);
+
+// Replaces the log with a new one holding a WAL_STATE record and tail, a
+// run of records taken from the old log. Nothing may be buffered.
+int wal_reset(struct wal *wal, const void *state, size_t state_size, const void *tail, size_t tail_size);
+
+// Reads the whole log file into *data, released with free()
+int wal_read(struct wal *wal, uint8_t **data, size_t *size);
+
+// Returns the record at *pos of data and moves *pos past it. Returns false
+// at the end of data and at a torn or corrupted record.
+bool wal_next(const uint8_t *data, size_t size, size_t *pos, struct wal_record_header *header, const uint8_t **payload);
+
+#endif // _WAL_H_
@@ -0,0 +1,638 @@
+#include <index.h>
+#include <io.h>
+#include <search.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC 0x58444e49 // "INDX"
+#define INDEX_VERSION 2 // 1 had 16 bit page numbers
+
+// Start of the header page of the index file
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // entries
+    uint32_t leaves;
+    uint32_t pages; // the root starts behind them
+};
+
+// The root as it is stored behind the index pages
+struct index_root_entry {
+    int32_t first_key;
+    uint32_t count;
+    uint32_t page;
+};
+
+void index_init(struct index *idx, struct stats *stats)
+{
+    assert(idx != NULL);
+    assert(stats != NULL);
+
+    memset(idx, 0x0, sizeof(struct index));
+    idx->pages = 1;
+    idx->fd = -1;
+    idx->stats = stats;
+}
+
+static int reserve_leaves(struct index *idx, size_t capacity)
+{
+    assert(idx != NULL);
+
+    if (capacity <= idx->leaf_capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = idx->leaf_capacity ? idx->leaf_capacity : 16;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    struct index_leaf *leaves = realloc(idx->leaves, new_capacity * sizeof(struct index_leaf));
+    if (leaves == NULL) {
+        return -ENOMEM;
+    }
+    idx->leaves = leaves;
+
+    int32_t *first_keys = realloc(idx->first_keys, new_capacity * sizeof(int32_t));
+    if (first_keys == NULL) {
+        return -ENOMEM;
+    }
+    idx->first_keys = first_keys;
+
+    // the tree is 1-based
+    size_t *tree = realloc(idx->tree, (new_capacity + 1) * sizeof(size_t));
+    if (tree == NULL) {
+        return -ENOMEM;
+    }
+    idx->tree = tree;
+
+    // leaves and free pages never outnumber the leaves there have been
+    uint32_t *free_pages = realloc(idx->free_pages, new_capacity * sizeof(uint32_t));
+    if (free_pages == NULL) {
+        return -ENOMEM;
+    }
+    idx->free_pages = free_pages;
+
+    idx->leaf_capacity = new_capacity;
+    return 0;
+}
+
+// Takes an index page no leaf uses or appends one to the file
+static uint32_t allocate_page(struct index *idx)
+{
+    assert(idx != NULL);
+
+    if (idx->free_count > 0) {
+        return idx->free_pages[--idx->free_count];
+    }
+
+    return idx->pages++;
+}
+
+/**
+ * Returns the entries of leaf l, reading them from the index file if they
+ * aren't loaded yet, or NULL if they couldn't be read. Threads loading the
+ * same leaf at once keep the run published first.
+ */
+static struct index_run *leaf_run(struct index *idx, size_t l)
+{
+    assert(idx != NULL);
+    assert(l < idx->leaf_count);
+
+    struct index_leaf *leaf = &idx->leaves[l];
+    struct index_run *run = __atomic_load_n(&leaf->run, __ATOMIC_ACQUIRE);
+    if (run != NULL) {
+        return run;
+    }
+
+    run = malloc(sizeof(struct index_run));
+    struct index_entry *entries = malloc(INDEX_PAGE_SIZE);
+    if (run == NULL || entries == NULL) {
+        free(run);
+        free(entries);
+        return NULL;
+    }
+
+    ssize_t read = io_read_at(idx->fd, entries, INDEX_PAGE_SIZE, (off_t)leaf->page * INDEX_PAGE_SIZE);
+    if (read != INDEX_PAGE_SIZE) {
+        free(run);
+        free(entries);
+        return NULL;
+    }
+    stats_add(&idx->stats->index_reads, 1);
+    stats_add(&idx->stats->bytes_read, read);
+
+    for (size_t i = 0; i < leaf->count; i++) {
+        run->keys[i] = entries[i].key;
+        run->page_numbers[i] = entries[i].page_number;
+    }
+    free(entries);
+
+    struct index_run *expected = NULL;
+    if (!__atomic_compare_exchange_n(&leaf->run, &expected, run, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(run);
+        run = expected;
+    }
+
+    return run;
+}
+
+// Adds delta to the count of leaf l in the tree
+static void tree_add(struct index *idx, size_t l, ptrdiff_t delta)
+{
+    for (size_t i = l + 1; i <= idx->leaf_count; i += i & -i) {
+        idx->tree[i] += delta;
+    }
+}
+
+// Builds the tree from the counts of the leaves, after leaves were added or dropped
+static void tree_build(struct index *idx)
+{
+    for (size_t i = 1; i <= idx->leaf_count; i++) {
+        idx->tree[i] = idx->leaves[i - 1].count;
+    }
+    for (size_t i = 1; i <= idx->leaf_count; i++) {
+        size_t parent = i + (i & -i);
+        if (parent <= idx->leaf_count) {
+            idx->tree[parent] += idx->tree[i];
+        }
+    }
+}
+
+// Returns the position of the first entry of leaf l
+static size_t leaf_start(const struct index *idx, size_t l)
+{
+    assert(idx != NULL);
+    assert(l < idx->leaf_count);
+
+    size_t start = 0;
+    for (size_t i = l; i > 0; i -= i & -i) {
+        start += idx->tree[i];
+    }
+
+    return start;
+}
+
+// Returns the leaf holding the entry at pos, *i gets its place in the leaf
+static size_t leaf_of(const struct index *idx, size_t pos, size_t *i)
+{
+    assert(idx != NULL);
+    assert(pos < idx->size);
+
+    // descends the tree to the last leaf whose entries all come before pos
+    size_t step = 1;
+    while (step * 2 <= idx->leaf_count) {
+        step *= 2;
+    }
+
+    size_t l = 0;
+    for (; step > 0; step /= 2) {
+        if (l + step <= idx->leaf_count && idx->tree[l + step] <= pos) {
+            l += step;
+            pos -= idx->tree[l];
+        }
+    }
+
+    *i = pos;
+    return l;
+}
+
+int index_load(struct index *idx, int fd)
+{
+    assert(idx != NULL);
+
+    off_t file_size = io_file_size(fd);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    struct stats *stats = idx->stats;
+    index_free(idx);
+    index_init(idx, stats);
+    idx->fd = fd;
+    if (file_size == 0) {
+        return 0;
+    }
+
+    struct index_header header;
+    ssize_t read = io_read_at(fd, &header, sizeof(header), 0);
+    if (read != sizeof(header)) {
+        return read < 0 ? read : -EIO;
+    }
+    if (header.magic != INDEX_MAGIC || header.version != INDEX_VERSION || header.pages == 0) {
+        fprintf(stderr, "Not an index file of version %u\n", INDEX_VERSION);
+        return -EINVAL;
+    }
+
+    size_t root_size = header.leaves * sizeof(struct index_root_entry);
+    struct index_root_entry *root = malloc(root_size ? root_size : 1);
+    uint8_t *used = calloc(header.pages, sizeof(uint8_t));
+    int rc = reserve_leaves(idx, header.leaves);
+    if (root == NULL || used == NULL || rc != 0) {
+        free(root);
+        free(used);
+        return -ENOMEM;
+    }
+
+    read = io_read_at(fd, root, root_size, (off_t)header.pages * INDEX_PAGE_SIZE);
+    if (read != (ssize_t)root_size) {
+        free(root);
+        free(used);
+        return read < 0 ? read : -EIO;
+    }
+    stats_add(&idx->stats->index_reads, 1);
+    stats_add(&idx->stats->bytes_read, sizeof(header) + root_size);
+
+    size_t start = 0;
+    for (size_t l = 0; l < header.leaves; l++) {
+        if (root[l].page == 0 || root[l].page >= header.pages || root[l].count > INDEX_PAGE_ENTRIES) {
+            rc = -EINVAL;
+            break;
+        }
+        idx->leaves[l] = (struct index_leaf){ .count = root[l].count, .page = root[l].page };
+        idx->first_keys[l] = root[l].first_key;
+        used[root[l].page] = 1;
+        start += root[l].count;
+    }
+    free(root);
+
+    if (rc == 0 && start != header.size) {
+        rc = -EINVAL;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "The root of the index file is damaged\n");
+        free(used);
+        return rc;
+    }
+
+    idx->leaf_count = header.leaves;
+    idx->size = header.size;
+    idx->pages = header.pages;
+    tree_build(idx);
+
+    // pages of dropped leaves are reused, as many as there is room for next to the leaves
+    for (uint32_t page = 1; page < header.pages && idx->leaf_count + idx->free_count < idx->leaf_capacity; page++) {
+        if (!used[page]) {
+            idx->free_pages[idx->free_count++] = page;
+        }
+    }
+    free(used);
+
+    return 0;
+}
+
+int index_visit_dirty(struct index *idx, index_write_fn fn, void *arg)
+{
+    assert(idx != NULL);
+    assert(fn != NULL);
+
+    uint8_t *buffer = calloc(1, INDEX_PAGE_SIZE);
+    if (buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    int rc = 0;
+    for (size_t l = 0; l < idx->leaf_count && rc == 0; l++) {
+        struct index_leaf *leaf = &idx->leaves[l];
+        if (!leaf->dirty) {
+            continue;
+        }
+
+        struct index_entry *entries = (struct index_entry *)buffer;
+        memset(buffer, 0x0, INDEX_PAGE_SIZE);
+        for (size_t i = 0; i < leaf->count; i++) {
+            entries[i].key = leaf->run->keys[i];
+            entries[i].page_number = leaf->run->page_numbers[i];
+        }
+        rc = fn(arg, (uint64_t)leaf->page * INDEX_PAGE_SIZE, buffer, INDEX_PAGE_SIZE);
+    }
+
+    // the header goes last, it tells where the root is
+    if (rc == 0 && idx->root_dirty) {
+        size_t root_size = idx->leaf_count * sizeof(struct index_root_entry);
+        struct index_root_entry *root = malloc(root_size ? root_size : 1);
+        if (root == NULL) {
+            free(buffer);
+            return -ENOMEM;
+        }
+
+        for (size_t l = 0; l < idx->leaf_count; l++) {
+            root[l] = (struct index_root_entry){ idx->first_keys[l], idx->leaves[l].count, idx->leaves[l].page };
+        }
+        rc = fn(arg, (uint64_t)idx->pages * INDEX_PAGE_SIZE, root, root_size);
+        free(root);
+
+        struct index_header header = { INDEX_MAGIC, INDEX_VERSION, idx->size, idx->leaf_count, idx->pages };
+        memset(buffer, 0x0, INDEX_PAGE_SIZE);
+        memcpy(buffer, &header, sizeof(header));
+        if (rc == 0) {
+            rc = fn(arg, 0, buffer, INDEX_PAGE_SIZE);
+        }
+    }
+
+    free(buffer);
+    return rc;
+}
+
+struct store_target {
+    int fd;
+    struct stats *stats;
+};
+
+static int write_part(void *arg, uint64_t offset, const void *data, size_t size)
+{
+    struct store_target *target = arg;
+
+    ssize_t written = io_write_at(target->fd, data, size, offset);
+    if (written != (ssize_t)size) {
+        return written < 0 ? written : -EIO;
+    }
+    stats_add(&target->stats->index_writes, 1);
+    stats_add(&target->stats->bytes_written, size);
+    return 0;
+}
+
+int index_store(struct index *idx, int fd)
+{
+    assert(idx != NULL);
+
+    struct store_target target = { fd, idx->stats };
+    int rc = index_visit_dirty(idx, write_part, &target);
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (size_t l = 0; l < idx->leaf_count; l++) {
+        idx->leaves[l].dirty = false;
+    }
+    idx->root_dirty = false;
+    idx->fd = fd;
+    return 0;
+}
+
+// Adds an empty leaf at l, its entries are in memory from the start
+static int insert_leaf(struct index *idx, size_t l)
+{
+    assert(idx != NULL);
+    assert(l <= idx->leaf_count);
+
+    int rc = reserve_leaves(idx, idx->leaf_count + 1);
+    if (rc != 0) {
+        return rc;
+    }
+
+    struct index_run *run = malloc(sizeof(struct index_run));
+    if (run == NULL) {
+        return -ENOMEM;
+    }
+
+    memmove(&idx->leaves[l+1], &idx->leaves[l], (idx->leaf_count - l) * sizeof(struct index_leaf));
+    memmove(&idx->first_keys[l+1], &idx->first_keys[l], (idx->leaf_count - l) * sizeof(int32_t));
+    idx->leaves[l] = (struct index_leaf){ .page = allocate_page(idx), .run = run, .dirty = true };
+    idx->leaf_count++;
+    idx->root_dirty = true;
+    tree_build(idx);
+    return 0;
+}
+
+int index_append(struct index *idx, int32_t key, uint64_t page_number)
+{
+    assert(idx != NULL);
+
+    if (idx->leaf_count == 0 || idx->leaves[idx->leaf_count - 1].count == INDEX_PAGE_ENTRIES) {
+        int rc = insert_leaf(idx, idx->leaf_count);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    size_t l = idx->leaf_count - 1;
+    struct index_leaf *leaf = &idx->leaves[l];
+    struct index_run *run = leaf_run(idx, l);
+    if (run == NULL) {
+        return -EIO;
+    }
+    assert(leaf->count == 0 || run->keys[leaf->count - 1] < key);
+
+    if (leaf->count == 0) {
+        idx->first_keys[l] = key;
+    }
+    run->keys[leaf->count] = key;
+    run->page_numbers[leaf->count] = page_number;
+    leaf->count++;
+    leaf->dirty = true;
+    tree_add(idx, l, 1);
+    idx->size++;
+    idx->root_dirty = true;
+    return 0;
+}
+
+// Moves the upper half of the full leaf l into a new leaf after it
+static int split_leaf(struct index *idx, size_t l)
+{
+    assert(idx != NULL);
+
+    struct index_run *run = leaf_run(idx, l);
+    if (run == NULL) {
+        return -EIO;
+    }
+
+    size_t half = idx->leaves[l].count / 2;
+    int rc = insert_leaf(idx, l + 1);
+    if (rc != 0) {
+        return rc;
+    }
+
+    struct index_leaf *leaf = &idx->leaves[l];
+    struct index_leaf *next = &idx->leaves[l + 1];
+    next->count = leaf->count - half;
+    memcpy(next->run->keys, &run->keys[half], next->count * sizeof(int32_t));
+    memcpy(next->run->page_numbers, &run->page_numbers[half], next->count * sizeof(uint64_t));
+    idx->first_keys[l + 1] = next->run->keys[0];
+    leaf->count = half;
+    leaf->dirty = true;
+    tree_build(idx);
+    return 0;
+}
+
+int index_insert(struct index *idx, size_t pos, int32_t key, uint64_t page_number)
+{
+    assert(idx != NULL);
+    assert(pos <= idx->size);
+
+    if (pos == idx->size) {
+        return index_append(idx, key, page_number);
+    }
+
+    size_t i;
+    size_t l = leaf_of(idx, pos, &i);
+    if (idx->leaves[l].count == INDEX_PAGE_ENTRIES) {
+        int rc = split_leaf(idx, l);
+        if (rc != 0) {
+            return rc;
+        }
+        if (i > idx->leaves[l].count) {
+            i -= idx->leaves[l].count;
+            l++;
+        }
+    }
+
+    struct index_leaf *leaf = &idx->leaves[l];
+    struct index_run *run = leaf_run(idx, l);
+    if (run == NULL) {
+        return -EIO;
+    }
+    assert(i == 0 || run->keys[i - 1] < key);
+    assert(i == leaf->count || key < run->keys[i]);
+
+    memmove(&run->keys[i+1], &run->keys[i], (leaf->count - i) * sizeof(int32_t));
+    memmove(&run->page_numbers[i+1], &run->page_numbers[i], (leaf->count - i) * sizeof(uint64_t));
+    run->keys[i] = key;
+    run->page_numbers[i] = page_number;
+    if (i == 0) {
+        idx->first_keys[l] = key;
+    }
+    leaf->count++;
+    leaf->dirty = true;
+    tree_add(idx, l, 1);
+    idx->size++;
+    idx->root_dirty = true;
+    return 0;
+}
+
+int index_remove(struct index *idx, size_t pos)
+{
+    assert(idx != NULL);
+    assert(pos < idx->size);
+
+    size_t i;
+    size_t l = leaf_of(idx, pos, &i);
+    struct index_leaf *leaf = &idx->leaves[l];
+    struct index_run *run = leaf_run(idx, l);
+    if (run == NULL) {
+        return -EIO;
+    }
+
+    memmove(&run->keys[i], &run->keys[i+1], (leaf->count - i - 1) * sizeof(int32_t));
+    memmove(&run->page_numbers[i], &run->page_numbers[i+1], (leaf->count - i - 1) * sizeof(uint64_t));
+    leaf->count--;
+    leaf->dirty = true;
+    if (i == 0 && leaf->count > 0) {
+        idx->first_keys[l] = run->keys[0];
+    }
+    tree_add(idx, l, -1);
+    idx->size--;
+    idx->root_dirty = true;
+
+    // an emptied leaf is dropped unless it is the only one
+    if (leaf->count == 0 && idx->leaf_count > 1) {
+        idx->free_pages[idx->free_count++] = leaf->page;
+        free(run);
+        memmove(&idx->leaves[l], &idx->leaves[l+1], (idx->leaf_count - l - 1) * sizeof(struct index_leaf));
+        memmove(&idx->first_keys[l], &idx->first_keys[l+1], (idx->leaf_count - l - 1) * sizeof(int32_t));
+        idx->leaf_count--;
+        tree_build(idx);
+    }
+
+    return 0;
+}
+
+void index_free(struct index *idx)
+{
+    assert(idx != NULL);
+
+    for (size_t l = 0; l < idx->leaf_count; l++) {
+        free(idx->leaves[l].run);
+    }
+    free(idx->leaves);
+    free(idx->first_keys);
+    free(idx->tree);
+    free(idx->free_pages);
+    memset(idx, 0x0, sizeof(struct index));
+    idx->fd = -1;
+}
+
+int index_lookup(struct index *idx, int32_t key, size_t *pos)
+{
+    assert(idx != NULL);
+    assert(idx->size > 0);
+    assert(pos != NULL);
+
+    // count the index pages and then the entries not greater than key, the searches work on key arrays
+    size_t leaves = idx->leaf_count;
+    if (key < INT32_MAX) {
+        leaves = search_lower_bound(idx->first_keys, idx->leaf_count, key + 1);
+    }
+    if (leaves == 0) {
+        *pos = 0;
+        return 0;
+    }
+
+    size_t l = leaves - 1;
+    struct index_run *run = leaf_run(idx, l);
+    if (run == NULL) {
+        return -EIO;
+    }
+
+    size_t count = idx->leaves[l].count;
+    if (key < INT32_MAX) {
+        count = search_lower_bound(run->keys, count, key + 1);
+    }
+
+    *pos = leaf_start(idx, l) + (count > 0 ? count - 1 : 0);
+    return 0;
+}
+
+int index_key(struct index *idx, size_t pos, int32_t *key)
+{
+    assert(idx != NULL);
+    assert(key != NULL);
+
+    size_t i;
+    struct index_run *run = leaf_run(idx, leaf_of(idx, pos, &i));
+    if (run == NULL) {
+        return -EIO;
+    }
+
+    *key = run->keys[i];
+    return 0;
+}
+
+uint64_t index_page_number(struct index *idx, size_t pos)
+{
+    assert(idx != NULL);
+
+    size_t i;
+    struct index_run *run = leaf_run(idx, leaf_of(idx, pos, &i));
+    if (run == NULL) {
+        return 0;
+    }
+
+    return run->page_numbers[i];
+}
+
+int index_set_key(struct index *idx, size_t pos, int32_t key)
+{
+    assert(idx != NULL);
+    assert(pos < idx->size);
+
+    size_t i;
+    size_t l = leaf_of(idx, pos, &i);
+    struct index_run *run = leaf_run(idx, l);
+    if (run == NULL) {
+        return -EIO;
+    }
+
+    run->keys[i] = key;
+    idx->leaves[l].dirty = true;
+    if (i == 0) {
+        idx->first_keys[l] = key;
+        idx->root_dirty = true;
+    }
+
+    return 0;
+}
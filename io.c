@@ -0,0 +1,140 @@
+#include <io.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void *io_alloc_aligned(size_t size)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, IO_ALIGNMENT, size ? size : IO_ALIGNMENT) != 0) {
+        return NULL;
+    }
+
+    memset(ptr, 0x0, size);
+    return ptr;
+}
+
+ssize_t io_read_at(int fd, void *buf, size_t count, off_t offset)
+{
+    assert(fd >= 0);
+    assert(buf != NULL);
+
+    size_t done = 0;
+    while (done < count) {
+        ssize_t rc = pread(fd, (char *)buf + done, count - done, offset + done);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (rc == 0) { // end of file
+            break;
+        }
+        done += rc;
+    }
+
+    return done;
+}
+
+ssize_t io_readv_at(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    assert(fd >= 0);
+    assert(iov != NULL);
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    ssize_t rc;
+    do {
+        rc = preadv(fd, iov, iovcnt, offset);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0) {
+        return -errno;
+    }
+
+    if ((size_t)rc == total || rc == 0) {
+        return rc;
+    }
+
+    // short read, continue buffer by buffer
+    size_t done = rc;
+    size_t skipped = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        if (skipped + len > done) {
+            size_t in_buffer = done - skipped;
+            ssize_t read = io_read_at(fd, (char *)iov[i].iov_base + in_buffer, len - in_buffer, offset + done);
+            if (read < 0) {
+                return read;
+            }
+            done += read;
+            if ((size_t)read < len - in_buffer) { // end of file
+                break;
+            }
+        }
+        skipped += len;
+    }
+
+    return done;
+}
+
+ssize_t io_write_at(int fd, const void *buf, size_t count, off_t offset)
+{
+    assert(fd >= 0);
+    assert(buf != NULL);
+
+    size_t done = 0;
+    while (done < count) {
+        ssize_t rc = pwrite(fd, (const char *)buf + done, count - done, offset + done);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += rc;
+    }
+
+    return done;
+}
+
+off_t io_file_size(int fd)
+{
+    assert(fd >= 0);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -errno;
+    }
+
+    return st.st_size;
+}
+
+int io_sync_dir(const char *path)
+{
+    assert(path != NULL);
+
+    const char *slash = strrchr(path, '/');
+    char *dir = (slash == NULL) ? strdup(".") : strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int rc = (fsync(fd) == 0) ? 0 : -errno;
+    close(fd);
+    return rc;
+}
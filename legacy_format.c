@@ -0,0 +1,325 @@
+#include <legacy_format.h>
+#include <io.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The files as LEGACY_FORMAT_VERSION wrote them, nothing here may change
+#define LEGACY_SUPERBLOCK_MAGIC 0x51534449 // "IDSQ"
+#define LEGACY_SUPERBLOCK_SIZE 4096
+#define LEGACY_INDEX_MAGIC 0x58444e49 // "INDX"
+#define LEGACY_INDEX_VERSION 1
+#define LEGACY_INDEX_PAGE_SIZE 4096
+#define LEGACY_INDEX_PAGE_ENTRIES (LEGACY_INDEX_PAGE_SIZE / sizeof(struct legacy_index_entry))
+#define LEGACY_OVERFLOW_PTR_NULL 0xdeaddead
+
+struct legacy_superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t clean;
+    uint32_t primary_pages;
+    uint32_t page_size;
+    uint32_t records_per_page;
+    uint32_t number_of_pages;
+    uint32_t free_page_head;
+    uint32_t overflow_page;
+    uint32_t overflow_page_fill;
+    uint32_t overflow_records;
+    uint32_t overflow_free_head;
+    uint64_t records;
+    uint64_t inserts;
+};
+
+struct legacy_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint32_t leaves;
+    uint32_t pages;
+};
+
+struct legacy_root_entry {
+    int32_t first_key;
+    uint32_t count;
+    uint32_t page;
+};
+
+struct legacy_index_entry {
+    int32_t key;
+    uint16_t page_number;
+} __attribute__((packed));
+
+// Followed by the keys, the overflow pointers, the slots and the payloads
+struct legacy_page_header {
+    uint16_t count;
+    uint16_t flags;
+    int32_t min_key;
+    int32_t max_key;
+    uint32_t overflow_head;
+    uint32_t chained;
+    uint32_t inserts;
+    uint32_t bucket;
+};
+
+// Overflow records, at byte offsets into the pages
+struct legacy_record {
+    uint8_t numbers[RECORD_LEN];
+    int32_t key;
+    uint32_t overflow_pointer;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct legacy_superblock) == 64, "struct legacy_superblock changed");
+_Static_assert(sizeof(struct legacy_index_header) == 24, "struct legacy_index_header changed");
+_Static_assert(sizeof(struct legacy_index_entry) == 6, "struct legacy_index_entry changed");
+_Static_assert(sizeof(struct legacy_page_header) == 28, "struct legacy_page_header changed");
+_Static_assert(sizeof(struct legacy_record) == 23, "struct legacy_record changed");
+
+// Bytes taken by a primary page, before padding to the page alignment
+static size_t legacy_layout_size(size_t capacity)
+{
+    size_t size = sizeof(struct legacy_page_header)
+                  + capacity * (sizeof(int32_t) + sizeof(uint32_t) + sizeof(uint16_t) + RECORD_LEN);
+    return (size + 7) / 8 * 8;
+}
+
+static int read_exactly(struct legacy_reader *reader, int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t read = io_read_at(fd, buf, count, offset);
+    if (read < 0) {
+        return read;
+    }
+    stats_add(&reader->stats->bytes_read, read);
+
+    return read == (ssize_t)count ? 0 : -EIO;
+}
+
+int legacy_reader_open(struct legacy_reader *reader, int index_fd, int data_fd, struct stats *stats)
+{
+    assert(reader != NULL);
+    assert(index_fd >= 0);
+    assert(data_fd >= 0);
+    assert(stats != NULL);
+
+    memset(reader, 0x0, sizeof(struct legacy_reader));
+    reader->index_fd = index_fd;
+    reader->data_fd = data_fd;
+    reader->chain = LEGACY_OVERFLOW_PTR_NULL;
+    reader->last_key = INT32_MIN;
+    reader->stats = stats;
+
+    struct legacy_superblock sb;
+    int rc = read_exactly(reader, data_fd, &sb, sizeof(sb), 0);
+    if (rc != 0 || sb.magic != LEGACY_SUPERBLOCK_MAGIC || sb.version != LEGACY_FORMAT_VERSION) {
+        fprintf(stderr, "The data file isn't in format version %d\n", LEGACY_FORMAT_VERSION);
+        return rc != 0 ? rc : -EINVAL;
+    }
+
+    if (!sb.clean) {
+        fprintf(stderr, "The files weren't closed cleanly, open and close them with use_wal first\n");
+        return -EINVAL;
+    }
+
+    if (sb.records_per_page == 0 || sb.records_per_page > UINT16_MAX
+        || sb.page_size < legacy_layout_size(sb.records_per_page)) {
+        fprintf(stderr, "The superblock has %u records per page and %u byte pages\n", sb.records_per_page,
+                sb.page_size);
+        return -EINVAL;
+    }
+    reader->page_size = sb.page_size;
+    reader->records_per_page = sb.records_per_page;
+    reader->pages = sb.number_of_pages;
+    reader->records = sb.records;
+
+    struct legacy_index_header header;
+    rc = read_exactly(reader, index_fd, &header, sizeof(header), 0);
+    if (rc != 0 || header.magic != LEGACY_INDEX_MAGIC || header.version != LEGACY_INDEX_VERSION
+        || header.pages == 0 || header.size != sb.primary_pages) {
+        fprintf(stderr, "The index file doesn't belong to the data file\n");
+        return rc != 0 ? rc : -EINVAL;
+    }
+
+    reader->root = malloc(header.leaves ? header.leaves * sizeof(struct legacy_root_entry) : 1);
+    reader->entries = malloc(LEGACY_INDEX_PAGE_SIZE);
+    reader->page = calloc(1, reader->page_size);
+    reader->overflow_page = malloc(reader->page_size);
+    if (reader->root == NULL || reader->entries == NULL || reader->page == NULL || reader->overflow_page == NULL) {
+        legacy_reader_close(reader);
+        return -ENOMEM;
+    }
+    reader->leaves = header.leaves;
+
+    rc = read_exactly(reader, index_fd, reader->root, header.leaves * sizeof(struct legacy_root_entry),
+                      (off_t)header.pages * LEGACY_INDEX_PAGE_SIZE);
+    stats_add(&stats->index_reads, 1);
+
+    uint64_t entries = 0;
+    for (size_t l = 0; l < reader->leaves && rc == 0; l++) {
+        if (reader->root[l].page == 0 || reader->root[l].page >= header.pages
+            || reader->root[l].count > LEGACY_INDEX_PAGE_ENTRIES) {
+            rc = -EINVAL;
+        }
+        entries += reader->root[l].count;
+    }
+    if (rc == 0 && entries != header.size) {
+        rc = -EINVAL;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "The root of the index file is damaged\n");
+        legacy_reader_close(reader);
+    }
+
+    return rc;
+}
+
+// Reads the next primary page of the index, -1 past the last one
+static int read_next_page(struct legacy_reader *reader)
+{
+    while (reader->entry == reader->entry_count) {
+        if (reader->leaf == reader->leaves) {
+            return -1;
+        }
+
+        const struct legacy_root_entry *leaf = &reader->root[reader->leaf++];
+        int rc = read_exactly(reader, reader->index_fd, reader->entries, LEGACY_INDEX_PAGE_SIZE,
+                              (off_t)leaf->page * LEGACY_INDEX_PAGE_SIZE);
+        if (rc != 0) {
+            return rc;
+        }
+        stats_add(&reader->stats->index_reads, 1);
+        reader->entry_count = leaf->count;
+        reader->entry = 0;
+    }
+
+    uint16_t page_number = reader->entries[reader->entry++].page_number;
+    if (page_number == 0 || page_number > reader->pages) {
+        fprintf(stderr, "The index points to page %u of %" PRIu64 "\n", page_number, reader->pages);
+        return -EINVAL;
+    }
+
+    off_t offset = LEGACY_SUPERBLOCK_SIZE + (off_t)(page_number - 1) * reader->page_size;
+    int rc = read_exactly(reader, reader->data_fd, reader->page, reader->page_size, offset);
+    if (rc != 0) {
+        return rc;
+    }
+    stats_add(&reader->stats->page_reads, 1);
+
+    struct legacy_page_header *header = (struct legacy_page_header *)reader->page;
+    if (header->count > reader->records_per_page) {
+        fprintf(stderr, "Page %u has %u records\n", page_number, header->count);
+        return -EINVAL;
+    }
+    reader->next = 0;
+    reader->chain = header->overflow_head;
+
+    return 0;
+}
+
+// Copies the record at pos of the primary page to r, *chain gets the chain following it
+static int read_page_record(struct legacy_reader *reader, size_t pos, struct record *r, uint32_t *chain)
+{
+    size_t capacity = reader->records_per_page;
+    size_t keys = sizeof(struct legacy_page_header);
+    size_t overflow = keys + capacity * sizeof(int32_t);
+    size_t slots = overflow + capacity * sizeof(uint32_t);
+    size_t payload = slots + capacity * sizeof(uint16_t);
+
+    uint16_t slot;
+    memcpy(&slot, reader->page + slots + pos * sizeof(uint16_t), sizeof(uint16_t));
+    if (slot >= capacity) {
+        return -EINVAL;
+    }
+
+    memcpy(&r->key, reader->page + keys + pos * sizeof(int32_t), sizeof(int32_t));
+    memcpy(chain, reader->page + overflow + pos * sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(r->numbers, reader->page + payload + slot * RECORD_LEN, RECORD_LEN);
+    return 0;
+}
+
+// Reads the chained record at byte offset ptr, keeping its page for the next one
+static int read_chain_record(struct legacy_reader *reader, uint32_t ptr, struct record *r, uint32_t *next)
+{
+    uint32_t page_number = ptr / reader->page_size + 1;
+    size_t offset = ptr % reader->page_size;
+    if (page_number > reader->pages || offset % sizeof(struct legacy_record) != 0
+        || offset / sizeof(struct legacy_record) >= reader->records_per_page) {
+        fprintf(stderr, "Overflow pointer %u is out of the file\n", ptr);
+        return -EINVAL;
+    }
+
+    if (page_number != reader->overflow_page_number) {
+        reader->overflow_page_number = 0;
+        off_t page_offset = LEGACY_SUPERBLOCK_SIZE + (off_t)(page_number - 1) * reader->page_size;
+        int rc = read_exactly(reader, reader->data_fd, reader->overflow_page, reader->page_size, page_offset);
+        if (rc != 0) {
+            return rc;
+        }
+        stats_add(&reader->stats->page_reads, 1);
+        reader->overflow_page_number = page_number;
+    }
+
+    struct legacy_record record;
+    memcpy(&record, reader->overflow_page + offset, sizeof(record));
+    stats_add(&reader->stats->overflow_reads, 1);
+
+    memcpy(r->numbers, record.numbers, RECORD_LEN);
+    r->key = record.key;
+    *next = record.overflow_pointer;
+    return 0;
+}
+
+int legacy_reader_next(struct legacy_reader *reader, struct record *r)
+{
+    assert(reader != NULL);
+    assert(r != NULL);
+
+    while (true) {
+        const struct legacy_page_header *header = (const struct legacy_page_header *)reader->page;
+        int rc;
+
+        // the chain before a record holds the keys below it
+        if (reader->chain != LEGACY_OVERFLOW_PTR_NULL) {
+            rc = read_chain_record(reader, reader->chain, r, &reader->chain);
+        } else if (reader->next < header->count) {
+            rc = read_page_record(reader, reader->next++, r, &reader->chain);
+        } else {
+            rc = read_next_page(reader);
+            if (rc == 0) {
+                continue;
+            }
+        }
+        if (rc != 0) {
+            return rc;
+        }
+
+        r->overflow_pointer = OVERFLOW_PTR_NULL;
+        if (r->key <= 1) {
+            continue; // the dummy record
+        }
+
+        // also stops chains that run in circles
+        if (r->key <= reader->last_key) {
+            fprintf(stderr, "Key %d follows key %d\n", r->key, reader->last_key);
+            return -EINVAL;
+        }
+        reader->last_key = r->key;
+        return 0;
+    }
+}
+
+void legacy_reader_close(struct legacy_reader *reader)
+{
+    assert(reader != NULL);
+
+    free(reader->root);
+    free(reader->entries);
+    free(reader->page);
+    free(reader->overflow_page);
+    reader->root = NULL;
+    reader->entries = NULL;
+    reader->page = NULL;
+    reader->overflow_page = NULL;
+}
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <record.h>
 #include <idx_seq_file.h>
 
@@ -19,7 +20,17 @@ int main () {
 	struct record zeroed = {};
 	memset(&zeroed, 0x0, RECORD_SIZE);
 
-	idx_seq_file_init(&file, "index.bin", "data.bin");
+	// files of an earlier run are opened again, converted first if they
+	// have an older format. prep.sh leaves empty ones.
+	struct stat st;
+	if (stat("data.bin", &st) == 0 && st.st_size > 0) {
+		if (idx_seq_file_upgrade("index.bin", "data.bin", NULL) != 0
+		    || idx_seq_file_open(&file, "index.bin", "data.bin", NULL) != 0) {
+			return 1;
+		}
+	} else {
+		idx_seq_file_init(&file, "index.bin", "data.bin");
+	}
 
 	bool running = true;
 	while (running) {
@@ -65,5 +76,7 @@ int main () {
 		printf("\n\n");
 	}
 
+	idx_seq_file_close(&file);
+
 	return 0;
 }
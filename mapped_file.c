@@ -0,0 +1,115 @@
+#include <mapped_file.h>
+#include <io.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int mapped_file_init(struct mapped_file *map, int fd)
+{
+    assert(map != NULL);
+    assert(fd >= 0);
+
+    memset(map, 0x0, sizeof(struct mapped_file));
+    map->fd = fd;
+
+    void *base = mmap(NULL, MAPPED_FILE_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Couldn't reserve address space for the mapping\n");
+        return -errno;
+    }
+
+    map->base = base;
+    map->reserved = MAPPED_FILE_RESERVE;
+
+    off_t size = io_file_size(fd);
+    if (size < 0) {
+        mapped_file_free(map, 0);
+        return size;
+    }
+
+    return mapped_file_ensure(map, size);
+}
+
+int mapped_file_ensure(struct mapped_file *map, size_t size)
+{
+    assert(map != NULL);
+    assert(map->base != NULL);
+
+    if (size <= map->mapped) {
+        return 0;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t new_size = (size + MAPPED_FILE_GROWTH - 1) / MAPPED_FILE_GROWTH * MAPPED_FILE_GROWTH;
+    new_size = (new_size + page - 1) / page * page;
+    if (new_size > map->reserved) {
+        fprintf(stderr, "File doesn't fit into the reserved address space\n");
+        return -EFBIG;
+    }
+
+    off_t file_size = io_file_size(map->fd);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    if ((size_t)file_size < new_size && ftruncate(map->fd, new_size) != 0) {
+        return -errno;
+    }
+
+    // map only the new part, right after the old one
+    void *addr = mmap(map->base + map->mapped, new_size - map->mapped, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, map->fd, map->mapped);
+    if (addr == MAP_FAILED) {
+        return -errno;
+    }
+
+    // prefetching threads read it without the lock growing the mapping takes
+    __atomic_store_n(&map->mapped, new_size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mapped_file_prefetch(struct mapped_file *map, size_t offset, size_t size)
+{
+    assert(map != NULL);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    size_t mapped = __atomic_load_n(&map->mapped, __ATOMIC_ACQUIRE);
+    if (start >= mapped) {
+        return;
+    }
+    if (offset + size > mapped) {
+        size = mapped - offset;
+    }
+
+    madvise(map->base + start, offset + size - start, MADV_WILLNEED);
+}
+
+int mapped_file_sync(struct mapped_file *map)
+{
+    assert(map != NULL);
+
+    if (map->mapped > 0 && msync(map->base, map->mapped, MS_SYNC) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+void mapped_file_free(struct mapped_file *map, size_t size)
+{
+    assert(map != NULL);
+
+    if (map->base == NULL) {
+        return;
+    }
+
+    munmap(map->base, map->reserved);
+    if (map->mapped > 0 && ftruncate(map->fd, size) != 0) {
+        fprintf(stderr, "Couldn't truncate the mapped file\n");
+    }
+    memset(map, 0x0, sizeof(struct mapped_file));
+}
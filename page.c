@@ -0,0 +1,130 @@
+#include <page.h>
+#include <search.h>
+#include <assert.h>
+#include <string.h>
+
+void page_layout_init(struct page_layout *layout, size_t capacity)
+{
+    assert(layout != NULL);
+    assert(capacity > 0 && capacity <= UINT16_MAX);
+
+    layout->capacity = capacity;
+    layout->overflow = sizeof(struct page_header);
+    layout->keys = layout->overflow + capacity * sizeof(uint64_t);
+    layout->slots = layout->keys + capacity * sizeof(int32_t);
+    layout->payload = layout->slots + capacity * sizeof(uint16_t);
+
+    // pages follow each other in frames and mappings, keep the arrays aligned
+    size_t size = layout->payload + capacity * RECORD_LEN;
+    layout->size = (size + 7) / 8 * 8;
+}
+
+void page_format(const struct page_layout *layout, void *page)
+{
+    assert(layout != NULL);
+    assert(page != NULL);
+
+    memset(page, 0x0, layout->size);
+    page_header(page)->overflow_head = OVERFLOW_PTR_NULL;
+
+    uint16_t *slots = page_slots(layout, page);
+    for (size_t i = 0; i < layout->capacity; i++) {
+        slots[i] = i;
+    }
+}
+
+static void page_update_bounds(const struct page_layout *layout, void *page)
+{
+    struct page_header *header = page_header(page);
+    int32_t *keys = page_keys(layout, page);
+
+    header->min_key = header->count ? keys[0] : 0;
+    header->max_key = header->count ? keys[header->count - 1] : 0;
+}
+
+size_t page_lower_bound(const struct page_layout *layout, void *page, int32_t key)
+{
+    assert(layout != NULL);
+    assert(page != NULL);
+
+    return search_lower_bound(page_keys(layout, page), page_header(page)->count, key);
+}
+
+void page_get(const struct page_layout *layout, void *page, size_t pos, struct record *r)
+{
+    assert(layout != NULL);
+    assert(page != NULL);
+    assert(r != NULL);
+    assert(pos < page_header(page)->count);
+
+    r->key = page_keys(layout, page)[pos];
+    r->overflow_pointer = page_overflow(layout, page)[pos];
+    memcpy(r->numbers, page_payload(layout, page, pos), RECORD_LEN);
+}
+
+void page_insert(const struct page_layout *layout, void *page, size_t pos, const struct record *r)
+{
+    assert(layout != NULL);
+    assert(page != NULL);
+    assert(r != NULL);
+
+    struct page_header *header = page_header(page);
+    int32_t *keys = page_keys(layout, page);
+    uint64_t *overflow = page_overflow(layout, page);
+    uint16_t *slots = page_slots(layout, page);
+    size_t count = header->count;
+    assert(count < layout->capacity);
+    assert(pos <= count);
+
+    uint16_t slot = slots[count];
+    memmove(&keys[pos+1], &keys[pos], (count - pos) * sizeof(int32_t));
+    memmove(&overflow[pos+1], &overflow[pos], (count - pos) * sizeof(uint64_t));
+    memmove(&slots[pos+1], &slots[pos], (count - pos) * sizeof(uint16_t));
+
+    keys[pos] = r->key;
+    overflow[pos] = r->overflow_pointer;
+    slots[pos] = slot;
+    memcpy(page_payload(layout, page, pos), r->numbers, RECORD_LEN);
+
+    header->count++;
+    page_update_bounds(layout, page);
+}
+
+void page_replace(const struct page_layout *layout, void *page, size_t pos, const struct record *r)
+{
+    assert(layout != NULL);
+    assert(page != NULL);
+    assert(r != NULL);
+    assert(pos < page_header(page)->count);
+
+    page_keys(layout, page)[pos] = r->key;
+    page_overflow(layout, page)[pos] = r->overflow_pointer;
+    memcpy(page_payload(layout, page, pos), r->numbers, RECORD_LEN);
+    page_update_bounds(layout, page);
+}
+
+void page_remove(const struct page_layout *layout, void *page, size_t pos)
+{
+    assert(layout != NULL);
+    assert(page != NULL);
+
+    struct page_header *header = page_header(page);
+    int32_t *keys = page_keys(layout, page);
+    uint64_t *overflow = page_overflow(layout, page);
+    uint16_t *slots = page_slots(layout, page);
+    size_t count = header->count;
+    assert(pos < count);
+
+    // the payload stays where it is, its slot is handed back
+    uint16_t slot = slots[pos];
+    memmove(&keys[pos], &keys[pos+1], (count - pos - 1) * sizeof(int32_t));
+    memmove(&overflow[pos], &overflow[pos+1], (count - pos - 1) * sizeof(uint64_t));
+    memmove(&slots[pos], &slots[pos+1], (count - pos - 1) * sizeof(uint16_t));
+
+    keys[count-1] = 0;
+    overflow[count-1] = 0;
+    slots[count-1] = slot;
+
+    header->count--;
+    page_update_bounds(layout, page);
+}
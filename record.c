@@ -1,4 +1,5 @@
 #include <record.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <assert.h>
 
@@ -9,5 +10,5 @@ void record_print(struct record *r)
     for (size_t i = 0; i < RECORD_LEN; i++) {
         printf("%hhu ", r->numbers[i]);
     }
-    printf("\n\tPointer: %u\n", r->overflow_pointer);
+    printf("\n\tPointer: %" PRIu64 "\n", r->overflow_pointer);
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include <reorganize_policy.h>
+#include <assert.h>
+#include <string.h>
+
+double reorganize_mean_chain(const struct reorganize_stats *stats)
+{
+    assert(stats != NULL);
+
+    return stats->primary_pages ? (double)stats->overflow_records / stats->primary_pages : 0;
+}
+
+double reorganize_read_amplification(const struct reorganize_stats *stats)
+{
+    assert(stats != NULL);
+
+    return stats->gets ? (double)stats->get_overflow_reads / stats->gets : 0;
+}
+
+double reorganize_write_rate(const struct reorganize_stats *stats)
+{
+    assert(stats != NULL);
+
+    return stats->elapsed_ns ? stats->writes / (stats->elapsed_ns / 1e9) : 0;
+}
+
+bool reorganize_ratio_policy(void *arg, const struct reorganize_stats *stats)
+{
+    (void)arg;
+    assert(stats != NULL);
+
+    // compare record slots rather than bytes, primary pages may be padded
+    double a = (double)stats->overflow_records;
+    double b = (double)(stats->primary_pages * stats->records_per_page);
+
+    return a / (a+b) > stats->beta;
+}
+
+bool reorganize_cost_policy(void *arg, const struct reorganize_stats *stats)
+{
+    (void)arg;
+    assert(stats != NULL);
+
+    if (stats->overflow_records == 0) {
+        return false;
+    }
+
+    /* Every overflow record read is a page pin the rewritten file won't
+     * need. Paying for the rewrite once the reads since the last one add up
+     * to its cost never costs more than twice as much as knowing the future
+     * would, whether the calls are mostly reads or mostly writes. */
+    return stats->overflow_reads >= stats->rewrite_pages;
+}
+
+reorganize_policy_fn reorganize_policy(const char *name)
+{
+    assert(name != NULL);
+
+    if (strcmp(name, "ratio") == 0) {
+        return reorganize_ratio_policy;
+    }
+    if (strcmp(name, "cost") == 0) {
+        return reorganize_cost_policy;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,128 @@
+#include <search.h>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+// Arrays up to this length are counted whole, a few cache lines at most
+#define SEARCH_WINDOW 64
+
+size_t search_count_less_scalar(const int32_t *keys, size_t n, int32_t key)
+{
+    assert(keys != NULL || n == 0);
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += (keys[i] < key);
+    }
+
+    return count;
+}
+
+#ifdef SEARCH_X86
+static size_t search_count_less_sse2(const int32_t *keys, size_t n, int32_t key)
+{
+    assert(keys != NULL || n == 0);
+
+    // every lane of a comparison is -1 for a smaller key, subtracting counts them
+    __m128i needle = _mm_set1_epi32(key);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&keys[i]);
+        acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(needle, v));
+    }
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    size_t count = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    return count + search_count_less_scalar(keys + i, n - i, key);
+}
+
+__attribute__((target("avx2")))
+static size_t search_count_less_avx2(const int32_t *keys, size_t n, int32_t key)
+{
+    assert(keys != NULL || n == 0);
+
+    __m256i needle = _mm256_set1_epi32(key);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&keys[i]);
+        acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(needle, v));
+    }
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    size_t count = 0;
+    for (size_t j = 0; j < 8; j++) {
+        count += lanes[j];
+    }
+
+    return count + search_count_less_scalar(keys + i, n - i, key);
+}
+#endif
+
+search_kernel_fn search_kernel(const char *name)
+{
+    assert(name != NULL);
+
+    if (strcmp(name, "scalar") == 0) {
+        return search_count_less_scalar;
+    }
+
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        return search_count_less_sse2;
+    }
+
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return search_count_less_avx2;
+    }
+#endif
+
+    return NULL;
+}
+
+static size_t search_count_less_resolve(const int32_t *keys, size_t n, int32_t key);
+
+static search_kernel_fn search_best = search_count_less_resolve;
+
+static size_t search_count_less_resolve(const int32_t *keys, size_t n, int32_t key)
+{
+    const char *names[] = { "avx2", "sse2", "scalar" };
+
+    search_kernel_fn kernel = NULL;
+    for (size_t i = 0; kernel == NULL; i++) {
+        kernel = search_kernel(names[i]);
+    }
+
+    // every thread resolves to the same kernel, a race only repeats the work
+    __atomic_store_n(&search_best, kernel, __ATOMIC_RELAXED);
+    return kernel(keys, n, key);
+}
+
+size_t search_count_less(const int32_t *keys, size_t n, int32_t key)
+{
+    return __atomic_load_n(&search_best, __ATOMIC_RELAXED)(keys, n, key);
+}
+
+size_t search_lower_bound(const int32_t *keys, size_t n, int32_t key)
+{
+    assert(keys != NULL || n == 0);
+
+    // branchless binary search, the first key >= key stays in [base, base + n]
+    size_t base = 0;
+    while (n > SEARCH_WINDOW) {
+        size_t half = n / 2;
+        base = (keys[base + half - 1] < key) ? base + half : base;
+        n -= half;
+    }
+
+    return base + search_count_less(keys + base, n, key);
+}
@@ -0,0 +1,195 @@
+#include <stats.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+// snapshots and resets go over the counters as an array
+_Static_assert(sizeof(struct stats) % sizeof(uint64_t) == 0, "struct stats has to hold only uint64_t");
+
+#define STATS_WORDS (sizeof(struct stats) / sizeof(uint64_t))
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t ns)
+{
+    size_t bucket = 63 - __builtin_clzll(ns | 1);
+    return bucket < STATS_LATENCY_BUCKETS ? bucket : STATS_LATENCY_BUCKETS - 1;
+}
+
+void stats_record_latency(struct stats *stats, enum stats_op op, uint64_t start_ns)
+{
+    assert(stats != NULL);
+    assert(op < STATS_OPS);
+
+    uint64_t ns = stats_now() - start_ns;
+    struct stats_histogram *histogram = &stats->latency[op];
+    stats_add(&histogram->count, 1);
+    stats_add(&histogram->total_ns, ns);
+    stats_add(&histogram->buckets[latency_bucket(ns)], 1);
+
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, true, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED)) {
+    }
+}
+
+void stats_record_chain(struct stats *stats, size_t length)
+{
+    assert(stats != NULL);
+
+    size_t bucket = length < STATS_CHAIN_BUCKETS ? length : STATS_CHAIN_BUCKETS - 1;
+    stats_add(&stats->chain_lengths[bucket], 1);
+}
+
+void stats_snapshot(const struct stats *stats, struct stats *out)
+{
+    assert(stats != NULL);
+    assert(out != NULL);
+
+    const uint64_t *src = (const uint64_t *)stats;
+    uint64_t *dst = (uint64_t *)out;
+    for (size_t i = 0; i < STATS_WORDS; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+void stats_reset(struct stats *stats)
+{
+    assert(stats != NULL);
+
+    uint64_t *words = (uint64_t *)stats;
+    for (size_t i = 0; i < STATS_WORDS; i++) {
+        __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+const char *stats_op_name(enum stats_op op)
+{
+    static const char *names[STATS_OPS] = {
+        [STATS_OP_GET] = "get",
+        [STATS_OP_GET_BATCH] = "get_batch",
+        [STATS_OP_ADD] = "add",
+        [STATS_OP_ADD_BATCH] = "add_batch",
+        [STATS_OP_DELETE] = "delete",
+        [STATS_OP_SCAN] = "scan",
+        [STATS_OP_BULK_LOAD] = "bulk_load",
+        [STATS_OP_REORGANIZE_STEP] = "reorganize_step",
+        [STATS_OP_SYNC] = "sync",
+    };
+
+    assert(op < STATS_OPS);
+    return names[op];
+}
+
+uint64_t stats_percentile(const struct stats_histogram *histogram, double p)
+{
+    assert(histogram != NULL);
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * histogram->count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            uint64_t bound = (i + 1 < 64) ? (UINT64_C(1) << (i + 1)) - 1 : UINT64_MAX;
+            return bound < histogram->max_ns ? bound : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+// The counters in front of the arrays, in declaration order
+static const struct {
+    const char *name;
+    size_t offset;
+} counters[] = {
+    { "page_reads", offsetof(struct stats, page_reads) },
+    { "page_writes", offsetof(struct stats, page_writes) },
+    { "overflow_reads", offsetof(struct stats, overflow_reads) },
+    { "overflow_writes", offsetof(struct stats, overflow_writes) },
+    { "index_reads", offsetof(struct stats, index_reads) },
+    { "index_writes", offsetof(struct stats, index_writes) },
+    { "bytes_read", offsetof(struct stats, bytes_read) },
+    { "bytes_written", offsetof(struct stats, bytes_written) },
+    { "reorganizations", offsetof(struct stats, reorganizations) },
+    { "reorganize_ns", offsetof(struct stats, reorganize_ns) },
+    { "log_bytes", offsetof(struct stats, log_bytes) },
+    { "log_syncs", offsetof(struct stats, log_syncs) },
+    { "checkpoints", offsetof(struct stats, checkpoints) },
+};
+
+static uint64_t counter(const struct stats *stats, size_t i)
+{
+    return *(const uint64_t *)((const uint8_t *)stats + counters[i].offset);
+}
+
+void stats_print_text(const struct stats *stats, FILE *out)
+{
+    assert(stats != NULL);
+    assert(out != NULL);
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(out, "%s %" PRIu64 "\n", counters[i].name, counter(stats, i));
+    }
+
+    fprintf(out, "chain_lengths");
+    for (size_t i = 0; i < STATS_CHAIN_BUCKETS; i++) {
+        fprintf(out, " %" PRIu64, stats->chain_lengths[i]);
+    }
+    fprintf(out, "\n");
+
+    for (size_t op = 0; op < STATS_OPS; op++) {
+        const struct stats_histogram *h = &stats->latency[op];
+        if (h->count == 0) {
+            continue;
+        }
+        fprintf(out, "latency %s count %" PRIu64 " mean_ns %" PRIu64 " p50_ns %" PRIu64 " p90_ns %" PRIu64
+                " p99_ns %" PRIu64 " max_ns %" PRIu64 "\n", stats_op_name(op), h->count, h->total_ns / h->count,
+                stats_percentile(h, 0.5), stats_percentile(h, 0.9), stats_percentile(h, 0.99), h->max_ns);
+    }
+}
+
+static void print_json_array(const uint64_t *values, size_t n, FILE *out)
+{
+    fprintf(out, "[");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "%s%" PRIu64, i ? "," : "", values[i]);
+    }
+    fprintf(out, "]");
+}
+
+void stats_print_json(const struct stats *stats, FILE *out)
+{
+    assert(stats != NULL);
+    assert(out != NULL);
+
+    fprintf(out, "{");
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(out, "\"%s\":%" PRIu64 ",", counters[i].name, counter(stats, i));
+    }
+
+    fprintf(out, "\"chain_lengths\":");
+    print_json_array(stats->chain_lengths, STATS_CHAIN_BUCKETS, out);
+
+    fprintf(out, ",\"latency\":{");
+    for (size_t op = 0; op < STATS_OPS; op++) {
+        const struct stats_histogram *h = &stats->latency[op];
+        fprintf(out, "%s\"%s\":{\"count\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64
+                ",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"buckets\":",
+                op ? "," : "", stats_op_name(op), h->count, h->total_ns, h->max_ns, stats_percentile(h, 0.5),
+                stats_percentile(h, 0.9), stats_percentile(h, 0.99));
+        print_json_array(h->buckets, STATS_LATENCY_BUCKETS, out);
+        fprintf(out, "}");
+    }
+    fprintf(out, "}}\n");
+}
@@ -0,0 +1,402 @@
+#include <wal.h>
+#include <io.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t size)
+{
+    // a nibble at a time, the log isn't checksummed often enough for a bigger table
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+    }
+
+    return crc;
+}
+
+static uint32_t record_checksum(const struct wal_record_header *header, const struct iovec *iov, int iovcnt)
+{
+    uint32_t crc = crc32_update(~0u, header, offsetof(struct wal_record_header, checksum));
+    for (int i = 0; i < iovcnt; i++) {
+        crc = crc32_update(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    return ~crc;
+}
+
+static char *log_tmp_path(const char *path)
+{
+    const char *suffix = ".tmp";
+    char *tmp = malloc(strlen(path) + strlen(suffix) + 1);
+    if (tmp == NULL) {
+        return NULL;
+    }
+
+    strcpy(tmp, path);
+    strcat(tmp, suffix);
+    return tmp;
+}
+
+int wal_open(struct wal *wal, const char *path, size_t group_commit, struct stats *stats)
+{
+    assert(wal != NULL);
+    assert(path != NULL);
+    assert(stats != NULL);
+
+    memset(wal, 0x0, sizeof(struct wal));
+    wal->fd = -1;
+    wal->group_commit = group_commit ? group_commit : 1;
+    wal->stats = stats;
+
+    wal->path = strdup(path);
+    if (wal->path == NULL) {
+        return -ENOMEM;
+    }
+
+    wal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (wal->fd < 0) {
+        fprintf(stderr, "Couldn't open file: %s\n", path);
+        free(wal->path);
+        wal->path = NULL;
+        return -EIO;
+    }
+
+    off_t size = io_file_size(wal->fd);
+    if (size < 0) {
+        close(wal->fd);
+        free(wal->path);
+        wal->fd = -1;
+        wal->path = NULL;
+        return size;
+    }
+    wal->written = size;
+    wal->durable = size;
+
+    // commits wait for their group with a timeout, the clock mustn't jump
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->flushed, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+void wal_close(struct wal *wal)
+{
+    assert(wal != NULL);
+
+    if (wal->fd < 0) {
+        return;
+    }
+
+    if (wal_flush(wal) != 0) {
+        fprintf(stderr, "Couldn't write the log: %s\n", wal->path);
+    }
+
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->flushed);
+    free(wal->buffer);
+    free(wal->spare);
+    free(wal->path);
+    memset(wal, 0x0, sizeof(struct wal));
+    wal->fd = -1;
+}
+
+static int reserve(uint8_t **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while (new_capacity < size) {
+        new_capacity *= 2;
+    }
+
+    uint8_t *data = realloc(*buffer, new_capacity);
+    if (data == NULL) {
+        return -ENOMEM;
+    }
+
+    *buffer = data;
+    *capacity = new_capacity;
+    return 0;
+}
+
+int wal_append(struct wal *wal, uint16_t type, const struct iovec *iov, int iovcnt)
+{
+    assert(wal != NULL);
+    assert(wal->fd >= 0);
+
+    struct wal_record_header header = {};
+    header.type = type;
+    for (int i = 0; i < iovcnt; i++) {
+        header.size += iov[i].iov_len;
+    }
+    header.checksum = record_checksum(&header, iov, iovcnt);
+
+    pthread_mutex_lock(&wal->lock);
+    int rc = wal->error;
+    if (rc == 0) {
+        rc = reserve(&wal->buffer, &wal->capacity, wal->buffered + sizeof(header) + header.size);
+    }
+    if (rc != 0) {
+        wal->error = rc;
+        pthread_mutex_unlock(&wal->lock);
+        return rc;
+    }
+
+    memcpy(wal->buffer + wal->buffered, &header, sizeof(header));
+    wal->buffered += sizeof(header);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(wal->buffer + wal->buffered, iov[i].iov_base, iov[i].iov_len);
+        wal->buffered += iov[i].iov_len;
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    return 0;
+}
+
+// Writes and syncs the log up to end, called with the lock held
+static int flush_to(struct wal *wal, uint64_t end)
+{
+    while (wal->error == 0 && wal->durable < end) {
+        if (wal->flushing) {
+            // the next sync takes whatever got appended in the meantime along
+            pthread_cond_wait(&wal->flushed, &wal->lock);
+            continue;
+        }
+
+        // appends go to the other buffer while this one is written
+        uint8_t *data = wal->buffer;
+        size_t size = wal->buffered;
+        size_t capacity = wal->capacity;
+        uint64_t offset = wal->written - wal->start;
+        wal->buffer = wal->spare;
+        wal->capacity = wal->spare_capacity;
+        wal->spare = data;
+        wal->spare_capacity = capacity;
+        wal->buffered = 0;
+        wal->written += size;
+        uint64_t target = wal->written;
+        wal->pending = 0; // their records are all in this write
+        wal->flushing = true;
+        pthread_mutex_unlock(&wal->lock);
+
+        int rc = 0;
+        if (size > 0) {
+            ssize_t written = io_write_at(wal->fd, data, size, offset);
+            if (written != (ssize_t)size) {
+                rc = written < 0 ? written : -EIO;
+            }
+        }
+        if (rc == 0 && fdatasync(wal->fd) != 0) {
+            rc = -errno;
+        }
+        stats_add(&wal->stats->log_bytes, size);
+        stats_add(&wal->stats->log_syncs, 1);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->flushing = false;
+        if (rc == 0) {
+            wal->durable = target;
+        } else {
+            wal->error = rc;
+        }
+        pthread_cond_broadcast(&wal->flushed);
+    }
+
+    return wal->error;
+}
+
+int wal_commit(struct wal *wal, size_t n)
+{
+    assert(wal != NULL);
+
+    pthread_mutex_lock(&wal->lock);
+    uint64_t lsn = wal->written + wal->buffered;
+    wal->pending += n;
+    if (wal->pending < wal->group_commit) {
+        // the commit filling the group syncs for all of it, or the first one tired of waiting
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += WAL_GROUP_COMMIT_WAIT_US * 1000l;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000l;
+        deadline.tv_nsec %= 1000000000l;
+        while (wal->error == 0 && wal->durable < lsn) {
+            if (pthread_cond_timedwait(&wal->flushed, &wal->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    int rc = flush_to(wal, lsn);
+    pthread_mutex_unlock(&wal->lock);
+
+    return rc;
+}
+
+int wal_flush(struct wal *wal)
+{
+    assert(wal != NULL);
+
+    pthread_mutex_lock(&wal->lock);
+    int rc = flush_to(wal, wal->written + wal->buffered);
+    pthread_mutex_unlock(&wal->lock);
+
+    return rc;
+}
+
+uint64_t wal_size(struct wal *wal)
+{
+    assert(wal != NULL);
+
+    pthread_mutex_lock(&wal->lock);
+    uint64_t size = wal->written - wal->start + wal->buffered;
+    pthread_mutex_unlock(&wal->lock);
+
+    return size;
+}
+
+int wal_reset(struct wal *wal, const void *state, size_t state_size, const void *tail, size_t tail_size)
+{
+    assert(wal != NULL);
+    assert(state != NULL);
+    assert(tail != NULL || tail_size == 0);
+
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushing) {
+        pthread_cond_wait(&wal->flushed, &wal->lock);
+    }
+    assert(wal->buffered == 0);
+
+    int rc = wal->error;
+    char *tmp = log_tmp_path(wal->path);
+    if (rc == 0 && tmp == NULL) {
+        rc = -ENOMEM;
+    }
+
+    // the new log is complete before it replaces the old one
+    int fd = -1;
+    if (rc == 0) {
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Couldn't create file: %s\n", tmp);
+            rc = -EIO;
+        }
+    }
+
+    struct wal_record_header header = {};
+    header.type = WAL_STATE;
+    header.size = state_size;
+    struct iovec iov[3] = {
+        { &header, sizeof(header) },
+        { (void *)state, state_size },
+        { (void *)tail, tail_size },
+    };
+    header.checksum = record_checksum(&header, &iov[1], 1);
+    size_t size = sizeof(header) + state_size + tail_size;
+
+    if (rc == 0) {
+        ssize_t written = pwritev(fd, iov, 3, 0);
+        if (written != (ssize_t)size) {
+            rc = written < 0 ? -errno : -EIO;
+        }
+    }
+    if (rc == 0 && fsync(fd) != 0) {
+        rc = -errno;
+    }
+    if (rc == 0 && rename(tmp, wal->path) != 0) {
+        rc = -errno;
+    }
+    if (rc == 0) {
+        rc = io_sync_dir(wal->path);
+    }
+
+    if (rc == 0) {
+        // positions keep growing, a commit waiting for the old log finds it durable
+        close(wal->fd);
+        wal->fd = fd;
+        wal->start = wal->written;
+        wal->written += size;
+        wal->durable = wal->written;
+        wal->pending = 0;
+        pthread_cond_broadcast(&wal->flushed);
+        stats_add(&wal->stats->log_bytes, size);
+        stats_add(&wal->stats->log_syncs, 1);
+    } else if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    free(tmp);
+    return rc;
+}
+
+int wal_read(struct wal *wal, uint8_t **data, size_t *size)
+{
+    assert(wal != NULL);
+    assert(data != NULL);
+    assert(size != NULL);
+
+    off_t file_size = io_file_size(wal->fd);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    *data = malloc(file_size ? file_size : 1);
+    if (*data == NULL) {
+        return -ENOMEM;
+    }
+
+    ssize_t read = io_read_at(wal->fd, *data, file_size, 0);
+    if (read != file_size) {
+        free(*data);
+        *data = NULL;
+        return read < 0 ? read : -EIO;
+    }
+
+    *size = file_size;
+    return 0;
+}
+
+bool wal_next(const uint8_t *data, size_t size, size_t *pos, struct wal_record_header *header, const uint8_t **payload)
+{
+    assert(data != NULL || size == 0);
+    assert(pos != NULL);
+    assert(header != NULL);
+    assert(payload != NULL);
+
+    if (*pos > size || size - *pos < sizeof(struct wal_record_header)) {
+        return false;
+    }
+
+    memcpy(header, data + *pos, sizeof(struct wal_record_header));
+    if (header->size > size - *pos - sizeof(struct wal_record_header)) {
+        return false;
+    }
+
+    struct iovec iov = { (void *)(data + *pos + sizeof(struct wal_record_header)), header->size };
+    if (record_checksum(header, &iov, 1) != header->checksum) {
+        return false;
+    }
+
+    *payload = iov.iov_base;
+    *pos += sizeof(struct wal_record_header) + header->size;
+    return true;
+}